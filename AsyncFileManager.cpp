@@ -0,0 +1,282 @@
+#include "AsyncFileManager.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+AsyncFileManager::AsyncFileManager(int engine, int queueDepth) : FileManager(), _requestedEngine(engine), _engine(engine), _queueDepth(queueDepth), _ringFd(-1), _inFlight(0), _reaping(false), _workers(0), _workerCount(0), _stop(false){
+    if (_queueDepth < 1) _queueDepth = 1;
+    pthread_mutex_init(&_lock, 0);
+    pthread_cond_init(&_completed, 0);
+    pthread_cond_init(&_queued, 0);
+}
+
+AsyncFileManager::~AsyncFileManager(){
+    closeFile();
+    pthread_cond_destroy(&_queued);
+    pthread_cond_destroy(&_completed);
+    pthread_mutex_destroy(&_lock);
+}
+
+bool AsyncFileManager::asynchronous() const{
+    return true;
+}
+
+/* Requests still in flight must have been waited for */
+void AsyncFileManager::closeFile(){
+    if (!_fd) return;
+    stop_p();
+    FileManager::closeFile();
+}
+
+void AsyncFileManager::createFile(const char *fileName, int blockSize){
+    if (_fd) closeFile();
+    FileManager::createFile(fileName, blockSize);
+    if (_requestedEngine != ENGINE_RING || !startRing_p()) startThreads_p();
+}
+
+/* The engine in use, ENGINE_THREADS when io_uring could not be set up */
+int AsyncFileManager::engine() const{
+    return _engine;
+}
+
+void AsyncFileManager::openFile(const char *fileName){
+    if (_fd) closeFile();
+    FileManager::openFile(fileName);
+    if (_requestedEngine != ENGINE_RING || !startRing_p()) startThreads_p();
+}
+
+void AsyncFileManager::submit(FileRequest *requests, int count){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < count; i ++) requests[i].done = false;
+    if (_engine == ENGINE_THREADS){
+        for (int i = 0; i < count; i ++) _queue.push_back(&requests[i]);
+        pthread_cond_broadcast(&_queued);
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)_sqes;
+    for (int i = 0; i < count; ){
+        /* Never more requests in flight than the completion ring holds */
+        while (_inFlight == _cqEntries) reap_p();
+        unsigned tail = *_sqTail, queued = 0;
+        while (i < count && queued < _sqEntries && _inFlight < _cqEntries){
+            unsigned idx = (tail + queued) & *_sqMask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe -> opcode = requests[i].type == REQUEST_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe -> fd = _fd;
+            sqe -> off = requests[i].position;
+            sqe -> addr = (unsigned long)requests[i].data;
+            sqe -> len = _blockSize;
+            sqe -> user_data = (unsigned long)&requests[i];
+            _sqArray[idx] = idx;
+            queued ++;
+            _inFlight ++;
+            i ++;
+        }
+        __atomic_store_n(_sqTail, tail + queued, __ATOMIC_RELEASE);
+        /* Everything the kernel has not taken yet goes in, that of another thread too while it was reaping */
+        for (;;){
+            unsigned pending = *_sqTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+            if (!pending) break;
+            long n = syscall(__NR_io_uring_enter, _ringFd, pending, 0, 0, 0, 0);
+            if (n >= 0 || errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) reap_p();
+            else {
+                takeBack_p();
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+/* Returns once every request has completed */
+void AsyncFileManager::wait(FileRequest *requests, int count){
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < count; i ++){
+        while (!requests[i].done){
+            if (_engine == ENGINE_THREADS) pthread_cond_wait(&_completed, &_lock);
+            else reap_p();
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+/* Called with the lock held */
+void AsyncFileManager::complete_p(FileRequest *request, long result){
+    request -> result = result;
+    request -> done = true;
+}
+
+/* Runs a request synchronously, without the lock; past the end of file reads see zeros and a result short of a block */
+void AsyncFileManager::execute_p(FileRequest *request){
+    if (request -> type == REQUEST_READ){
+        request -> result = read_p(request -> data, _blockSize, request -> position);
+        return;
+    }
+    long done = 0;
+    while (done < _blockSize){
+        long n = pwrite(_fd, request -> data + done, _blockSize - done, request -> position + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    request -> result = done;
+}
+
+/* Runs requests the ring did not do, without the lock, then completes them; called with the lock held */
+void AsyncFileManager::executeAll_p(std::vector <FileRequest *> &requests){
+    if (requests.empty()) return;
+    pthread_mutex_unlock(&_lock);
+    for (int i = 0; i < (int)requests.size(); i ++) execute_p(requests[i]);
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < (int)requests.size(); i ++) complete_p(requests[i], requests[i] -> result);
+    _inFlight -= requests.size();
+    pthread_cond_broadcast(&_completed);
+}
+
+/*
+ * Waits for at least one completion and hands out everything the completion
+ * ring holds. Only one thread waits in the kernel at a time, the others wait
+ * for it to be done: a completion it takes may well be theirs. Called with
+ * the lock held, while the caller has requests in flight.
+ */
+void AsyncFileManager::reap_p(){
+    if (_reaping){
+        pthread_cond_wait(&_completed, &_lock);
+        return;
+    }
+    _reaping = true;
+    pthread_mutex_unlock(&_lock);
+    syscall(__NR_io_uring_enter, _ringFd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+    pthread_mutex_lock(&_lock);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *)_cqes;
+    unsigned head = *_cqHead, tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    std::vector <FileRequest *> retry;
+    for (; head != tail; head ++){
+        struct io_uring_cqe *cqe = &cqes[head & *_cqMask];
+        FileRequest *request = (FileRequest *)(unsigned long)cqe -> user_data;
+        /* Failed or short, at the end of file or on a kernel without IORING_OP_READ for instance: done again the plain way */
+        if (cqe -> res < _blockSize) retry.push_back(request);
+        else {
+            complete_p(request, cqe -> res);
+            _inFlight --;
+        }
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    executeAll_p(retry);
+    _reaping = false;
+    pthread_cond_broadcast(&_completed);
+}
+
+/* Maps the rings of a new io_uring instance, false when the kernel does not offer it */
+bool AsyncFileManager::startRing_p(){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, _queueDepth, &p);
+    if (fd < 0) return false;
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (_cqRingSize > _sqRingSize) _sqRingSize = _cqRingSize;
+        _cqRingSize = _sqRingSize;
+    }
+    _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sq = mmap(0, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(0, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED)
+        sqes = mmap(0, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED){
+        if (cq != MAP_FAILED && cq != sq) munmap(cq, _cqRingSize);
+        if (sq != MAP_FAILED) munmap(sq, _sqRingSize);
+        close(fd);
+        return false;
+    }
+    _ringFd = fd;
+    _sqRing = (char *)sq;
+    _cqRing = (char *)cq;
+    _sqes = sqes;
+    _sqHead = (unsigned *)(_sqRing + p.sq_off.head);
+    _sqTail = (unsigned *)(_sqRing + p.sq_off.tail);
+    _sqMask = (unsigned *)(_sqRing + p.sq_off.ring_mask);
+    _sqArray = (unsigned *)(_sqRing + p.sq_off.array);
+    _cqHead = (unsigned *)(_cqRing + p.cq_off.head);
+    _cqTail = (unsigned *)(_cqRing + p.cq_off.tail);
+    _cqMask = (unsigned *)(_cqRing + p.cq_off.ring_mask);
+    _cqes = _cqRing + p.cq_off.cqes;
+    _sqEntries = p.sq_entries;
+    _cqEntries = p.cq_entries;
+    _inFlight = 0;
+    _engine = ENGINE_RING;
+    return true;
+}
+
+/*
+ * Takes the requests the kernel has not consumed back out of the submission
+ * ring, after it refused them, and does them the plain way. Called with the
+ * lock held.
+ */
+void AsyncFileManager::takeBack_p(){
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)_sqes;
+    unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE), tail = *_sqTail;
+    std::vector <FileRequest *> requests;
+    for (unsigned i = head; i != tail; i ++) requests.push_back((FileRequest *)(unsigned long)sqes[_sqArray[i & *_sqMask]].user_data);
+    __atomic_store_n(_sqTail, head, __ATOMIC_RELEASE);
+    executeAll_p(requests);
+}
+
+/* One thread per request that may be in flight */
+void AsyncFileManager::startThreads_p(){
+    _engine = ENGINE_THREADS;
+    _stop = false;
+    _workerCount = _queueDepth;
+    _workers = new pthread_t[_workerCount];
+    for (int i = 0; i < _workerCount; i ++) pthread_create(&_workers[i], 0, worker_p, this);
+}
+
+void AsyncFileManager::stop_p(){
+    if (_ringFd != -1){
+        munmap(_sqes, _sqesSize);
+        if (_cqRing != _sqRing) munmap(_cqRing, _cqRingSize);
+        munmap(_sqRing, _sqRingSize);
+        close(_ringFd);
+        _ringFd = -1;
+        /* The next file may try the ring again */
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    _stop = true;
+    pthread_cond_broadcast(&_queued);
+    pthread_mutex_unlock(&_lock);
+    for (int i = 0; i < _workerCount; i ++) pthread_join(_workers[i], 0);
+    delete []_workers;
+    _workers = 0;
+    _workerCount = 0;
+}
+
+void *AsyncFileManager::worker_p(void *arg){
+    AsyncFileManager *fm = (AsyncFileManager *)arg;
+    pthread_mutex_lock(&fm -> _lock);
+    for (;;){
+        while (fm -> _queue.empty() && !fm -> _stop) pthread_cond_wait(&fm -> _queued, &fm -> _lock);
+        if (fm -> _queue.empty()) break;
+        FileRequest *request = fm -> _queue.front();
+        fm -> _queue.pop_front();
+        pthread_mutex_unlock(&fm -> _lock);
+        fm -> execute_p(request);
+        pthread_mutex_lock(&fm -> _lock);
+        fm -> complete_p(request, request -> result);
+        pthread_cond_broadcast(&fm -> _completed);
+    }
+    pthread_mutex_unlock(&fm -> _lock);
+    return 0;
+}
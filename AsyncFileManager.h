@@ -0,0 +1,81 @@
+#ifndef ASYNC_FILE_MANAGER_H
+#define ASYNC_FILE_MANAGER_H
+
+#include "FileManager.h"
+
+#include <deque>
+#include <vector>
+
+/*
+ * FileManager backend that keeps many block requests in flight at once.
+ * Requests go through io_uring when the kernel offers it, otherwise through a
+ * pool of threads doing pread / pwrite. The synchronous calls inherited from
+ * FileManager still work as before.
+ */
+class AsyncFileManager : public FileManager{
+    public:
+        AsyncFileManager(int engine = ENGINE_RING, int queueDepth = DEFAULT_QUEUE_DEPTH);
+        ~AsyncFileManager();
+
+        bool asynchronous() const;
+        void closeFile();
+        void createFile(const char *fileName, int blockSize);
+        int engine() const;
+        void openFile(const char *fileName);
+        void submit(FileRequest *requests, int count);
+        void wait(FileRequest *requests, int count);
+
+        static const int ENGINE_RING = 0;
+        static const int ENGINE_THREADS = 1;
+
+        static const int DEFAULT_QUEUE_DEPTH = 32;
+
+    private:
+        /* The engine asked for, every file tries it anew, and the one the open file uses */
+        int _requestedEngine;
+        int _engine;
+        int _queueDepth;
+        pthread_mutex_t _lock;
+        pthread_cond_t _completed;
+
+        /* io_uring: the mapped rings, requests are passed as user data */
+        int _ringFd;
+        char *_sqRing;
+        long _sqRingSize;
+        char *_cqRing;
+        long _cqRingSize;
+        void *_sqes;
+        long _sqesSize;
+        unsigned *_sqHead;
+        unsigned *_sqTail;
+        unsigned *_sqMask;
+        unsigned *_sqArray;
+        unsigned *_cqHead;
+        unsigned *_cqTail;
+        unsigned *_cqMask;
+        void *_cqes;
+        unsigned _sqEntries;
+        unsigned _cqEntries;
+        unsigned _inFlight;
+        /* Some thread is waiting for completions in the kernel, the others wait for it */
+        bool _reaping;
+
+        /* Thread pool */
+        pthread_cond_t _queued;
+        std::deque <FileRequest *> _queue;
+        pthread_t *_workers;
+        int _workerCount;
+        bool _stop;
+
+        void complete_p(FileRequest *request, long result);
+        void execute_p(FileRequest *request);
+        void executeAll_p(std::vector <FileRequest *> &requests);
+        void reap_p();
+        bool startRing_p();
+        void takeBack_p();
+        void startThreads_p();
+        void stop_p();
+        static void *worker_p(void *arg);
+};
+
+#endif
@@ -4,516 +4,2952 @@
 
 #include "BPlusTree.h"
 #include "FileManager.h"
+#include "NodeCache.h"
+#include "PageChecksum.h"
+#include "PostingList.h"
+#include "WriteAheadLog.h"
 
+#include <algorithm>
 #include <string.h>
 #include <stdio.h>
 
+const double BPlusTree::DEFAULT_MIN_FILL = 0.5;
+__thread BPlusTree::BPlusTreeGuard *BPlusTree::_guard = 0;
+
 BPlusTreeException::BPlusTreeException(int errNo) : _errNo(errNo){
 }
 
 BPlusTreeException::BPlusTreeException(const BPlusTreeException &e) : _errNo(e._errNo){
 }
 
+int BPlusTreeException::errNo() const throw(){
+    return _errNo;
+}
+
 const char *BPlusTreeException::msg() const throw(){
     switch (_errNo){
         case ERR_FILE_NOT_OPEN : 
             return "file not open";
+        case ERR_TREE_NOT_EMPTY :
+            return "tree not empty";
+        case ERR_UNSORTED_INPUT :
+            return "unsorted input";
+        case ERR_UNKNOWN_INDEX_TYPE :
+            return "unknown index type";
+        case ERR_KEY_TOO_LONG :
+            return "key too long";
+        case ERR_FORMAT_MISMATCH :
+            return "file written with checksums on and opened with them off, or the other way round";
+        case ERR_RESERVED_POSITION :
+            return "position reserved for posting lists";
         default :
             return "unknown error";
     }
 }
 
-BPlusTree::BPlusTree(FileManager *fm, int indexType, int indexLen) : _fm(fm), _idxType(indexType), _idxLen(indexLen){
-    if (!fm -> isOpen()) throw BPlusTreeException(BPlusTreeException::ERR_FILE_NOT_OPEN);
-    if (_idxType == IDX_TYPE_INT) _idxLen = sizeof(int);
-    _blkSize = _fm -> blockSize();
-    _nonLeafDataCount = (_blkSize - sizeof(int) * 3) / (sizeof(int) + _idxLen);
-    _leafDataCount = (_blkSize - sizeof(int) * 3) / (_idxLen + sizeof(int) * 2);
+/* Orders batch indices by key, equal keys keep their order in the batch */
+struct BatchKeyLess{
+    const NodeLayout *layout;
+    const char *data;
+    int idxLen;
 
-    char *s = fm -> readString(_blkSize, B_TREE_FILE_HEADER_LEN);
-    if (strcmp(s, B_TREE_FILE_HEADER)){
-        /* Following function call (writeHeader_p) cannot be removed, for header is needed */
-        _rootBlock = 0;
-        writeHeader_p();
+    bool operator ()(int a, int b) const{
+        return layout -> compare(data + a * idxLen, data + b * idxLen) < 0;
+    }
+};
 
-        _emptyNode = 0; 
-        _rootBlock = newBlock_p(emptyBlockPosition_p(), TREE_NODE_TYPE_LEAF);
-        writeBlock_p(_rootBlock);
-        writeHeader_p();
-    }  else {
-        _rootBlock = readBlock_p(fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN));
-        _emptyNode = fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN + sizeof(int));
+/* Takes one frame out of those a guard holds, the last one taken goes first */
+static void dropFrame(std::vector <int> &frames, int frame){
+    for (int i = frames.size() - 1; i >= 0; i --){
+        if (frames[i] != frame) continue;
+        frames.erase(frames.begin() + i);
+        return;
+    }
+}
+
+BPlusTreeIterator::BPlusTreeIterator(BPlusTree *tree, bool prefetch) : _tree(tree), _position(-1), _loc(0), _end(0), _lastInclusive(true), _treeVersion(0), _prefetch(prefetch), _window(0){
+    alloc_p();
+}
+
+BPlusTreeIterator::BPlusTreeIterator(const BPlusTreeIterator &it) : _tree(0), _position(-1), _page(0), _key(0), _end(0), _last(0){
+    *this = it;
+}
+
+BPlusTreeIterator::~BPlusTreeIterator(){
+    delete []_page;
+}
+
+BPlusTreeIterator &BPlusTreeIterator::operator=(const BPlusTreeIterator &it){
+    if (this == &it) return *this;
+    delete []_page;
+    _tree = it._tree;
+    _position = it._position;
+    _loc = it._loc;
+    _lastInclusive = it._lastInclusive;
+    _treeVersion = it._treeVersion;
+    _prefetch = it._prefetch;
+    _window = it._window;
+    alloc_p();
+    memcpy(_page, it._page, _tree -> _blkSize + _tree -> _idxLen * 4);
+    if (it._end) _end = _last + _tree -> _idxLen;
+    return *this;
+}
+
+const void *BPlusTreeIterator::key() const{
+    return _key;
+}
+
+BPlusTreeMatchIterator BPlusTreeIterator::matches() const{
+    return _tree -> queryAll(_key);
+}
+
+void BPlusTreeIterator::next(){
+    BPlusTree::BPlusTreeGuard guard(_tree);
+    _loc ++;
+    settle_p();
+}
+
+int BPlusTreeIterator::posPage() const{
+    return _tree -> _layout -> posPage(_page, _loc);
+}
+
+int BPlusTreeIterator::posSlot() const{
+    return _tree -> _layout -> posSlot(_page, _loc);
+}
+
+bool BPlusTreeIterator::valid() const{
+    return _position != -1;
+}
+
+/* One allocation holds the copy of the leaf and the keys, _end is only set by scan() */
+void BPlusTreeIterator::alloc_p(){
+    _page = new char[_tree -> _blkSize + _tree -> _idxLen * 4];
+    _key = _page + _tree -> _blkSize;
+    _last = _key + _tree -> _idxLen;
+    _end = 0;
+}
+
+/* Takes a copy of a latched leaf and releases it, the tree latch must be held */
+void BPlusTreeIterator::copy_p(int position, int frame, const char *page){
+    memcpy(_page, page, _tree -> _blkSize);
+    _position = position;
+    _treeVersion = _tree -> _treeVersion;
+    BPlusTree::BPlusTreeBlock block;
+    block.position = position;
+    block.frame = frame;
+    block.page = (char *)page;
+    _tree -> releaseBlock_p(&block);
+}
+
+/* Copies the next leaf without latching it, false if it is not cached or the tree has changed since the current leaf was read */
+bool BPlusTreeIterator::nextOptimistic_p(int next){
+    if (__atomic_load_n(&_tree -> _treeVersion, __ATOMIC_ACQUIRE) != _treeVersion) return false;
+    int frame;
+    unsigned long version;
+    char *page = _tree -> _bp -> lookup(next, &frame, &version);
+    if (!page) return false;
+    _tree -> _stats.count(TreeStats::COUNTER_CACHED_READS);
+    memcpy(_page, page, _tree -> _blkSize);
+    if (!_tree -> validate_p(frame, version, _treeVersion)) return false;
+    _position = next;
+    _loc = 0;
+    return true;
+}
+
+/* Positions the iterator at the first value after data, or not before data when inclusive. The tree latch must be held */
+void BPlusTreeIterator::seek_p(const void *data, bool inclusive){
+    BPlusTree::BPlusTreeBlock b;
+    _tree -> descend_p(data, &b, false);
+    int equals;
+    _loc = _tree -> _layout -> search(b.page, data, &equals);
+    if (inclusive && equals) _loc --;
+    copy_p(b.position, b.frame, b.page);
+}
+
+/* Same as seek_p without any latch, false if it keeps conflicting with writers or needs a page that is not cached */
+bool BPlusTreeIterator::seekOptimistic_p(const void *data, bool inclusive){
+    for (int i = 0; i < BPlusTree::OPTIMISTIC_RETRIES; i ++){
+        BPlusTree::BPlusTreeBlock b;
+        unsigned long version, treeVersion;
+        int size = _tree -> descendOptimistic_p(data, &b, &version, &treeVersion);
+        if (size == BPlusTree::OPTIMISTIC_MISS) return false;
+        if (size == BPlusTree::OPTIMISTIC_CONFLICT) continue;
+        memcpy(_page, b.page, _tree -> _blkSize);
+        if (!_tree -> validate_p(b.frame, version, treeVersion)) continue;
+        int equals;
+        _loc = _tree -> _layout -> search(_page, data, &equals);
+        if (inclusive && equals) _loc --;
+        _position = b.position;
+        _treeVersion = treeVersion;
+        return true;
+    }
+    return false;
+}
+
+/* Moves along the leaf chain until _loc is a value of the current leaf, reads its key and stops after _end */
+void BPlusTreeIterator::settle_p(){
+    while (_position != -1 && _loc >= NodeLayout::size(_page)){
+        int next = NodeLayout::next(_page);
+        if (NodeLayout::size(_page)){
+            _tree -> _layout -> readKey(_page, NodeLayout::size(_page) - 1, _last);
+            _lastInclusive = false;
+        }
+        if (!next){
+            _position = -1;
+            return;
+        }
+        _window --;
+        if (nextOptimistic_p(next)) continue;
+        _tree -> lockShared_p();
+        if (_treeVersion == _tree -> _treeVersion){
+            BPlusTree::BPlusTreeBlock b;
+            _tree -> readBlock_p(next, &b);
+            _tree -> latch_p(b.frame, false);
+            _loc = 0;
+            copy_p(b.position, b.frame, b.page);
+        }  else seek_p(_last, _lastInclusive);
+        _tree -> unlockShared_p();
+    }
+    if (_position == -1) return;
+    _tree -> _layout -> readKey(_page, _loc, _key);
+    if (_end && _tree -> _layout -> compare(_key, _end) > 0) _position = -1;
+    if (_position != -1 && _prefetch && _window <= BPlusTree::PREFETCH_WINDOW / 2 && NodeLayout::next(_page))
+        _window = _tree -> prefetchLeaves_p(key(), BPlusTree::PREFETCH_WINDOW);
+}
+
+BPlusTreeMatchIterator::BPlusTreeMatchIterator() : _loc(0){
+}
+
+void BPlusTreeMatchIterator::next(){
+    _loc ++;
+}
+
+int BPlusTreeMatchIterator::posPage() const{
+    return _positions[_loc].first;
+}
+
+int BPlusTreeMatchIterator::posSlot() const{
+    return _positions[_loc].second;
+}
+
+bool BPlusTreeMatchIterator::valid() const{
+    return _loc < (int)_positions.size();
+}
+
+double BPlusTreeStats::cacheHitRatio() const{
+    long hits = cacheHits + counters[TreeStats::COUNTER_CACHED_READS];
+    return hits + cacheMisses ? (double)hits / (hits + cacheMisses) : 0;
+}
+
+double BPlusTreeStats::fill() const{
+    double sum = 0;
+    long nodes = 0;
+    for (int i = 0; i < (int)levelNodes.size(); i ++){
+        sum += levelFill[i] * levelNodes[i];
+        nodes += levelNodes[i];
+    }
+    return nodes ? sum / nodes : 0;
+}
+
+long BPlusTreeStats::latencyPercentile(int op, double p) const{
+    long total = 0, seen = 0;
+    for (int i = 0; i < TreeStats::LATENCY_BUCKETS; i ++) total += latency[op][i];
+    for (int i = 0; i < TreeStats::LATENCY_BUCKETS; i ++){
+        seen += latency[op][i];
+        if (seen && seen >= total * p) return 2L << i;
+    }
+    return 0;
+}
+
+BPlusTree::BPlusTreeGuard::BPlusTreeGuard(BPlusTree *tree) : tree(tree), outer(_guard), treeLatch(0){
+    _guard = this;
+}
+
+/* Only a call that throws leaves anything held; ending its exclusive section may pin blocks again */
+BPlusTree::BPlusTreeGuard::~BPlusTreeGuard(){
+    release();
+    if (treeLatch == GUARD_EXCLUSIVE){
+        tree -> abortTree_p();
+        release();
+    }  else if (treeLatch == GUARD_SHARED) pthread_rwlock_unlock(&tree -> _treeLatch);
+    _guard = outer;
+}
+
+void BPlusTree::BPlusTreeGuard::release(){
+    for (int i = latches.size() - 1; i >= 0; i --) tree -> _bp -> unlatch(latches[i]);
+    for (int i = pins.size() - 1; i >= 0; i --) tree -> _bp -> unpin(pins[i]);
+    latches.clear();
+    pins.clear();
+}
+
+BPlusTree::BPlusTree(FileManager *fm, int indexType, int indexLen, int cacheSize, int cachePolicy, WriteAheadLog *log) : _fm(fm), _log(log), _treeVersion(0), _headerDirty(false), _duplicates((indexType & IDX_DUPLICATES) != 0), _checksums((indexType & IDX_CHECKSUMS) != 0){
+    if (!fm -> isOpen()) throw BPlusTreeException(BPlusTreeException::ERR_FILE_NOT_OPEN);
+    NodeLayout *layout = NodeLayout::create(fm -> blockSize() - (_checksums ? PageChecksum::SIZE : 0), indexType, indexLen);
+    if (!layout) throw BPlusTreeException(BPlusTreeException::ERR_UNKNOWN_INDEX_TYPE);
+    open_p(layout, cacheSize, cachePolicy);
+}
+
+BPlusTree::BPlusTree(FileManager *fm, NodeLayout *layout, int cacheSize, int cachePolicy, WriteAheadLog *log, bool checksums, bool duplicates) : _fm(fm), _log(log), _treeVersion(0), _headerDirty(false), _duplicates(duplicates), _checksums(checksums){
+    if (!fm -> isOpen()){
+        delete layout;
+        throw BPlusTreeException(BPlusTreeException::ERR_FILE_NOT_OPEN);
     }
-    delete[] s;
+    open_p(layout, cacheSize, cachePolicy);
 }
 
 BPlusTree::~BPlusTree(){
-    clearBlock_p(_rootBlock);
+    clearBlock_p(&_rootBlock);
+    /* A destructor cannot report a failed write; the log is then kept for the next open to recover from */
+    try {
+        _bp -> flush();
+        if (_log){
+            _fm -> sync();
+            _log -> checkpoint();
+        }
+    }  catch (...){
+    }
+    delete _bp;
+    delete _layout;
+    delete _nodeCache;
+    pthread_rwlock_destroy(&_treeLatch);
+}
+
+/*
+ * Builds the tree bottom-up from sorted input. Leaves are packed to fillFactor
+ * and written sequentially, then every non-leaf level is built from the
+ * separators between the nodes of the level below. Only an empty tree can be
+ * loaded.
+ */
+int BPlusTree::bulkLoad(BPlusTreeSource *source, double fillFactor){
+    BPlusTreeGuard guard(this);
+    lockTree_p();
+    if (NodeLayout::type(_rootBlock.page) != TREE_NODE_TYPE_LEAF || NodeLayout::size(_rootBlock.page)){
+        unlockTree_p();
+        throw BPlusTreeException(BPlusTreeException::ERR_TREE_NOT_EMPTY);
+    }
+    if (fillFactor <= 0 || fillFactor > 1) fillFactor = 1;
+    int perNonLeaf = (int)((_nonLeafDataCount + 1) * fillFactor);
+    if (perNonLeaf < 3) perNonLeaf = 3;
+    if (perNonLeaf > _nonLeafDataCount + 1) perNonLeaf = _nonLeafDataCount + 1;
+
+    /* Separator before and position of every node of the level being built */
+    std::vector <char> values;
+    std::vector <int> positions;
+    /* Leaves not written yet, consecutive blocks from runFirst on */
+    std::vector <char> run;
+    char leaf[_blkSize];
+    char data[_idxLen];
+    char last[_idxLen];
+    int posPage, posSlot, count = 0, first = 0, runFirst = 0;
+    memset(leaf, 0, _blkSize);
+    _layout -> init(leaf, TREE_NODE_TYPE_LEAF);
+    while (source -> next(data, &posPage, &posSlot)){
+        bool unsorted = count && _layout -> compare(last, data) >= 0;
+        if (unsorted || (_duplicates && posPage <= POSTING_LIST)){
+            /* Nothing links to the leaves written so far, the file is cut back to where they start */
+            if (count) _fm -> truncate((long)first * _blkSize);
+            unlockTree_p();
+            throw BPlusTreeException(unsorted ? BPlusTreeException::ERR_UNSORTED_INPUT : BPlusTreeException::ERR_RESERVED_POSITION);
+        }
+        bool added = false;
+        if (!count){
+            /* Reserve the first leaf, the following ones are appended right after it */
+            first = _fm -> writeNewBlock(leaf) / _blkSize;
+            values.insert(values.end(), data, data + _idxLen);
+        }  else if (_layout -> fill(leaf) < fillFactor) added = _layout -> insertLeaf(leaf, NodeLayout::size(leaf), data, posPage, posSlot);
+        if (count && !added){
+            int position = first + positions.size();
+            NodeLayout::next(leaf) = position + 1;
+            if (run.empty()) runFirst = position;
+            run.insert(run.end(), leaf, leaf + _blkSize);
+            if ((int)run.size() == BULK_WRITE_RUN * _blkSize) writeRun_p(runFirst, run);
+            positions.push_back(position);
+            values.resize(values.size() + _idxLen);
+            _layout -> separator(last, data, &values[values.size() - _idxLen]);
+            memset(leaf, 0, _blkSize);
+            _layout -> init(leaf, TREE_NODE_TYPE_LEAF);
+        }
+        if (!added) _layout -> insertLeaf(leaf, NodeLayout::size(leaf), data, posPage, posSlot);
+        memcpy(last, data, _idxLen);
+        count ++;
+    }
+    if (!count){
+        unlockTree_p();
+        return 0;
+    }
+    int position = first + positions.size();
+    if (run.empty()) runFirst = position;
+    run.insert(run.end(), leaf, leaf + _blkSize);
+    writeRun_p(runFirst, run);
+    positions.push_back(position);
+
+    while (positions.size() > 1) bulkLoadLevel_p(values, positions, perNonLeaf);
+    /* The new nodes bypass the pool and the log, they must be on disk before the header that links them in is committed */
+    if (_log) _fm -> sync();
+    int oldRoot = _rootBlock.position;
+    clearBlock_p(&_rootBlock);
+    freeBlock_p(oldRoot);
+    readBlock_p(positions[0], &_rootBlock);
+    /* The nodes were written past writeBlock_p */
+    if (_cacheNodes) loadNodeCache_p();
+    _headerDirty = true;
+    unlockTree_p();
+    return count;
+}
+
+/*
+ * Moves the nodes and map pages lying past the blocks in use into the free
+ * blocks before them, then cuts the file after the last block in use and
+ * returns how many blocks it lost. The whole tree is walked once, other calls
+ * wait meanwhile. With a log the moves are committed and checkpointed before
+ * the file is cut, so recovery never writes past its end.
+ */
+int BPlusTree::compact(){
+    BPlusTreeGuard guard(this);
+    lockTree_p();
+    int blocks = _fm -> fileSize() / _blkSize, end = blocks - _freeCount;
+    if (end < blocks){
+        for (int i = 0; i < (int)_mapBlocks.size(); i ++){
+            if (_mapBlocks[i] < end) continue;
+            /* Map pages are written whole when the section ends, only their place changes */
+            int position = allocBlock_p(0);
+            freeBlock_p(_mapBlocks[i]);
+            _mapBlocks[i] = position;
+            _mapDirty[i] = true;
+            if (i > 0) _mapDirty[i - 1] = true;
+            else _headerDirty = true;
+        }
+        if (_rootBlock.position >= end){
+            int position = moveBlock_p(_rootBlock.position);
+            clearBlock_p(&_rootBlock);
+            readBlock_p(position, &_rootBlock);
+            _headerDirty = true;
+        }
+        int height = 0, prevLeaf = -1;
+        /* Pages of short lists moved, other leaves may still point to their old place */
+        std::map <int, int> moved;
+        BPlusTreeBlock b = _rootBlock;
+        while (NodeLayout::type(b.page) == TREE_NODE_TYPE_NONLEAF){
+            BPlusTreeBlock child;
+            readBlock_p(_layout -> child(b.page, 0), &child);
+            if (b.page != _rootBlock.page) clearBlock_p(&b);
+            b = child;
+            height ++;
+        }
+        if (b.page != _rootBlock.page) clearBlock_p(&b);
+        if (height) relocate_p(&_rootBlock, height, end, &prevLeaf, moved);
+        else if (_duplicates) relocatePostings_p(_rootBlock.position, end, moved);
+    }
+    unlockTree_p();
+
+    lockTree_p();
+    _bp -> flush();
+    _fm -> sync();
+    if (_log) _log -> checkpoint();
+    blocks = _fm -> fileSize() / _blkSize;
+    end = blocks;
+    while (end > FIRST_NODE_BLOCK && end - 1 < (int)_freeMap.size() * 8 && (_freeMap[(end - 1) / 8] & (1 << ((end - 1) & 7)))) end --;
+    if (end < blocks){
+        /* Blocks past the end of the file are neither free nor cached */
+        for (int i = end; i < blocks; i ++) setFree_p(i, false);
+        _bp -> discard(end);
+        _fm -> truncate((long)end * _blkSize);
+        _headerDirty = true;
+    }
+    unlockTree_p();
+    return blocks - end;
+}
+
+/*
+ * One step of defragmentation: moves up to maxLeaves leaves, in index order,
+ * to the blocks following the ones placed by the previous steps; whatever
+ * lies there takes the block a leaf leaves. With a fillFactor, each leaf
+ * first takes in the leaves after it under the same parent as long as it
+ * stays below fillFactor. Returns false once the last leaf is in place, the
+ * next call starts a new pass. Updates between steps do no harm, leaves
+ * split or merged meanwhile may just end up out of place.
+ */
+bool BPlusTree::defragment(int maxLeaves, double fillFactor){
+    BPlusTreeGuard guard(this);
+    lockTree_p();
+    if (NodeLayout::type(_rootBlock.page) == TREE_NODE_TYPE_LEAF){
+        _defragNext = 0;
+        unlockTree_p();
+        return false;
+    }
+    if (!_defragNext){
+        _defragNext = FIRST_NODE_BLOCK;
+        _defragKey.clear();
+    }
+    std::vector <int> path, locs;
+    for (int n = 0; n < maxLeaves; n ++){
+        leafPath_p(_defragKey.size() ? &_defragKey[0] : 0, path, locs);
+        if (fillFactor > 0) repackLeaf_p(path, locs, fillFactor);
+        int position = path.back();
+        /* A leaf below _defragNext has been placed already, it took in the one looked for */
+        if (position >= _defragNext){
+            if (position == _defragNext || placeLeaf_p(path, locs, _defragNext)) position = _defragNext;
+            _defragNext ++;
+            /* Nothing that could be told apart was in the way, the leaf goes to the next block */
+            if (position != _defragNext - 1) continue;
+        }
+        BPlusTreeBlock leaf;
+        readBlock_p(position, &leaf);
+        int next = NodeLayout::next(leaf.page);
+        clearBlock_p(&leaf);
+        if (!next){
+            _defragNext = 0;
+            break;
+        }
+        readBlock_p(next, &leaf);
+        _defragKey.resize(_idxLen);
+        _layout -> readKey(leaf.page, 0, &_defragKey[0]);
+        clearBlock_p(&leaf);
+    }
+    bool ret = _defragNext != 0;
+    unlockTree_p();
+    return ret;
+}
+
+/* With a log this is a checkpoint: once every page is on disk the log is emptied, so no operation may run meanwhile */
+void BPlusTree::flush(){
+    BPlusTreeGuard guard(this);
+    if (_log){
+        lockTree_p();
+        _bp -> flush();
+        _fm -> sync();
+        _log -> checkpoint();
+        unlockTree_p();
+        return;
+    }
+    lockShared_p();
+    _bp -> flush();
+    _fm -> sync();
+    unlockShared_p();
 }
 
 bool BPlusTree::insert(void *data, int posPage, int posSlot){
-    BPlusTreeBlock *block = 0;
-    bool ret = insert_p(_rootBlock, data, posPage, posSlot);
-    BPlusTreeBlock *newBlock = 0;
-    if (_rootBlock -> type == TREE_NODE_TYPE_LEAF && _rootBlock -> data.leaf.size > _leafDataCount) newBlock = splitLeaf_p(_rootBlock);
-    else if (_rootBlock -> type == TREE_NODE_TYPE_NONLEAF && _rootBlock -> data.nonleaf.size > _nonLeafDataCount) newBlock = splitNonLeaf_p(_rootBlock);
-    if (newBlock){
-        int pos = emptyBlockPosition_p();
-        BPlusTreeBlock *newRoot = newBlock_p(pos, TREE_NODE_TYPE_NONLEAF);
-        newRoot -> data.nonleaf.child[0] = _rootBlock -> position;
-        addToNonLeaf_p(newBlock, newRoot);
-        writeBlock_p(newRoot);
-        writeBlock_p(newBlock);
-        writeBlock_p(_rootBlock);
-        clearBlock_p(newBlock);
-        clearBlock_p(_rootBlock);
-        _rootBlock = newRoot;
-        writeHeader_p();
+    BPlusTreeGuard guard(this);
+    if (_duplicates && posPage <= POSTING_LIST) throw BPlusTreeException(BPlusTreeException::ERR_RESERVED_POSITION);
+    long start = _stats.start();
+    _stats.count(TreeStats::COUNTER_INSERTS);
+    /* Keys are searched for and stored padded to _idxLen, string keys may be shorter */
+    char padded[_idxLen];
+    _layout -> copyKey(padded, data);
+    data = padded;
+    /* Optimistic pass: only the leaf is latched exclusively, which is enough unless it has to split */
+    BPlusTreeBlock b;
+    lockShared_p();
+    descend_p(data, &b, true);
+    int equals;
+    int loc = _layout -> search(b.page, data, &equals);
+    /* Another position of a key goes in under the tree latch, it may start a posting list */
+    bool done = equals ? !_duplicates : _layout -> insertLeaf(b.page, loc, data, posPage, posSlot);
+    long lsn = 0;
+    if (!equals && done){
+        writeBlock_p(&b);
+        if (_log) lsn = commit_p(&b, 1);
+    }
+    releaseBlock_p(&b);
+    unlockShared_p();
+    if (lsn) _log -> waitCommit(lsn);
+    if (done){
+        _stats.finish(TreeStats::OP_INSERT, start);
+        return !equals;
+    }
+
+    lockTree_p();
+    BPlusTreeBlock newBlock;
+    char sep[_idxLen];
+    bool ret = insert_p(&_rootBlock, data, posPage, posSlot, &newBlock, sep);
+    if (newBlock.position != -1){
+        BPlusTreeBlock newRoot;
+        newBlock_p(TREE_NODE_TYPE_NONLEAF, &newRoot, _rootBlock.position);
+        _layout -> setChild(newRoot.page, 0, _rootBlock.position);
+        _layout -> insertNonLeaf(newRoot.page, 0, sep, newBlock.position);
+        writeBlock_p(&newRoot);
+        clearBlock_p(&newBlock);
+        setRoot_p(&newRoot);
+        _headerDirty = true;
+    }
+    unlockTree_p();
+    _stats.finish(TreeStats::OP_INSERT, start);
+    return ret;
+}
+
+/*
+ * Inserts count keys stored back to back in data. The batch is sorted and
+ * applied in one traversal: every leaf is modified once and split afterwards
+ * if needed. Returns the number of keys inserted.
+ */
+int BPlusTree::insertBatch(void *data, int *posPage, int *posSlot, int count, bool *results){
+    BPlusTreeGuard guard(this);
+    if (count <= 0) return 0;
+    for (int i = 0; _duplicates && i < count; i ++)
+        if (posPage[i] <= POSTING_LIST) throw BPlusTreeException(BPlusTreeException::ERR_RESERVED_POSITION);
+    _stats.count(TreeStats::COUNTER_INSERTS, count);
+    BPlusTreeBatch batch;
+    batch.data = (const char *)data;
+    batch.posPage = posPage;
+    batch.posSlot = posSlot;
+    batch.results = results ? results : new bool[count];
+    batchOrder_p(&batch, count);
+    lockTree_p();
+    std::vector <char> values;
+    std::vector <int> positions;
+    int ret = insertBatch_p(&_rootBlock, &batch, 0, count, values, positions);
+    while (positions.size()){
+        BPlusTreeBlock newRoot;
+        newBlock_p(TREE_NODE_TYPE_NONLEAF, &newRoot, _rootBlock.position);
+        _layout -> setChild(newRoot.page, 0, _rootBlock.position);
+        std::vector <int> at(positions.size(), 0);
+        std::vector <char> newValues;
+        std::vector <int> newPositions;
+        insertChildren_p(&newRoot, at, values, positions, newValues, newPositions);
+        setRoot_p(&newRoot);
+        _headerDirty = true;
+        values.swap(newValues);
+        positions.swap(newPositions);
+    }
+    /* Keys already there, or twice in the batch, take another position */
+    for (int i = 0; _duplicates && i < count; i ++){
+        if (batch.results[i]) continue;
+        const char *x = batch.data + i * _idxLen;
+        std::vector <int> path, locs;
+        leafPath_p(x, path, locs);
+        BPlusTreeBlock leaf;
+        readBlock_p(path.back(), &leaf);
+        int equals;
+        int loc = _layout -> search(leaf.page, x, &equals) - 1;
+        batch.results[i] = equals && addPosting_p(&leaf, loc, posPage[i], posSlot[i]);
+        ret += batch.results[i];
+        clearBlock_p(&leaf);
+    }
+    unlockTree_p();
+    delete []batch.order;
+    if (!results) delete []batch.results;
+    return ret;
+}
+
+/* Iterator at the first value not before data */
+BPlusTreeIterator BPlusTree::lowerBound(void *data, bool prefetch){
+    BPlusTreeGuard guard(this);
+    BPlusTreeIterator ret(this, prefetch);
+    /* String keys may be shorter than _idxLen, the layout pads them and the padded copy is searched for */
+    _layout -> copyKey(ret._last, data);
+    if (!ret.seekOptimistic_p(ret._last, true)){
+        lockShared_p();
+        ret.seek_p(ret._last, true);
+        unlockShared_p();
     }
+    ret.settle_p();
     return ret;
 }
 
 void BPlusTree::print() const{
-    print_p(_rootBlock);
+    BPlusTreeGuard guard((BPlusTree *)this);
+    lockShared_p();
+    BPlusTreeBlock root = _rootBlock;
+    latch_p(root.frame, false);
+    print_p(&root);
+    unlatch_p(root.frame);
+    unlockShared_p();
 }
 
 std::pair <int, int> BPlusTree::query(void *data){
+    BPlusTreeGuard guard(this);
+    long start = _stats.start();
+    _stats.count(TreeStats::COUNTER_QUERIES);
+    char padded[_idxLen];
+    _layout -> copyKey(padded, data);
+    data = padded;
     std::pair <int, int> ret(-1, -1);
-    BPlusTreeBlock *b = _rootBlock;
-    while (b -> type != TREE_NODE_TYPE_LEAF){
-        BPlusTreeBlock *next = readBlock_p(b -> data.nonleaf.child[calcBlockPosition_p(data, b)]);
-        if (b != _rootBlock) clearBlock_p(b);
-        b = next;
+    BPlusTreeBlock b;
+    for (int i = 0; i < OPTIMISTIC_RETRIES; i ++){
+        unsigned long version, treeVersion;
+        int size = descendOptimistic_p(data, &b, &version, &treeVersion);
+        if (size == OPTIMISTIC_MISS) break;
+        if (size == OPTIMISTIC_CONFLICT){
+            _stats.count(TreeStats::COUNTER_OPTIMISTIC_RETRIES);
+            continue;
+        }
+        int equals;
+        int loc = _layout -> search(b.page, size, data, &equals);
+        if (equals) ret = std::make_pair(_layout -> posPage(b.page, loc - 1), _layout -> posSlot(b.page, loc - 1));
+        bool valid = validate_p(b.frame, version, treeVersion);
+        /* A posting list is read under the tree latch */
+        if (valid && (!_duplicates || ret.first > POSTING_LIST)){
+            _stats.finish(TreeStats::OP_QUERY, start);
+            return ret;
+        }
+        ret = std::make_pair(-1, -1);
+        if (valid) break;
+        _stats.count(TreeStats::COUNTER_OPTIMISTIC_RETRIES);
     }
+    _stats.count(TreeStats::COUNTER_OPTIMISTIC_FALLBACKS);
+    lockShared_p();
+    descend_p(data, &b, false);
+    int equals;
+    int loc = _layout -> search(b.page, data, &equals);
+    if (equals) ret = firstPosition_p(b.page, loc - 1);
+    releaseBlock_p(&b);
+    unlockShared_p();
+    _stats.finish(TreeStats::OP_QUERY, start);
+    return ret;
+}
+
+/* Every position of data, none if it is not in the index */
+BPlusTreeMatchIterator BPlusTree::queryAll(void *data){
+    BPlusTreeGuard guard(this);
+    _stats.count(TreeStats::COUNTER_QUERIES);
+    char padded[_idxLen];
+    _layout -> copyKey(padded, data);
+    data = padded;
+    BPlusTreeMatchIterator ret;
+    BPlusTreeBlock b;
+    lockShared_p();
+    descend_p(data, &b, false);
     int equals;
-    int loc = calcBlockPosition_p(data, b, &equals);
-    if (equals) ret = std::make_pair(b -> data.leaf.posPage[loc - 1], b -> data.leaf.posSlot[loc - 1]);
-    if (b != _rootBlock) clearBlock_p(b);
+    int loc = _layout -> search(b.page, data, &equals) - 1;
+    if (equals) readPositions_p(b.page, loc, ret._positions);
+    releaseBlock_p(&b);
+    unlockShared_p();
     return ret;
 }
 
+void BPlusTree::queryBatch(void *data, int count, std::pair <int, int> *results){
+    BPlusTreeGuard guard(this);
+    if (count <= 0) return;
+    _stats.count(TreeStats::COUNTER_QUERIES, count);
+    BPlusTreeBatch batch;
+    batch.data = (const char *)data;
+    batchOrder_p(&batch, count);
+    lockShared_p();
+    latch_p(_rootBlock.frame, false);
+    queryBatch_p(&_rootBlock, &batch, 0, count, results);
+    unlatch_p(_rootBlock.frame);
+    unlockShared_p();
+    delete []batch.order;
+}
+
 bool BPlusTree::remove(void *data){
-    bool ret = remove_p(_rootBlock, data);
-    if (ret && _rootBlock -> type == TREE_NODE_TYPE_NONLEAF && _rootBlock -> data.nonleaf.size == 0){
-        BPlusTreeBlock *newBlock = readBlock_p(_rootBlock -> data.nonleaf.child[0]);
-        addEmptyBlock_p(_rootBlock -> position);
-        clearBlock_p(_rootBlock);
-        _rootBlock = newBlock;
-        writeHeader_p();
+    BPlusTreeGuard guard(this);
+    long start = _stats.start();
+    _stats.count(TreeStats::COUNTER_REMOVES);
+    char padded[_idxLen];
+    _layout -> copyKey(padded, data);
+    data = padded;
+    /* Optimistic pass, enough while the leaf stays at least half full: no merge is needed then */
+    BPlusTreeBlock b;
+    lockShared_p();
+    descend_p(data, &b, true);
+    int equals;
+    int loc = _layout -> search(b.page, data, &equals) - 1;
+    bool done = !equals || b.page == _rootBlock.page || !_layout -> underflow(b.page, loc, _minFill);
+    /* Pages of a posting list are freed under the tree latch */
+    if (equals && _duplicates && _layout -> posPage(b.page, loc) <= POSTING_LIST) done = false;
+    long lsn = 0;
+    if (equals && done){
+        _layout -> removeLeaf(b.page, loc);
+        writeBlock_p(&b);
+        if (_log) lsn = commit_p(&b, 1);
     }
+    releaseBlock_p(&b);
+    unlockShared_p();
+    if (lsn) _log -> waitCommit(lsn);
+    if (done){
+        _stats.finish(TreeStats::OP_REMOVE, start);
+        return equals;
+    }
+
+    lockTree_p();
+    bool ret = remove_p(&_rootBlock, data);
+    if (ret) collapseRoot_p();
+    unlockTree_p();
+    _stats.finish(TreeStats::OP_REMOVE, start);
     return ret;
 }
 
-void BPlusTree::clearBlock_p(BPlusTreeBlock *&block) const{
-    if (!block) return;
-    if (block -> type == TREE_NODE_TYPE_EMPTY){
-    }  else if (block -> type == TREE_NODE_TYPE_LEAF){
-        delete []block -> data.leaf.posPage;
-        delete []block -> data.leaf.posSlot;
-        delete [](char *)block -> data.leaf.value;
-    }  else if (block -> type == TREE_NODE_TYPE_NONLEAF){
-        delete []block -> data.nonleaf.child;
-        delete [](char *)block -> data.nonleaf.value;
+/* Takes one position away from data, and data with it if that was its last one. False if data does not have that position */
+bool BPlusTree::remove(void *data, int posPage, int posSlot){
+    BPlusTreeGuard guard(this);
+    long start = _stats.start();
+    _stats.count(TreeStats::COUNTER_REMOVES);
+    char padded[_idxLen];
+    _layout -> copyKey(padded, data);
+    data = padded;
+    lockTree_p();
+    std::vector <int> path, locs;
+    leafPath_p(data, path, locs);
+    BPlusTreeBlock leaf;
+    readBlock_p(path.back(), &leaf);
+    int equals;
+    int loc = _layout -> search(leaf.page, data, &equals) - 1;
+    int left = equals ? removePosting_p(&leaf, loc, posPage, posSlot) : -1;
+    clearBlock_p(&leaf);
+    if (left == 0){
+        remove_p(&_rootBlock, data);
+        collapseRoot_p();
     }
-    delete block;
-    block = 0;
+    unlockTree_p();
+    _stats.finish(TreeStats::OP_REMOVE, start);
+    return left != -1;
 }
 
-void BPlusTree::addEmptyBlock_p(int position){
-    BPlusTreeBlock *block = newBlock_p(position, TREE_NODE_TYPE_EMPTY);
-    block -> data.empty.next = _emptyNode;
-    _emptyNode = position;
-    writeBlock_p(block);
-    writeHeader_p();
-    clearBlock_p(block);
+int BPlusTree::removeBatch(void *data, int count, bool *results){
+    BPlusTreeGuard guard(this);
+    if (count <= 0) return 0;
+    _stats.count(TreeStats::COUNTER_REMOVES, count);
+    BPlusTreeBatch batch;
+    batch.data = (const char *)data;
+    batch.results = results ? results : new bool[count];
+    batchOrder_p(&batch, count);
+    lockTree_p();
+    int ret = removeBatch_p(&_rootBlock, &batch, 0, count);
+    collapseRoot_p();
+    unlockTree_p();
+    delete []batch.order;
+    if (!results) delete []batch.results;
+    return ret;
 }
 
-void BPlusTree::addToLeaf_p(void *data, int posPage, int posSlot, BPlusTreeBlock *block, int loc){
-    if (loc == -1) loc = calcBlockPosition_p(data, block);
-    char *arr = (char *)block -> data.leaf.value;
-    int size = block -> data.leaf.size ++;
-    memmove(arr + (loc + 1) * _idxLen, arr + loc * _idxLen, (size - loc) * _idxLen); 
-    memcpy(arr + loc * _idxLen, data, _idxLen);
-    memmove(block -> data.leaf.posPage + loc + 1, block -> data.leaf.posPage + loc, (size - loc) * sizeof(int));
-    block -> data.leaf.posPage[loc] = posPage;
-    memmove(block -> data.leaf.posSlot + loc + 1, block -> data.leaf.posSlot + loc, (size - loc) * sizeof(int));
-    block -> data.leaf.posSlot[loc] = posSlot;
-}
-
-void BPlusTree::addToNonLeaf_p(BPlusTreeBlock *blockAdd, BPlusTreeBlock *block, int loc){
-    BPlusTreeBlock *b = blockAdd;
-    while (b -> type != TREE_NODE_TYPE_LEAF){
-        BPlusTreeBlock *newBlock = readBlock_p(b -> data.nonleaf.child[0]);
-        if (b != blockAdd) clearBlock_p(b);
-        b = newBlock;
-    }
-    if (loc == -1) loc = calcBlockPosition_p(b -> data.leaf.value, block);
-    char *arr = (char *)block -> data.nonleaf.value;
-    int size = block -> data.nonleaf.size ++;
-    memmove(arr + (loc + 1) * _idxLen, arr + loc * _idxLen, (size - loc) * _idxLen); 
-    memcpy(arr + loc * _idxLen, b -> data.leaf.value, _idxLen);
-    memmove(block -> data.nonleaf.child + loc + 2, block -> data.nonleaf.child + loc + 1, (size - loc) * sizeof(int));
-    block -> data.nonleaf.child[loc + 1] = blockAdd -> position;
-    if (b != blockAdd) clearBlock_p(b);
-}
-
-int BPlusTree::calcBlockPosition_p(void *data, BPlusTreeBlock *block, int *equals){
-    int size;
-    void *value;
-    if (block -> type == TREE_NODE_TYPE_NONLEAF){
-        size = block -> data.nonleaf.size;
-        value = block -> data.nonleaf.value;
-    }  else if (block -> type == TREE_NODE_TYPE_LEAF){
-        size = block -> data.leaf.size;
-        value = block -> data.leaf.value;
-    }
-    int l = 0, r = size - 1;
-    if (_idxType == IDX_TYPE_STRING){
-        char *x = (char *)data;
-        char *arr = (char *)value;
-        while (l < r){
-            int mid = (l + r) >> 1;
-            int c = strncmp(x, arr + mid * _idxLen, _idxLen);
-            if (c > 0) r = mid - 1;
-            else if (c == 0) l = r = mid;
-            else l = mid + 1;
-        }
-        //printf("%s %s %d %d %d\n", x, arr + l * _idxLen, strncmp(x, arr + l * _idxLen, _idxLen), l, r);
-        if (equals) *equals = (l < size && strncmp(x, arr + l * _idxLen, _idxLen) == 0);
-        while (l < size && strncmp(x, arr + l * _idxLen, _idxLen) <= 0) l ++;
-        while (l > 0 && strncmp(x, arr + (l - 1) * _idxLen, _idxLen) > 0) l --;
-    }  else if (_idxType == IDX_TYPE_INT){
-        int x = *((int *)data);
-        int *arr = (int *)value;
-        while (l < r){
-            int mid = (l + r) >> 1;
-            if (arr[mid] < x) l = mid + 1;
-            else if (arr[mid] > x) r = mid - 1;
-            else l = r = mid;
-        }
-        if (equals) *equals = (l < size && arr[l] == x);
-        while (l < size && arr[l] <= x) l ++;
-        while (l > 0 && arr[l - 1] > x) l --;
-        //for (int i = 0; i < size; i ++) printf("%d ", arr[i]);
-        //printf("(%d)\n", size);
-    }
-    return l;
-}
-
-int BPlusTree::emptyBlockPosition_p(){
-    if (_emptyNode == 0){
-        char block[_blkSize];
-        memset(block, 0, _blkSize);
-        return _fm -> writeNewBlock(block) / _blkSize;
-    }
-    int ret = _emptyNode;
-    BPlusTreeBlock *block = readBlock_p(ret);
-    _emptyNode = block -> data.empty.next;
-    clearBlock_p(block);
-    writeHeader_p();
-    return ret;
+void BPlusTree::resetStats(){
+    _stats.reset();
+    _bp -> resetCounts();
 }
 
-bool BPlusTree::insert_p(BPlusTreeBlock *block, void *data, int posPage, int posSlot){
-    bool ret;
-    if (block -> type == TREE_NODE_TYPE_LEAF){
-        int equals;
-        int loc = calcBlockPosition_p(data, block, &equals);
-        if (equals) ret = 0;
-        else {
-            addToLeaf_p(data, posPage, posSlot, block, loc);
-            if (block -> data.leaf.size <= _leafDataCount) writeBlock_p(block);
-            ret = 1;
-        }
-    }  else if (block -> type == TREE_NODE_TYPE_NONLEAF){
-        int loc = calcBlockPosition_p(data, block);
-        BPlusTreeBlock *child = readBlock_p(block -> data.nonleaf.child[loc]);
-        ret = insert_p(child, data, posPage, posSlot);
-        BPlusTreeBlock *newBlock = 0;
-        if (child -> type == TREE_NODE_TYPE_NONLEAF && child -> data.nonleaf.size > _nonLeafDataCount) newBlock = splitNonLeaf_p(child);
-        else if (child -> type == TREE_NODE_TYPE_LEAF && child -> data.leaf.size > _leafDataCount) newBlock = splitLeaf_p(child);
-        if (newBlock){
-            writeBlock_p(child);
-            writeBlock_p(newBlock);
-            addToNonLeaf_p(newBlock, block, loc);
-            if (block -> data.nonleaf.size <= _nonLeafDataCount) writeBlock_p(block);
-            clearBlock_p(newBlock);
-        }
-        clearBlock_p(child);
-    }
+/* Iterator over the values between from and to inclusive */
+BPlusTreeIterator BPlusTree::scan(void *from, void *to, bool prefetch){
+    BPlusTreeGuard guard(this);
+    BPlusTreeIterator ret = lowerBound(from, prefetch);
+    ret._end = ret._last + _idxLen;
+    _layout -> copyKey(ret._end, to);
+    ret.settle_p();
     return ret;
 }
 
-void BPlusTree::mergeLeaf_p(BPlusTreeBlock *block, BPlusTreeBlock *nextBlock){
-    int lSize = block -> data.leaf.size, rSize = nextBlock -> data.leaf.size;
-    block -> data.leaf.next = nextBlock -> data.leaf.next;
-    memcpy(block -> data.leaf.posPage + lSize, nextBlock -> data.leaf.posPage, sizeof(int) * rSize);
-    memcpy(block -> data.leaf.posSlot + lSize, nextBlock -> data.leaf.posSlot, sizeof(int) * rSize);
-    memcpy(((char *)block -> data.leaf.value) + _idxLen * lSize, nextBlock -> data.leaf.value, _idxLen * rSize);
-    block -> data.leaf.size = lSize + rSize;
-}
-
-void BPlusTree::mergeNonLeaf_p(BPlusTreeBlock *block, BPlusTreeBlock *nextBlock){
-    BPlusTreeBlock *b = nextBlock;
-    while (b -> type != TREE_NODE_TYPE_LEAF){
-        BPlusTreeBlock *nb = readBlock_p(b -> data.nonleaf.child[0]);
-        if (b != nextBlock) clearBlock_p(b);
-        b = nb;
-    }
-    int lSize = block -> data.nonleaf.size, rSize = nextBlock -> data.nonleaf.size;
-    memcpy(block -> data.nonleaf.child + lSize + 1, nextBlock -> data.nonleaf.child, sizeof(int) * (rSize + 1));
-    memcpy(((char *)block -> data.nonleaf.value) + _idxLen * (lSize + 1), nextBlock -> data.nonleaf.value, _idxLen * rSize);
-    memcpy(((char *)block -> data.nonleaf.value) + _idxLen * lSize, b -> data.leaf.value, _idxLen);
-    block -> data.nonleaf.size = lSize + rSize + 1;
-    clearBlock_p(b);
-}
-
-BPlusTree::BPlusTreeBlock *BPlusTree::newBlock_p(int position, int type){
-    BPlusTreeBlock *ret = new BPlusTreeBlock;
-    ret -> position = position;
-    ret -> type = type;
-    if (ret -> type == TREE_NODE_TYPE_EMPTY){
-        ret -> data.empty.next = 0;
-    }  else if (ret -> type == TREE_NODE_TYPE_LEAF){
-        ret -> data.leaf.size = 0;
-        ret -> data.leaf.next = 0;
-        ret -> data.leaf.posPage = new int[_leafDataCount + 1];
-        ret -> data.leaf.posSlot = new int[_leafDataCount + 1];
-        ret -> data.leaf.value = (void *)new char[_leafDataCount * _idxLen + _idxLen];
-    }  else {
-        ret -> data.nonleaf.size = 0;
-        ret -> data.nonleaf.child = new int[_nonLeafDataCount + 2];
-        ret -> data.nonleaf.value = (void *)new char[_nonLeafDataCount * _idxLen + _idxLen];
-    }
+/* Nodes filled less than minFill after a remove are merged or refilled from a neighbour, a higher minimum keeps the tree denser for more work per remove */
+void BPlusTree::setMinFill(double minFill){
+    BPlusTreeGuard guard(this);
+    if (minFill < 0) minFill = 0;
+    if (minFill > 1) minFill = 1;
+    lockTree_p();
+    _minFill = minFill;
+    unlockTree_p();
+}
+
+/* Turning the node cache on reads every non-leaf node once, turning it off keeps its memory for the next time */
+void BPlusTree::setNodeCache(bool on){
+    BPlusTreeGuard guard(this);
+    lockTree_p();
+    _cacheNodes = on;
+    if (on){
+        if (!_nodeCache) __atomic_store_n(&_nodeCache, new NodeCache(_layout), __ATOMIC_RELEASE);
+        loadNodeCache_p();
+    }  else if (_nodeCache) _nodeCache -> clear();
+    unlockTree_p();
+}
+
+/* SPLIT_HALVES or SPLIT_SHIFT, see the class comment */
+void BPlusTree::setSplitPolicy(int policy){
+    BPlusTreeGuard guard(this);
+    lockTree_p();
+    _splitPolicy = policy;
+    unlockTree_p();
+}
+
+/* Latencies of query(), insert() and remove() are measured while timing is on */
+void BPlusTree::setStatsTiming(bool timing){
+    _stats.setTiming(timing);
+}
+
+/* Counters so far, and with structure the shape of the tree, which takes reading every node under the shared tree latch */
+BPlusTreeStats BPlusTree::stats(bool structure) const{
+    BPlusTreeGuard guard((BPlusTree *)this);
+    BPlusTreeStats ret;
+    _stats.read(ret.counters, &ret.latency[0][0]);
+    _bp -> counts(&ret.cacheHits, &ret.cacheMisses, &ret.pageWrites);
+    ret.height = 0;
+    ret.postingPages = 0;
+    lockShared_p();
+    ret.nodeCacheBytes = _cacheNodes ? _nodeCache -> bytes() : 0;
+    ret.freeBlocks = _freeCount;
+    ret.fileBlocks = _fm -> fileSize() / _blkSize;
+    if (structure) structureStats_p(&ret);
+    unlockShared_p();
     return ret;
 }
 
-void BPlusTree::print_p(BPlusTreeBlock *block) const{
-    void *data;
-    int size;
-    if (block -> type == TREE_NODE_TYPE_LEAF){
-        data = block -> data.leaf.value;
-        size = block -> data.leaf.size;
-    }  else {
-        data = block -> data.nonleaf.value;
-        size = block -> data.nonleaf.size;
-    }
-    if (_idxType == IDX_TYPE_INT){
-        int *arr = (int *)data;
-        for (int i = 0; i < size; i ++){
-            if (block -> type == TREE_NODE_TYPE_NONLEAF){
-                printf("(");
-                BPlusTreeBlock *child = readBlock_p(block -> data.nonleaf.child[i]);
-                print_p(child);
-                clearBlock_p(child);
-                printf(")");
-            }
-            printf(" %d", arr[i]);
-            if (block -> type == TREE_NODE_TYPE_LEAF)
-                printf(",%d,%d", block -> data.leaf.posPage[i], block -> data.leaf.posSlot[i]);
-            putchar(' ');
-        }
-        if (block -> type == TREE_NODE_TYPE_NONLEAF){
-            printf("(");
-            BPlusTreeBlock *child = readBlock_p(block -> data.nonleaf.child[size]);
-            print_p(child);
-            clearBlock_p(child);
-            printf(")");
+/*
+ * Checks the tree under the shared tree latch, so that only updates within a
+ * leaf go on meanwhile. With several threads, the top levels are checked
+ * first and split into subtrees that the threads then take in turn; the leaf
+ * chain between subtrees and the free-space map are checked once all are.
+ */
+int BPlusTree::verify(std::vector <BPlusTreeProblem> *problems, int threads){
+    BPlusTreeGuard guard(this);
+    if (threads < 1) threads = 1;
+    std::vector <BPlusTreeSubtree> subtrees(1), below;
+    std::vector <BPlusTreeVerifier> verifiers(threads);
+    pthread_t workers[threads];
+    int next = 0;
+    lockShared_p();
+    int fileBlocks = _fm -> fileSize() / _blkSize, leafDepth = -1;
+    /* The leftmost path gives the depth of every leaf */
+    try {
+        for (int depth = 0, position = _rootBlock.position; depth <= VERIFY_MAX_HEIGHT && position >= FIRST_NODE_BLOCK && position < fileBlocks; depth ++){
+            BPlusTreeBlock b;
+            readBlock_p(position, &b);
+            int type = NodeLayout::type(b.page);
+            position = type == TREE_NODE_TYPE_NONLEAF ? _layout -> child(b.page, 0) : 0;
+            clearBlock_p(&b);
+            if (type == TREE_NODE_TYPE_LEAF) leafDepth = depth;
         }
-    }  else {
-        char *arr = (char *)data;
-        for (int i = 0; i < size; i ++){
-            if (block -> type == TREE_NODE_TYPE_NONLEAF){
-                printf("(");
-                BPlusTreeBlock *child = readBlock_p(block -> data.nonleaf.child[i]);
-                print_p(child);
-                clearBlock_p(child);
-                printf(")");
+    }  catch (BufferPoolException &e){
+        if (e.errNo() != BufferPoolException::ERR_BAD_PAGE) throw;
+    }
+    for (int i = 0; i < threads; i ++){
+        verifiers[i].tree = this;
+        verifiers[i].subtrees = &subtrees;
+        verifiers[i].next = &next;
+        verifiers[i].fileBlocks = fileBlocks;
+        verifiers[i].leafDepth = leafDepth;
+    }
+    subtrees[0].position = _rootBlock.position;
+    subtrees[0].depth = 0;
+    subtrees[0].checked = false;
+    while (threads > 1 && (int)subtrees.size() < threads * VERIFY_SUBTREES){
+        bool split = false;
+        below.clear();
+        for (int i = 0; i < (int)subtrees.size(); i ++){
+            int count = below.size();
+            if (!subtrees[i].checked) verifySubtree_p(&verifiers[0], &subtrees[i], &below);
+            if ((int)below.size() > count) split = true;
+            else {
+                /* A leaf or a node that could not be read, nothing is left to check below it */
+                subtrees[i].checked = true;
+                below.push_back(subtrees[i]);
             }
-            putchar(' ');
-            for (int j = 0; j < _idxLen; j ++) 
-                putchar(arr[j + i * _idxLen]);
-            if (block -> type == TREE_NODE_TYPE_LEAF)
-                printf(",%d,%d", block -> data.leaf.posPage[i], block -> data.leaf.posSlot[i]);
-            putchar(' ');
-        }
-        if (block -> type == TREE_NODE_TYPE_NONLEAF){
-            printf("(");
-            BPlusTreeBlock *child = readBlock_p(block -> data.nonleaf.child[size]);
-            print_p(child);
-            clearBlock_p(child);
-            printf(")");
         }
+        subtrees.swap(below);
+        if (!split) break;
     }
-}
+    for (int i = 1; i < threads; i ++) pthread_create(&workers[i], 0, verifyThread_p, &verifiers[i]);
+    verifyThread_p(&verifiers[0]);
+    for (int i = 1; i < threads; i ++) pthread_join(workers[i], 0);
+    for (int i = 1; i < threads; i ++) verifiers[0].shortLists.insert(verifiers[0].shortLists.end(), verifiers[i].shortLists.begin(), verifiers[i].shortLists.end());
+    verifyShortLists_p(&verifiers[0], verifiers[0].shortLists);
 
-bool BPlusTree::remove_p(BPlusTreeBlock *block, void *data){
-    bool ret;
-    if (block -> type == TREE_NODE_TYPE_LEAF){
-        int equals;
-        int loc = calcBlockPosition_p(data, block, &equals) - 1;
-        if (!equals) ret = 0;
-        else {
-            removeFromLeaf_p(block, loc);
-            writeBlock_p(block);
-            ret = 1;
-        }
-    }  else if (block -> type == TREE_NODE_TYPE_NONLEAF){
-        int loc = calcBlockPosition_p(data, block);
-        BPlusTreeBlock *child = readBlock_p(block -> data.nonleaf.child[loc]);
-        ret = remove_p(child, data);
-        if (ret){
-            BPlusTreeBlock *nextChild = 0, *lastChild = 0;
-            if (loc > 0) lastChild = readBlock_p(block -> data.nonleaf.child[loc - 1]);
-            if (loc < block -> data.nonleaf.size) nextChild = readBlock_p(block -> data.nonleaf.child[loc + 1]);
-            if (lastChild && ((child -> type == TREE_NODE_TYPE_NONLEAF && lastChild -> data.nonleaf.size + child -> data.nonleaf.size + 1 <= _nonLeafDataCount)
-                    || (child -> type == TREE_NODE_TYPE_LEAF && lastChild -> data.leaf.size + child -> data.leaf.size <= _leafDataCount))){
-                if (child -> type == TREE_NODE_TYPE_LEAF) mergeLeaf_p(lastChild, child);
-                else mergeNonLeaf_p(lastChild, child);
-                addEmptyBlock_p(child -> position);
-                removeFromNonLeaf_p(block, loc);
-                writeBlock_p(lastChild);
-                writeBlock_p(block);
-            }  else if (nextChild && ((child -> type == TREE_NODE_TYPE_NONLEAF && 
-                            nextChild -> data.nonleaf.size + child -> data.nonleaf.size + 1 <= _nonLeafDataCount) || (child -> type == TREE_NODE_TYPE_LEAF &&
-                            nextChild -> data.leaf.size + child -> data.leaf.size <= _leafDataCount))){
-                if (child -> type == TREE_NODE_TYPE_LEAF) mergeLeaf_p(child, nextChild);
-                else mergeNonLeaf_p(child, nextChild); 
-                addEmptyBlock_p(nextChild -> position);
-                removeFromNonLeaf_p(block, loc + 1);
-                writeBlock_p(child);
-                writeBlock_p(block);
-            }
-            if (nextChild) clearBlock_p(nextChild);
-            if (lastChild) clearBlock_p(lastChild);
+    std::vector <BPlusTreeProblem> found;
+    std::vector <int> blocks;
+    for (int i = 0; i < threads; i ++){
+        found.insert(found.end(), verifiers[i].problems.begin(), verifiers[i].problems.end());
+        blocks.insert(blocks.end(), verifiers[i].blocks.begin(), verifiers[i].blocks.end());
+    }
+    int prevLeaf = 0, prevNext = 0;
+    for (int i = 0; i < (int)subtrees.size(); i ++){
+        BPlusTreeSubtree &s = subtrees[i];
+        if (s.firstLeaf > 0 && prevLeaf > 0 && prevNext != s.firstLeaf) addProblem_p(found, BPlusTreeProblem::LEAF_CHAIN, s.firstLeaf);
+        if (s.lastLeaf){
+            prevLeaf = s.lastLeaf;
+            prevNext = s.lastNext;
         }
-        clearBlock_p(child);
     }
-    return ret;
+    if (prevLeaf > 0 && prevNext) addProblem_p(found, BPlusTreeProblem::LEAF_CHAIN, prevLeaf);
+    verifyFreeMap_p(blocks, found);
+    unlockShared_p();
+    if (problems) problems -> insert(problems -> end(), found.begin(), found.end());
+    return found.size();
 }
 
-void BPlusTree::removeFromLeaf_p(BPlusTreeBlock *block, int loc){
-    int size = block -> data.leaf.size --;
-    memmove(block -> data.leaf.posPage + loc, block -> data.leaf.posPage + loc + 1, (size - loc - 1) * sizeof(int));
-    memmove(block -> data.leaf.posSlot + loc, block -> data.leaf.posSlot + loc + 1, (size - loc - 1) * sizeof(int));
-    memmove(((char *)block -> data.leaf.value) + _idxLen * loc, ((char *)block -> data.leaf.value) + _idxLen * (loc + 1), (size - loc - 1) * _idxLen);
+void BPlusTree::clearBlock_p(BPlusTreeBlock *block) const{
+    _bp -> unpin(block -> frame);
+    if (block != &_rootBlock && _guard && _guard -> tree == this) dropFrame(_guard -> pins, block -> frame);
 }
 
-/* Remove the child and the value BEFORE it */
-void BPlusTree::removeFromNonLeaf_p(BPlusTreeBlock *block, int loc){
-    int size = block -> data.nonleaf.size --;
-    memmove(block -> data.nonleaf.child + loc, block -> data.nonleaf.child + loc + 1, (size - loc) * sizeof(int));
-    memmove(((char *)block -> data.nonleaf.value) + _idxLen * (loc - 1), ((char *)block -> data.nonleaf.value) + _idxLen * loc, (size - loc) * _idxLen);
+/* Makes the only child of the root the root, as long as there is one */
+void BPlusTree::collapseRoot_p(){
+    while (NodeLayout::type(_rootBlock.page) == TREE_NODE_TYPE_NONLEAF && NodeLayout::size(_rootBlock.page) == 0){
+        BPlusTreeBlock newRoot;
+        readBlock_p(_layout -> child(_rootBlock.page, 0), &newRoot);
+        freeBlock_p(_rootBlock.position);
+        setRoot_p(&newRoot);
+        _headerDirty = true;
+    }
 }
 
-BPlusTree::BPlusTreeBlock *BPlusTree::splitLeaf_p(BPlusTreeBlock *block){
-    BPlusTreeBlock *ret = newBlock_p(emptyBlockPosition_p(), TREE_NODE_TYPE_LEAF);
-    int lSize = block -> data.leaf.size / 2, rSize = block -> data.leaf.size - lSize;
-    ret -> data.leaf.next = block -> data.leaf.next;
-    block -> data.leaf.next = ret -> position;
-    memcpy(ret -> data.leaf.posPage, block -> data.leaf.posPage + lSize, sizeof(int) * rSize);
-    memcpy(ret -> data.leaf.posSlot, block -> data.leaf.posSlot + lSize, sizeof(int) * rSize);
-    char *arr = (char *)block -> data.leaf.value;
-    memcpy(ret -> data.leaf.value, arr + _idxLen * lSize, _idxLen * rSize);
-    block -> data.leaf.size = lSize;
-    ret -> data.leaf.size = rSize;
-    return ret;
+void BPlusTree::addProblem_p(std::vector <BPlusTreeProblem> &problems, int kind, int position){
+    BPlusTreeProblem problem;
+    problem.kind = kind;
+    problem.position = position;
+    problems.push_back(problem);
 }
 
-BPlusTree::BPlusTreeBlock *BPlusTree::splitNonLeaf_p(BPlusTreeBlock *block){
-    BPlusTreeBlock *ret = newBlock_p(emptyBlockPosition_p(), TREE_NODE_TYPE_NONLEAF);
-    int lSize = block -> data.nonleaf.size / 2, rSize = block -> data.nonleaf.size - lSize - 1;
-    memcpy(ret -> data.nonleaf.child, block -> data.nonleaf.child + lSize + 1, sizeof(int) * (rSize + 1));
-    char *arr = (char *)block -> data.nonleaf.value;
-    memcpy(ret -> data.nonleaf.value, arr + _idxLen * (lSize + 1), _idxLen * rSize);
-    block -> data.nonleaf.size = lSize;
-    ret -> data.nonleaf.size = rSize;
-    return ret;
+/*
+ * Ends the exclusive section of a call that threw, for its guard. With a log
+ * the section is rolled back, see rollback_p. Without one there is nothing to
+ * roll back to: what the section changed so far stays, committed as when a
+ * section ends, and the node cache, which may have missed some of it, is
+ * loaded again. If either throws too, the section is left as it is and the
+ * node cache unused until the next section ends; with a log the next open
+ * recovers the file.
+ */
+void BPlusTree::abortTree_p(){
+    _cacheBlocks.clear();
+    _cacheReload = true;
+    try {
+        if (_log){
+            rollback_p();
+            _guard -> treeLatch = 0;
+            __atomic_fetch_add(&_treeVersion, 1, __ATOMIC_ACQ_REL);
+            pthread_rwlock_unlock(&_treeLatch);
+            return;
+        }
+        unlockTree_p();
+    }  catch (...){
+        /* Only waiting for the commit threw, the section was over */
+        if (_guard -> treeLatch != GUARD_EXCLUSIVE) return;
+        _guard -> treeLatch = 0;
+        _logBlocks.clear();
+        _cacheBlocks.clear();
+        if (_nodeCache) _nodeCache -> clear();
+        __atomic_fetch_add(&_treeVersion, 1, __ATOMIC_ACQ_REL);
+        pthread_rwlock_unlock(&_treeLatch);
+    }
+}
+
+/* Appends a map page covering the next _mapBits blocks, none of them free yet */
+void BPlusTree::addMapBlock_p(){
+    char block[_blkSize];
+    memset(block, 0, _blkSize);
+    _mapBlocks.push_back(_fm -> writeNewBlock(block) / _blkSize);
+    _mapDirty.push_back(true);
+    if (_mapBlocks.size() > 1) _mapDirty[_mapBlocks.size() - 2] = true;
+    _headerDirty = true;
+    _freeMap.resize((long)_mapBlocks.size() * _mapBits / 8);
 }
 
-BPlusTree::BPlusTreeBlock *BPlusTree::readBlock_p(int position) const{
-    char *d = _fm -> readBlock(position * _blkSize);
-    char *data = d;
-    BPlusTreeBlock *ret = new BPlusTreeBlock;
-    ret -> position = position;
-    memcpy(&ret -> type, data, sizeof(int));
-    data += sizeof(int);
-    if (ret -> type == TREE_NODE_TYPE_EMPTY){
-        memcpy(&ret -> data.empty.next, data, sizeof(int));
-    }  else if (ret -> type == TREE_NODE_TYPE_LEAF){
-        memcpy(&ret -> data.leaf.size, data, sizeof(int));
-        data += sizeof(int);
-
-        memcpy(&ret -> data.leaf.next, data, sizeof(int));
-        data += sizeof(int);
-
-        ret -> data.leaf.posPage = new int[_leafDataCount + 1];
-        memcpy(ret -> data.leaf.posPage, data, sizeof(int) * _leafDataCount);
-        data += sizeof(int) * _leafDataCount;
-
-        ret -> data.leaf.posSlot = new int[_leafDataCount + 1];
-        memcpy(ret -> data.leaf.posSlot, data, sizeof(int) * _leafDataCount);
-        data += sizeof(int) * _leafDataCount;
-
-        ret -> data.leaf.value = (void *)new char[_leafDataCount * _idxLen + _idxLen];
-        memcpy(ret -> data.leaf.value, data, _leafDataCount * _idxLen);
-        //printf("%d %d\n", data - d + _leafDataCount * _idxLen, _blkSize);
-    }  else if (ret -> type == TREE_NODE_TYPE_NONLEAF){
-        memcpy(&ret -> data.nonleaf.size, data, sizeof(int));
-        data += sizeof(int);
-
-        ret -> data.nonleaf.child = new int[_nonLeafDataCount + 2];
-        memcpy(ret -> data.nonleaf.child, data, sizeof(int) * (_nonLeafDataCount + 1));
-        data += sizeof(int) * (_nonLeafDataCount + 1);
-
-        ret -> data.nonleaf.value = (void *)new char[_nonLeafDataCount * _idxLen + _idxLen];
-        memcpy(ret -> data.nonleaf.value, data, _nonLeafDataCount * _idxLen);
-        //printf("%d %d\n", data - d + _nonLeafDataCount * _idxLen, _blkSize);
-    }
-    delete []d;
+/* A free block close to near, else the lowest free one so that the end of the file empties for compact(); the file grows if none is free */
+int BPlusTree::allocBlock_p(int near){
+    if (!_freeCount){
+        _stats.count(TreeStats::COUNTER_FILE_GROWTHS);
+        /* The header keeps the file length */
+        _headerDirty = true;
+        char block[_blkSize];
+        memset(block, 0, _blkSize);
+        return _fm -> writeNewBlock(block) / _blkSize;
+    }
+    int bytes = _freeMap.size(), at = near / 8 < bytes ? near / 8 : bytes;
+    int ret = findFree_p(at, at + LOCALITY_WINDOW < bytes ? at + LOCALITY_WINDOW : bytes);
+    if (ret == -1) ret = findFree_p(at > LOCALITY_WINDOW ? at - LOCALITY_WINDOW : 0, at);
+    if (ret == -1){
+        ret = findFree_p(_freeHint, bytes);
+        _freeHint = ret / 8;
+    }
+    setFree_p(ret, false);
+    _stats.count(TreeStats::COUNTER_ALLOCATIONS);
     return ret;
 }
 
-void BPlusTree::writeBlock_p(BPlusTreeBlock *block){
-    char d[_blkSize];
-    char *data = d;
-    memcpy(data, &block -> type, sizeof(int));
-    data += sizeof(int);
-    if (block -> type == TREE_NODE_TYPE_EMPTY){
-        memcpy(data, &block -> data.empty.next, sizeof(int));
-    }  else if (block -> type == TREE_NODE_TYPE_LEAF){
-        memcpy(data, &block -> data.leaf.size, sizeof(int));
-        data += sizeof(int);
+/*
+ * Moves values from the fuller of the leaves loc and loc + 1 of the non-leaf
+ * block into the other one until both are about as full, then works out
+ * their separator anew. Returns false, changing nothing, if no value could be
+ * moved or the new separator does not fit.
+ */
+bool BPlusTree::balanceLeaves_p(BPlusTreeBlock *block, int loc){
+    char *page = block -> page;
+    BPlusTreeBlock left, right;
+    readBlock_p(_layout -> child(page, loc), &left);
+    readBlock_p(_layout -> child(page, loc + 1), &right);
+    char savedLeft[_blkSize], savedRight[_blkSize], savedPage[_blkSize];
+    memcpy(savedLeft, left.page, _blkSize);
+    memcpy(savedRight, right.page, _blkSize);
+    memcpy(savedPage, page, _blkSize);
+    bool toLeft = _layout -> fill(left.page) < _layout -> fill(right.page);
+    bool ret = toLeft ? shiftLeaf_p(right.page, left.page, true, true) : shiftLeaf_p(left.page, right.page, false, true);
+    if (ret) ret = setLeafSeparator_p(page, loc, left.page, right.page);
+    if (ret){
+        _stats.count(TreeStats::COUNTER_REDISTRIBUTIONS);
+        writeBlock_p(&left);
+        writeBlock_p(&right);
+        writeBlock_p(block);
+    }  else {
+        memcpy(left.page, savedLeft, _blkSize);
+        memcpy(right.page, savedRight, _blkSize);
+        memcpy(page, savedPage, _blkSize);
+    }
+    clearBlock_p(&left);
+    clearBlock_p(&right);
+    return ret;
+}
 
-        memcpy(data, &block -> data.leaf.next, sizeof(int));
-        data += sizeof(int);
+/*
+ * Spreads the values of the leaves loc, loc + 1 and loc + 2 of the non-leaf
+ * block over the first two, which lets nodes stay more than half full where
+ * two neighbours cannot be merged. Returns false, changing nothing, if they
+ * do not fit.
+ */
+bool BPlusTree::mergeLeaves_p(BPlusTreeBlock *block, int loc){
+    char *page = block -> page;
+    BPlusTreeBlock left, mid, right;
+    readBlock_p(_layout -> child(page, loc), &left);
+    readBlock_p(_layout -> child(page, loc + 1), &mid);
+    readBlock_p(_layout -> child(page, loc + 2), &right);
+    bool ret = _layout -> fill(left.page) + _layout -> fill(mid.page) + _layout -> fill(right.page) <= 2;
+    if (ret){
+        char savedLeft[_blkSize], savedMid[_blkSize], savedPage[_blkSize];
+        memcpy(savedLeft, left.page, _blkSize);
+        memcpy(savedMid, mid.page, _blkSize);
+        memcpy(savedPage, page, _blkSize);
+        /* The left leaf is filled up, leaving room in the middle one for the right one */
+        shiftLeaf_p(mid.page, left.page, true, false);
+        ret = NodeLayout::size(mid.page) > 0 && _layout -> mergeLeaf(mid.page, right.page);
+        if (ret){
+            _layout -> removeNonLeaf(page, loc + 2);
+            ret = setLeafSeparator_p(page, loc, left.page, mid.page);
+        }
+        if (ret){
+            _stats.count(TreeStats::COUNTER_MERGES);
+            freeBlock_p(right.position);
+            writeBlock_p(&left);
+            writeBlock_p(&mid);
+            writeBlock_p(block);
+        }  else {
+            memcpy(left.page, savedLeft, _blkSize);
+            memcpy(mid.page, savedMid, _blkSize);
+            memcpy(page, savedPage, _blkSize);
+        }
+    }
+    clearBlock_p(&left);
+    clearBlock_p(&mid);
+    clearBlock_p(&right);
+    if (ret) balanceLeaves_p(block, loc);
+    return ret;
+}
 
-        memcpy(data, block -> data.leaf.posPage, sizeof(int) * _leafDataCount);
-        data += sizeof(int) * _leafDataCount;
+/* Same as balanceLeaves_p for non-leaf children, every child moved over takes the parent value down with it and sends its neighbouring value up */
+bool BPlusTree::balanceNonLeaves_p(BPlusTreeBlock *block, int loc){
+    char *page = block -> page;
+    BPlusTreeBlock left, right;
+    readBlock_p(_layout -> child(page, loc), &left);
+    readBlock_p(_layout -> child(page, loc + 1), &right);
+    char savedLeft[_blkSize], savedRight[_blkSize], savedPage[_blkSize];
+    memcpy(savedLeft, left.page, _blkSize);
+    memcpy(savedRight, right.page, _blkSize);
+    memcpy(savedPage, page, _blkSize);
+    bool toLeft = _layout -> fill(left.page) < _layout -> fill(right.page);
+    char *from = toLeft ? right.page : left.page, *to = toLeft ? left.page : right.page;
+    char sep[_idxLen];
+    _layout -> readKey(page, loc, sep);
+    int moved = 0;
+    while (NodeLayout::size(from) > 1 && _layout -> fill(to) < _layout -> fill(from)){
+        int n = NodeLayout::size(from);
+        if (toLeft){
+            if (!_layout -> insertNonLeaf(to, NodeLayout::size(to), sep, _layout -> child(from, 0))) break;
+            _layout -> readKey(from, 0, sep);
+            _layout -> setChild(from, 0, _layout -> child(from, 1));
+            _layout -> removeNonLeaf(from, 1);
+        }  else {
+            if (!_layout -> insertNonLeaf(to, 0, sep, _layout -> child(to, 0))) break;
+            _layout -> setChild(to, 0, _layout -> child(from, n));
+            _layout -> readKey(from, n - 1, sep);
+            _layout -> removeNonLeaf(from, n);
+        }
+        moved ++;
+    }
+    bool ret = moved > 0 && setSeparator_p(page, loc, sep);
+    if (ret){
+        _stats.count(TreeStats::COUNTER_REDISTRIBUTIONS);
+        writeBlock_p(&left);
+        writeBlock_p(&right);
+        writeBlock_p(block);
+    }  else {
+        memcpy(left.page, savedLeft, _blkSize);
+        memcpy(right.page, savedRight, _blkSize);
+        memcpy(page, savedPage, _blkSize);
+    }
+    clearBlock_p(&left);
+    clearBlock_p(&right);
+    return ret;
+}
 
-        memcpy(data, block -> data.leaf.posSlot, sizeof(int) * _leafDataCount);
-        data += sizeof(int) * _leafDataCount;
+void BPlusTree::batchOrder_p(BPlusTreeBatch *batch, int count){
+    batch -> order = new int[count];
+    for (int i = 0; i < count; i ++) batch -> order[i] = i;
+    BatchKeyLess less;
+    less.layout = _layout;
+    less.data = batch -> data;
+    less.idxLen = _idxLen;
+    std::stable_sort(batch -> order, batch -> order + count, less);
+}
 
-        memcpy(data, block -> data.leaf.value, _leafDataCount * _idxLen);
-    }  else if (block -> type == TREE_NODE_TYPE_NONLEAF){
-        memcpy(data, &block -> data.nonleaf.size, sizeof(int));
-        data += sizeof(int);
+/* End of the batch keys from `from` on that fall under child loc of the non-leaf page */
+int BPlusTree::batchGroupEnd_p(char *page, int loc, BPlusTreeBatch *batch, int from, int to){
+    if (loc == NodeLayout::size(page)) return to;
+    char upper[_idxLen];
+    _layout -> readKey(page, loc, upper);
+    int i = from + 1;
+    while (i < to && _layout -> compare(batch -> data + batch -> order[i] * _idxLen, upper) < 0) i ++;
+    return i;
+}
 
-        memcpy(data, block -> data.nonleaf.child, sizeof(int) * (_nonLeafDataCount + 1));
-        data += sizeof(int) * (_nonLeafDataCount + 1);
+/* Replaces the level described by values and positions with its parent level, children spread evenly over the parents as far as they fit */
+void BPlusTree::bulkLoadLevel_p(std::vector <char> &values, std::vector <int> &positions, int perNode){
+    int n = positions.size(), nodes = (n + perNode - 1) / perNode;
+    std::vector <char> parentValues;
+    std::vector <int> parentPositions;
+    std::vector <char> run;
+    char page[_blkSize];
+    int first = 0, runFirst = 0;
+    for (int i = 0, c = 0; c < n; i ++){
+        int left = nodes - i > 1 ? nodes - i : 1;
+        int children = (n - c + left - 1) / left, j = 1;
+        memset(page, 0, _blkSize);
+        _layout -> init(page, TREE_NODE_TYPE_NONLEAF);
+        _layout -> setChild(page, 0, positions[c]);
+        while (j < children && _layout -> insertNonLeaf(page, j - 1, &values[(c + j) * _idxLen], positions[c + j])) j ++;
+        parentValues.insert(parentValues.end(), values.begin() + c * _idxLen, values.begin() + (c + 1) * _idxLen);
+        /* Reserve the first node, the following ones are appended right after it; it is written again with them, checksummed */
+        if (!i) first = _fm -> writeNewBlock(page) / _blkSize;
+        if (run.empty()) runFirst = first + i;
+        run.insert(run.end(), page, page + _blkSize);
+        if ((int)run.size() == BULK_WRITE_RUN * _blkSize) writeRun_p(runFirst, run);
+        parentPositions.push_back(first + i);
+        c += j;
+    }
+    if (run.size()) writeRun_p(runFirst, run);
+    values.swap(parentValues);
+    positions.swap(parentPositions);
+}
 
-        memcpy(data, block -> data.nonleaf.value, _nonLeafDataCount * _idxLen);
+/* Logs the images of the given pinned blocks as one group and returns the lsn that ends it */
+long BPlusTree::commit_p(BPlusTreeBlock *blocks, int count){
+    std::vector <char> group;
+    for (int i = 0; i < count; i ++){
+        /* Recovery writes the image straight to the file, it must carry its checksum */
+        if (_checksums) PageChecksum::stamp(blocks[i].page, _blkSize, blocks[i].position);
+        _log -> addPage(group, blocks[i].position, blocks[i].page, _blkSize);
     }
-    _fm -> writeBlock(block -> position * _blkSize, d);
+    long lsn = _log -> commit(group);
+    for (int i = 0; i < count; i ++) _bp -> logged(blocks[i].frame, lsn);
+    return lsn;
 }
 
-void BPlusTree::writeHeader_p(){
-    char block[_blkSize];
-    memset(block, 0, _blkSize);
-    memcpy(block, B_TREE_FILE_HEADER, B_TREE_FILE_HEADER_LEN);
-    if (_rootBlock) memcpy(block + B_TREE_FILE_HEADER_LEN, &_rootBlock -> position, sizeof(int));
-    memcpy(block + B_TREE_FILE_HEADER_LEN + sizeof(int), &_emptyNode, sizeof(int));
-    _fm -> writeBlock(_blkSize, block);
+/*
+ * Crabs down to the leaf that may hold data: a child is latched before its
+ * parent is released. Inner nodes are latched shared, the leaf exclusively if
+ * asked. The leaf is returned pinned and latched, see releaseBlock_p. Needs
+ * the tree latch held shared, so node types cannot change under the caller.
+ * With the node cache on, the leaf is found in it and read alone.
+ */
+void BPlusTree::descend_p(const void *data, BPlusTreeBlock *leaf, bool exclusive) const{
+    int position = _cacheNodes ? _nodeCache -> leaf(data) : 0;
+    if (position){
+        readBlock_p(position, leaf);
+        latch_p(leaf -> frame, exclusive);
+        return;
+    }
+    BPlusTreeBlock b = _rootBlock;
+    latch_p(b.frame, exclusive && NodeLayout::type(b.page) == TREE_NODE_TYPE_LEAF);
+    while (NodeLayout::type(b.page) != TREE_NODE_TYPE_LEAF){
+        BPlusTreeBlock next;
+        readBlock_p(_layout -> child(b.page, _layout -> search(b.page, data)), &next);
+        latch_p(next.frame, exclusive && NodeLayout::type(next.page) == TREE_NODE_TYPE_LEAF);
+        releaseBlock_p(&b);
+        b = next;
+    }
+    *leaf = b;
 }
 
+/*
+ * Latch-free descent for readers: nothing shared is written, instead every
+ * node is validated against its version before the child position read from
+ * it is followed. Returns the size of the leaf, stored in leaf with its
+ * version and the tree version, or OPTIMISTIC_CONFLICT / OPTIMISTIC_MISS when
+ * a writer got in the way or a page is not cached. The leaf is neither pinned
+ * nor latched: anything read from it only counts once validate_p() agrees.
+ */
+int BPlusTree::descendOptimistic_p(const void *data, BPlusTreeBlock *leaf, unsigned long *version, unsigned long *treeVersion) const{
+    unsigned long tv = __atomic_load_n(&_treeVersion, __ATOMIC_ACQUIRE), v;
+    if (tv & 1) return OPTIMISTIC_CONFLICT;
+    BPlusTreeBlock b;
+    /* The node cache may be changing too, a wrong leaf fails validation like a changed page would */
+    NodeCache *cache = __atomic_load_n(&_nodeCache, __ATOMIC_ACQUIRE);
+    b.position = cache ? cache -> leaf(data) : 0;
+    if (!b.position) b.position = __atomic_load_n(&_rootBlock.position, __ATOMIC_RELAXED);
+    b.page = _bp -> lookup(b.position, &b.frame, &v);
+    while (b.page){
+        _stats.count(TreeStats::COUNTER_CACHED_READS);
+        /* Type and size are read once, the page may change under us */
+        int type = NodeLayout::type(b.page), size = NodeLayout::size(b.page);
+        if (type == TREE_NODE_TYPE_LEAF && size >= 0 && size <= _leafDataCount){
+            if (!validate_p(b.frame, v, tv)) return OPTIMISTIC_CONFLICT;
+            *leaf = b;
+            *version = v;
+            *treeVersion = tv;
+            return size;
+        }
+        if (type != TREE_NODE_TYPE_NONLEAF || size < 0 || size > _nonLeafDataCount) return OPTIMISTIC_CONFLICT;
+        int child = _layout -> child(b.page, _layout -> search(b.page, size, data));
+        if (!validate_p(b.frame, v, tv)) return OPTIMISTIC_CONFLICT;
+        b.position = child;
+        b.page = _bp -> lookup(child, &b.frame, &v);
+    }
+    return OPTIMISTIC_MISS;
+}
 
+/*
+ * Adds a position to value loc of the leaf, which gets a short list once it
+ * has two, a larger slot once its slot is full and a posting list of its own
+ * past _shortSize. The position goes into the list page it belongs in, which
+ * splits in halves when full. False if the value has the position already.
+ */
+bool BPlusTree::addPosting_p(BPlusTreeBlock *leaf, int loc, int posPage, int posSlot){
+    PostingList::Position p(posPage, posSlot), old(_layout -> posPage(leaf -> page, loc), _layout -> posSlot(leaf -> page, loc));
+    BPlusTreeBlock b;
+    if (old.first != POSTING_LIST){
+        std::vector <PostingList::Position> positions;
+        readPositions_p(leaf -> page, loc, positions);
+        std::vector <PostingList::Position>::iterator it = std::lower_bound(positions.begin(), positions.end(), p);
+        if (it != positions.end() && *it == p) return false;
+        positions.insert(it, p);
+        if (old.first <= POSTING_SHORT){
+            readBlock_p(old.second, &b);
+            if ((int)positions.size() <= PostingList::slotCapacity(b.page)){
+                PostingList::writeShort(b.page, POSTING_SHORT - old.first, &positions[0], positions.size());
+                writeBlock_p(&b);
+                clearBlock_p(&b);
+                return true;
+            }
+            clearBlock_p(&b);
+        }
+        /* A single position becomes a short list, a full short list moves to a larger slot or a page of its own */
+        freePostings_p(leaf -> page, loc);
+        setPositions_p(leaf, loc, positions);
+        return true;
+    }
+    int prev;
+    readBlock_p(findPosting_p(old.second, p, &prev), &b);
+    std::vector <PostingList::Position> positions;
+    PostingList::read(b.page, positions);
+    std::vector <PostingList::Position>::iterator it = std::lower_bound(positions.begin(), positions.end(), p);
+    if (it != positions.end() && *it == p){
+        clearBlock_p(&b);
+        return false;
+    }
+    positions.insert(it, p);
+    if (!PostingList::write(b.page, _pageSize, &positions[0], positions.size())){
+        BPlusTreeBlock split;
+        newBlock_p(TREE_NODE_TYPE_POSTING, &split, b.position);
+        PostingList::init(split.page);
+        int half = positions.size() / 2;
+        PostingList::write(b.page, _pageSize, &positions[0], half);
+        PostingList::write(split.page, _pageSize, &positions[half], positions.size() - half);
+        PostingList::next(split.page) = PostingList::next(b.page);
+        PostingList::next(b.page) = split.position;
+        writeBlock_p(&split);
+        clearBlock_p(&split);
+    }
+    writeBlock_p(&b);
+    clearBlock_p(&b);
+    readBlock_p(old.second, &b);
+    PostingList::total(b.page) ++;
+    writeBlock_p(&b);
+    clearBlock_p(&b);
+    return true;
+}
+
+/* Pins a page of short lists of class cls with a free slot into block and returns the slot, a new page goes near block near */
+int BPlusTree::allocShort_p(int near, int cls, BPlusTreeBlock *block){
+    if (_shortPages[cls]){
+        readBlock_p(_shortPages[cls], block);
+        int slot = PostingList::freeSlot(block -> page, _pageSize);
+        if (slot != -1) return slot;
+        clearBlock_p(block);
+    }
+    newBlock_p(TREE_NODE_TYPE_SHORT_POSTINGS, block, near);
+    PostingList::initShort(block -> page, _pageSize, cls);
+    _shortPages[cls] = block -> position;
+    _headerDirty = true;
+    return 0;
+}
+
+/* Lowest free block within bytes [from, to) of the free-space map, -1 if there is none */
+int BPlusTree::findFree_p(int from, int to){
+    for (int i = from; i < to; i ++)
+        if (_freeMap[i]) return i * 8 + __builtin_ctz(_freeMap[i]);
+    return -1;
+}
+
+/* The page of the posting list starting at first that position belongs in, the one before it is stored in prev, 0 for the first page */
+int BPlusTree::findPosting_p(int first, const std::pair <int, int> &position, int *prev) const{
+    *prev = 0;
+    for (int at = first; ; ){
+        BPlusTreeBlock b;
+        readBlock_p(at, &b);
+        int next = PostingList::next(b.page);
+        clearBlock_p(&b);
+        if (!next) return at;
+        readBlock_p(next, &b);
+        bool after = position < PostingList::first(b.page);
+        clearBlock_p(&b);
+        if (after) return at;
+        *prev = at;
+        at = next;
+    }
+}
+
+/* Position of value loc of the leaf page, the first of its posting list if it has one */
+std::pair <int, int> BPlusTree::firstPosition_p(char *page, int loc) const{
+    std::pair <int, int> ret(_layout -> posPage(page, loc), _layout -> posSlot(page, loc));
+    if (_duplicates && ret.first <= POSTING_LIST){
+        std::vector <PostingList::Position> positions;
+        BPlusTreeBlock b;
+        readBlock_p(ret.second, &b);
+        if (ret.first == POSTING_LIST) positions.push_back(PostingList::first(b.page));
+        else PostingList::readShort(b.page, POSTING_SHORT - ret.first, positions);
+        clearBlock_p(&b);
+        ret = positions[0];
+    }
+    return ret;
+}
+
+/* The page is left as it is, nothing reads a free block */
+void BPlusTree::freeBlock_p(int position){
+    _stats.count(TreeStats::COUNTER_FREES);
+    if (_cacheNodes) _nodeCache -> remove(position);
+    setFree_p(position, true);
+}
+
+/* Frees the posting list of value loc of the leaf page, if it has one */
+void BPlusTree::freePostings_p(char *page, int loc){
+    int posPage = _layout -> posPage(page, loc);
+    if (!_duplicates || posPage > POSTING_LIST) return;
+    if (posPage != POSTING_LIST){
+        BPlusTreeBlock b;
+        readBlock_p(_layout -> posSlot(page, loc), &b);
+        freeShort_p(&b, POSTING_SHORT - posPage);
+        return;
+    }
+    for (int at = _layout -> posSlot(page, loc); at; ){
+        BPlusTreeBlock b;
+        readBlock_p(at, &b);
+        int next = PostingList::next(b.page);
+        clearBlock_p(&b);
+        freeBlock_p(at);
+        at = next;
+    }
+}
+
+/* Frees slot of the page of short lists pinned in block and unpins it; the page is freed once no slot is in use, else new short lists of its class try it first */
+void BPlusTree::freeShort_p(BPlusTreeBlock *block, int slot){
+    int position = block -> position, cls = PostingList::slotClass(block -> page);
+    PostingList::writeShort(block -> page, slot, 0, 0);
+    bool empty = !PostingList::slotsUsed(block -> page);
+    if (!empty) writeBlock_p(block);
+    clearBlock_p(block);
+    if (empty) freeBlock_p(position);
+    int hint = empty ? (_shortPages[cls] == position ? 0 : _shortPages[cls]) : position;
+    if (hint != _shortPages[cls]){
+        _shortPages[cls] = hint;
+        _headerDirty = true;
+    }
+}
+
+/* On a split the new right sibling is left pinned in split and the value separating it from block is copied into sep, otherwise split -> position is -1 */
+bool BPlusTree::insert_p(BPlusTreeBlock *block, void *data, int posPage, int posSlot, BPlusTreeBlock *split, char *sep){
+    bool ret;
+    char *page = block -> page;
+    split -> position = -1;
+    if (NodeLayout::type(page) == TREE_NODE_TYPE_LEAF){
+        int equals;
+        int loc = _layout -> search(page, data, &equals);
+        if (equals) return _duplicates && addPosting_p(block, loc - 1, posPage, posSlot);
+        if (!_layout -> insertLeaf(page, loc, data, posPage, posSlot)){
+            /* The page cannot hold an extra value, so the layout splits it */
+            _stats.count(TreeStats::COUNTER_SPLITS);
+            newBlock_p(TREE_NODE_TYPE_LEAF, split, block -> position);
+            NodeLayout::next(split -> page) = NodeLayout::next(page);
+            NodeLayout::next(page) = split -> position;
+            _layout -> splitLeaf(page, split -> page, loc, data, posPage, posSlot, sep);
+            writeBlock_p(split);
+        }
+        writeBlock_p(block);
+        ret = 1;
+    }  else {
+        int loc = _layout -> search(page, data);
+        BPlusTreeBlock child, newBlock;
+        char childSep[_idxLen];
+        readBlock_p(_layout -> child(page, loc), &child);
+        /* A full leaf first hands values to a neighbour, after which data may belong there */
+        bool shift = _splitPolicy == SPLIT_SHIFT && leafFull_p(child.page, data);
+        if (shift && ((loc < NodeLayout::size(page) && balanceLeaves_p(block, loc)) || (loc > 0 && balanceLeaves_p(block, loc - 1)))){
+            clearBlock_p(&child);
+            loc = _layout -> search(page, data);
+            readBlock_p(_layout -> child(page, loc), &child);
+        }
+        ret = insert_p(&child, data, posPage, posSlot, &newBlock, childSep);
+        clearBlock_p(&child);
+        if (newBlock.position != -1){
+            if (!_layout -> insertNonLeaf(page, loc, childSep, newBlock.position)){
+                _stats.count(TreeStats::COUNTER_SPLITS);
+                newBlock_p(TREE_NODE_TYPE_NONLEAF, split, block -> position);
+                _layout -> splitNonLeaf(page, split -> page, loc, childSep, newBlock.position, sep);
+                writeBlock_p(split);
+            }  else if (shift && NodeLayout::type(newBlock.page) == TREE_NODE_TYPE_LEAF){
+                /* The neighbours were full as well: spreading two full leaves over three leaves them about two thirds full */
+                if (loc + 2 <= NodeLayout::size(page)){
+                    balanceLeaves_p(block, loc + 1);
+                    balanceLeaves_p(block, loc);
+                }  else if (loc > 0){
+                    balanceLeaves_p(block, loc - 1);
+                    balanceLeaves_p(block, loc);
+                }
+            }
+            writeBlock_p(block);
+            clearBlock_p(&newBlock);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Inserts batch keys [from, to) under block. New right siblings created for
+ * block are returned in positions with the values separating them from their
+ * left neighbours in values.
+ */
+int BPlusTree::insertBatch_p(BPlusTreeBlock *block, BPlusTreeBatch *batch, int from, int to, std::vector <char> &values, std::vector <int> &positions){
+    int ret = 0;
+    char *page = block -> page;
+    if (NodeLayout::type(page) == TREE_NODE_TYPE_NONLEAF){
+        std::vector <int> at;
+        std::vector <char> childValues;
+        std::vector <int> childPositions;
+        for (int i = from; i < to; ){
+            int loc = _layout -> search(page, batch -> data + batch -> order[i] * _idxLen);
+            int end = batchGroupEnd_p(page, loc, batch, i, to);
+            BPlusTreeBlock child;
+            readBlock_p(_layout -> child(page, loc), &child);
+            int n = childPositions.size();
+            ret += insertBatch_p(&child, batch, i, end, childValues, childPositions);
+            clearBlock_p(&child);
+            at.insert(at.end(), childPositions.size() - n, loc);
+            i = end;
+        }
+        if (childPositions.size()) insertChildren_p(block, at, childValues, childPositions, values, positions);
+        return ret;
+    }
+
+    /* Leaf: find which keys are new, then apply them all at once */
+    std::vector <int> add;
+    for (int i = from; i < to; i ++){
+        int idx = batch -> order[i], equals;
+        const char *x = batch -> data + idx * _idxLen;
+        if (i > from && _layout -> compare(batch -> data + batch -> order[i - 1] * _idxLen, x) == 0) equals = 1;
+        else _layout -> search(page, x, &equals);
+        batch -> results[idx] = !equals;
+        if (!equals) add.push_back(idx);
+    }
+    ret = add.size();
+    if (!ret) return 0;
+    int size = NodeLayout::size(page);
+    if (size + ret <= _leafDataCount){
+        /* The layout may still run out of room, the page is then restored and split below */
+        char saved[_blkSize];
+        memcpy(saved, page, _blkSize);
+        int i = 0;
+        for (; i < ret; i ++){
+            const char *x = batch -> data + add[i] * _idxLen;
+            if (!_layout -> insertLeaf(page, _layout -> search(page, x), x, batch -> posPage[add[i]], batch -> posSlot[add[i]])) break;
+        }
+        if (i == ret){
+            writeBlock_p(block);
+            return ret;
+        }
+        memcpy(page, saved, _blkSize);
+    }
+
+    /* Merge into temporary arrays and spread evenly over as many leaves as needed */
+    int total = size + ret;
+    std::vector <char> mValues(total * _idxLen);
+    std::vector <int> mPosPage(total), mPosSlot(total);
+    char key[_idxLen];
+    if (size) _layout -> readKey(page, 0, key);
+    for (int i = 0, j = 0, k = 0; k < total; k ++){
+        const char *x = j < ret ? batch -> data + add[j] * _idxLen : 0;
+        if (i < size && (!x || _layout -> compare(key, x) < 0)){
+            memcpy(&mValues[k * _idxLen], key, _idxLen);
+            mPosPage[k] = _layout -> posPage(page, i);
+            mPosSlot[k] = _layout -> posSlot(page, i);
+            if (++ i < size) _layout -> readKey(page, i, key);
+        }  else {
+            memcpy(&mValues[k * _idxLen], x, _idxLen);
+            mPosPage[k] = batch -> posPage[add[j]];
+            mPosSlot[k] = batch -> posSlot[add[j]];
+            j ++;
+        }
+    }
+    int leaves = (total + _leafDataCount - 1) / _leafDataCount;
+    int next = NodeLayout::next(page);
+    BPlusTreeBlock cur = *block;
+    for (int l = 0, k = 0; k < total; l ++){
+        int left = leaves - l > 1 ? leaves - l : 1;
+        int begin = k, end = k + (total - k + left - 1) / left;
+        _layout -> init(cur.page, TREE_NODE_TYPE_LEAF);
+        while (k < end && _layout -> insertLeaf(cur.page, k - begin, &mValues[k * _idxLen], mPosPage[k], mPosSlot[k])) k ++;
+        /* A leaf that filled up early tells how many more are needed */
+        if (k < end) leaves = l + 1 + (total - begin - 1) / (k - begin);
+        BPlusTreeBlock following;
+        if (k < total){
+            _stats.count(TreeStats::COUNTER_SPLITS);
+            newBlock_p(TREE_NODE_TYPE_LEAF, &following, cur.position);
+        }
+        NodeLayout::next(cur.page) = k < total ? following.position : next;
+        writeBlock_p(&cur);
+        if (l > 0) clearBlock_p(&cur);
+        if (k < total){
+            values.resize(values.size() + _idxLen);
+            _layout -> separator(&mValues[(k - 1) * _idxLen], &mValues[k * _idxLen], &values[values.size() - _idxLen]);
+            positions.push_back(following.position);
+            cur = following;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Adds child positions[i] right after child at[i] of the non-leaf block, with
+ * values[i] as its separator; at must be ascending. Nodes that overflow are
+ * spread over new right siblings, returned in newPositions and newValues.
+ */
+void BPlusTree::insertChildren_p(BPlusTreeBlock *block, std::vector <int> &at, std::vector <char> &values, std::vector <int> &positions, std::vector <char> &newValues, std::vector <int> &newPositions){
+    char *page = block -> page;
+    int size = NodeLayout::size(page), add = positions.size();
+    if (size + add <= _nonLeafDataCount){
+        char saved[_blkSize];
+        memcpy(saved, page, _blkSize);
+        /* Right to left, so that the positions in at stay valid */
+        int i = add - 1;
+        while (i >= 0 && _layout -> insertNonLeaf(page, at[i], &values[i * _idxLen], positions[i])) i --;
+        if (i < 0){
+            writeBlock_p(block);
+            return;
+        }
+        memcpy(page, saved, _blkSize);
+    }
+
+    int total = size + add;
+    std::vector <char> mValues;
+    std::vector <int> mChildren;
+    char key[_idxLen];
+    for (int i = 0, j = 0; i <= size; i ++){
+        mChildren.push_back(_layout -> child(page, i));
+        for (; j < add && at[j] == i; j ++){
+            mValues.insert(mValues.end(), values.begin() + j * _idxLen, values.begin() + (j + 1) * _idxLen);
+            mChildren.push_back(positions[j]);
+        }
+        if (i < size){
+            _layout -> readKey(page, i, key);
+            mValues.insert(mValues.end(), key, key + _idxLen);
+        }
+    }
+    /* Children are spread evenly as far as they fit, the value between two nodes moves up */
+    int nodes = (total + 1 + _nonLeafDataCount) / (_nonLeafDataCount + 1);
+    BPlusTreeBlock cur = *block;
+    for (int l = 0, c = 0; c < total + 1; l ++){
+        int left = nodes - l > 1 ? nodes - l : 1;
+        int n = (total + 1 - c + left - 1) / left, i = 1;
+        _layout -> init(cur.page, TREE_NODE_TYPE_NONLEAF);
+        _layout -> setChild(cur.page, 0, mChildren[c]);
+        while (i < n && _layout -> insertNonLeaf(cur.page, i - 1, &mValues[(c + i - 1) * _idxLen], mChildren[c + i])) i ++;
+        if (i < n) nodes = l + 1 + (total - c) / i;
+        writeBlock_p(&cur);
+        if (l > 0) clearBlock_p(&cur);
+        c += i;
+        if (c < total + 1){
+            _stats.count(TreeStats::COUNTER_SPLITS);
+            newBlock_p(TREE_NODE_TYPE_NONLEAF, &cur, cur.position);
+            newValues.insert(newValues.end(), mValues.begin() + (c - 1) * _idxLen, mValues.begin() + c * _idxLen);
+            newPositions.push_back(cur.position);
+        }
+    }
+}
+
+void BPlusTree::latch_p(int frame, bool exclusive) const{
+    _bp -> latch(frame, exclusive);
+    if (_guard && _guard -> tree == this) _guard -> latches.push_back(frame);
+}
+
+void BPlusTree::lockShared_p() const{
+    pthread_rwlock_rdlock(&_treeLatch);
+    if (_guard && _guard -> tree == this) _guard -> treeLatch = GUARD_SHARED;
+}
+
+/* Starts an exclusive section, its odd tree version warns latch-free readers that pages may change without being latched */
+void BPlusTree::lockTree_p(){
+    pthread_rwlock_wrlock(&_treeLatch);
+    _stats.count(TreeStats::COUNTER_EXCLUSIVE_SECTIONS);
+    __atomic_fetch_add(&_treeVersion, 1, __ATOMIC_ACQ_REL);
+    if (_guard && _guard -> tree == this) _guard -> treeLatch = GUARD_EXCLUSIVE;
+}
+
+bool BPlusTree::isFree_p(int position) const{
+    return position / 8 < (int)_freeMap.size() && (_freeMap[position / 8] & (1 << (position & 7)));
+}
+
+/* True if the leaf page has no room for data and does not hold it yet */
+bool BPlusTree::leafFull_p(char *page, const void *data){
+    if (NodeLayout::type(page) != TREE_NODE_TYPE_LEAF) return false;
+    int equals;
+    int loc = _layout -> search(page, data, &equals);
+    if (equals) return false;
+    char scratch[_blkSize];
+    memcpy(scratch, page, _blkSize);
+    return !_layout -> insertLeaf(scratch, loc, data, 0, 0);
+}
+
+/* Positions of the nodes from the root down to the leaf that may hold data, the first leaf for data 0, and the child taken in every non-leaf one */
+void BPlusTree::leafPath_p(const void *data, std::vector <int> &path, std::vector <int> &locs){
+    path.clear();
+    locs.clear();
+    for (int position = _rootBlock.position; ; ){
+        BPlusTreeBlock b;
+        readBlock_p(position, &b);
+        path.push_back(position);
+        if (NodeLayout::type(b.page) != TREE_NODE_TYPE_NONLEAF){
+            clearBlock_p(&b);
+            return;
+        }
+        int loc = data ? _layout -> search(b.page, data) : 0;
+        locs.push_back(loc);
+        position = _layout -> child(b.page, loc);
+        clearBlock_p(&b);
+    }
+}
+
+/* Reads the map pages chained from first; blocks past the end of the file are not free, whatever the map says */
+void BPlusTree::loadFreeMap_p(int first){
+    int bytes = _mapBits / 8;
+    for (int position = first; position; ){
+        BPlusTreeBlock block;
+        readBlock_p(position, &block);
+        _mapBlocks.push_back(position);
+        _mapDirty.push_back(false);
+        _freeMap.insert(_freeMap.end(), block.page + FREE_MAP_HEADER, block.page + FREE_MAP_HEADER + bytes);
+        memcpy(&position, block.page + sizeof(int), sizeof(int));
+        clearBlock_p(&block);
+    }
+    long blocks = _fm -> fileSize() / _blkSize;
+    for (long i = 0; i < (long)_freeMap.size(); i ++){
+        if (i * 8 >= blocks) _freeMap[i] = 0;
+        else if (i * 8 + 8 > blocks) _freeMap[i] &= (1 << (blocks - i * 8)) - 1;
+        _freeCount += __builtin_popcount(_freeMap[i]);
+    }
+}
+
+/*
+ * Takes the root, the free-space map and the page of short lists from the
+ * tree header on disk, and returns the head of the free chain of older files.
+ * With a log, the file is first cut back to its length at the last commit:
+ * past it, the file only holds blocks of sections that never committed.
+ */
+int BPlusTree::loadHeader_p(){
+    /* 0 in older files */
+    int blocks = _fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN + sizeof(int) * 5);
+    if (_log && blocks >= FIRST_NODE_BLOCK && _fm -> fileSize() > (long)blocks * _blkSize) _fm -> truncate((long)blocks * _blkSize);
+    readBlock_p(_fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN), &_rootBlock);
+    _mapBlocks.clear();
+    _mapDirty.clear();
+    _freeMap.clear();
+    _freeCount = 0;
+    _freeHint = 0;
+    loadFreeMap_p(_fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN + sizeof(int) * 2));
+    /* The first class where short lists had a single page, the others past the file length; 0 in files written before short lists */
+    for (int c = 0; c < PostingList::SHORT_CLASSES; c ++) _shortPages[c] = _fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN + sizeof(int) * (c ? 5 + c : 4));
+    return _fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN + sizeof(int));
+}
+
+/* Fills the node cache anew, level by level from the root down to the parents of the leaves */
+void BPlusTree::loadNodeCache_p(){
+    _nodeCache -> clear();
+    std::vector <int> level, below, nodes;
+    if (NodeLayout::type(_rootBlock.page) == TREE_NODE_TYPE_NONLEAF) level.push_back(_rootBlock.position);
+    while (level.size()){
+        below.clear();
+        for (int i = 0; i < (int)level.size(); i ++){
+            BPlusTreeBlock block;
+            readBlock_p(level[i], &block);
+            _nodeCache -> add(level[i]);
+            nodes.push_back(level[i]);
+            for (int j = 0; j <= NodeLayout::size(block.page); j ++) below.push_back(_layout -> child(block.page, j));
+            clearBlock_p(&block);
+        }
+        BPlusTreeBlock first;
+        readBlock_p(below[0], &first);
+        if (NodeLayout::type(first.page) != TREE_NODE_TYPE_NONLEAF) below.clear();
+        clearBlock_p(&first);
+        level.swap(below);
+    }
+    /* Children are linked to their slots, so every node has one before any is copied */
+    for (int i = 0; i < (int)nodes.size(); i ++){
+        BPlusTreeBlock block;
+        readBlock_p(nodes[i], &block);
+        _nodeCache -> update(nodes[i], block.page);
+        clearBlock_p(&block);
+    }
+    _nodeCache -> setRoot(nodes.size() ? _rootBlock.position : 0);
+    _cacheReload = false;
+}
+
+/* Block position is not read: a free block close to near is overwritten with an empty node */
+void BPlusTree::newBlock_p(int type, BPlusTreeBlock *block, int near){
+    pinBlock_p(allocBlock_p(near), block, false);
+    _layout -> init(block -> page, type);
+}
+
+/* Copies block position into the lowest free block and frees it, returns where it went */
+int BPlusTree::moveBlock_p(int position){
+    BPlusTreeBlock from, to;
+    /* A block that cannot be read leaves no block taken behind */
+    readBlock_p(position, &from);
+    to.position = allocBlock_p(0);
+    pinBlock_p(to.position, &to, false);
+    memcpy(to.page, from.page, _blkSize);
+    writeBlock_p(&to);
+    clearBlock_p(&to);
+    clearBlock_p(&from);
+    freeBlock_p(position);
+    return to.position;
+}
+
+/*
+ * Moves the leaf path leads to into block to. A free block is simply taken;
+ * a node or map page found there trades places with the leaf. Every pointer
+ * to either block is fixed. Returns false, moving nothing, if block to holds
+ * something that is none of these.
+ */
+bool BPlusTree::placeLeaf_p(std::vector <int> &path, std::vector <int> &locs, int to){
+    int from = path.back(), depth = path.size();
+    /* Pointers to set once the blocks have traded places: the block holding it, the child or -1 for the next leaf, the new value */
+    std::vector <int> fixes;
+    if (depth > 1){
+        int f[] = {path[depth - 2], locs.back(), to};
+        fixes.insert(fixes.end(), f, f + 3);
+    }
+    int prev = prevLeaf_p(path, locs), map = -1;
+    if (prev != -1){
+        int f[] = {prev, -1, to};
+        fixes.insert(fixes.end(), f, f + 3);
+    }
+    bool isFree = to < (int)_freeMap.size() * 8 && (_freeMap[to / 8] & (1 << (to & 7)));
+    if (!isFree && to != _rootBlock.position){
+        BPlusTreeBlock b;
+        readBlock_p(to, &b);
+        int type = NodeLayout::type(b.page), size = NodeLayout::size(b.page);
+        char key[_idxLen];
+        if (size > 0) _layout -> readKey(b.page, 0, key);
+        clearBlock_p(&b);
+        if (type == TREE_NODE_TYPE_FREE_MAP){
+            for (int i = 0; i < (int)_mapBlocks.size(); i ++)
+                if (_mapBlocks[i] == to) map = i;
+            if (map == -1) return false;
+        }  else {
+            if ((type != TREE_NODE_TYPE_LEAF && type != TREE_NODE_TYPE_NONLEAF) || size <= 0) return false;
+            /* The first key of a node leads to it from the root */
+            std::vector <int> toPath, toLocs;
+            leafPath_p(key, toPath, toLocs);
+            int k = std::find(toPath.begin(), toPath.end(), to) - toPath.begin();
+            if (k == 0 || k == (int)toPath.size() || (type == TREE_NODE_TYPE_LEAF) != (k == (int)toPath.size() - 1)) return false;
+            int f[] = {toPath[k - 1], toLocs[k - 1], from};
+            fixes.insert(fixes.end(), f, f + 3);
+            if (type == TREE_NODE_TYPE_LEAF && (prev = prevLeaf_p(toPath, toLocs)) != -1){
+                int g[] = {prev, -1, from};
+                fixes.insert(fixes.end(), g, g + 3);
+            }
+        }
+    }
+
+    BPlusTreeBlock a, b;
+    readBlock_p(from, &a);
+    if (isFree){
+        setFree_p(to, false);
+        pinBlock_p(to, &b, false);
+        memcpy(b.page, a.page, _blkSize);
+    }  else {
+        readBlock_p(to, &b);
+        char page[_blkSize];
+        memcpy(page, a.page, _blkSize);
+        memcpy(a.page, b.page, _blkSize);
+        memcpy(b.page, page, _blkSize);
+        writeBlock_p(&a);
+    }
+    writeBlock_p(&b);
+    clearBlock_p(&a);
+    clearBlock_p(&b);
+    if (isFree) freeBlock_p(from);
+    for (int i = 0; i < (int)fixes.size(); i += 3){
+        BPlusTreeBlock block;
+        readBlock_p(fixes[i] == from ? to : fixes[i] == to ? from : fixes[i], &block);
+        if (fixes[i + 1] == -1) NodeLayout::next(block.page) = fixes[i + 2];
+        else _layout -> setChild(block.page, fixes[i + 1], fixes[i + 2]);
+        writeBlock_p(&block);
+        clearBlock_p(&block);
+    }
+    if (map != -1){
+        _mapBlocks[map] = from;
+        _mapDirty[map] = true;
+        if (map > 0) _mapDirty[map - 1] = true;
+        else _headerDirty = true;
+    }
+    /* The root frame now holds the page of the other block */
+    if (_rootBlock.position == from || _rootBlock.position == to){
+        int position = _rootBlock.position == from ? to : from;
+        clearBlock_p(&_rootBlock);
+        readBlock_p(position, &_rootBlock);
+        _headerDirty = true;
+    }
+    return true;
+}
+
+/* The leaf before the one path leads to, -1 for the first leaf */
+int BPlusTree::prevLeaf_p(std::vector <int> &path, std::vector <int> &locs){
+    int j = locs.size() - 1;
+    while (j >= 0 && !locs[j]) j --;
+    if (j < 0) return -1;
+    BPlusTreeBlock b;
+    readBlock_p(path[j], &b);
+    int position = _layout -> child(b.page, locs[j] - 1);
+    clearBlock_p(&b);
+    for (;;){
+        readBlock_p(position, &b);
+        bool leaf = NodeLayout::type(b.page) != TREE_NODE_TYPE_NONLEAF;
+        if (!leaf) position = _layout -> child(b.page, NodeLayout::size(b.page));
+        clearBlock_p(&b);
+        if (leaf) return position;
+    }
+}
+
+/* Sets the tree up on an open file, creating it if the file holds no tree yet */
+void BPlusTree::open_p(NodeLayout *layout, int cacheSize, int cachePolicy){
+    if (layout -> minCapacity() < MIN_NODE_CAPACITY){
+        delete layout;
+        throw BPlusTreeException(BPlusTreeException::ERR_KEY_TOO_LONG);
+    }
+    pthread_rwlock_init(&_treeLatch, 0);
+    if (cacheSize < MIN_CACHE_SIZE) cacheSize = MIN_CACHE_SIZE;
+    _bp = new BufferPool(_fm, cacheSize, cachePolicy);
+    _bp -> setChecksums(_checksums);
+    if (_log){
+        _log -> recover(_fm);
+        _bp -> setLog(_log);
+    }
+    _layout = layout;
+    _idxLen = _layout -> keyLength();
+    _blkSize = _fm -> blockSize();
+    _pageSize = _blkSize - (_checksums ? PageChecksum::SIZE : 0);
+    _nonLeafDataCount = _layout -> nonLeafCapacity();
+    _leafDataCount = _layout -> leafCapacity();
+    _mapBits = (_pageSize - FREE_MAP_HEADER) * 8;
+    _freeCount = 0;
+    _freeHint = 0;
+    memset(_shortPages, 0, sizeof(_shortPages));
+    _shortSize = PostingList::shortSize(_pageSize);
+    _defragNext = 0;
+    _minFill = DEFAULT_MIN_FILL;
+    _splitPolicy = SPLIT_HALVES;
+    _nodeCache = 0;
+    _cacheNodes = false;
+    _cacheReload = false;
+
+    char s[sizeof(B_TREE_FILE_HEADER)];
+    _fm -> readString(_blkSize, B_TREE_FILE_HEADER_LEN, s);
+    /* A new tree gone before its first commit may leave a header without a root */
+    if (strcmp(s, B_TREE_FILE_HEADER) || !_fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN)){
+        /* Blocks it appended would count as the tree's own */
+        if (_fm -> fileSize() > (long)FIRST_NODE_BLOCK * _blkSize) _fm -> truncate((long)FIRST_NODE_BLOCK * _blkSize);
+        /* Following function calls (writeHeader_p, flush) cannot be removed, for header block must be on disk before new blocks are appended */
+        lockTree_p();
+        _rootBlock.position = 0;
+        writeHeader_p();
+        _bp -> flush();
+
+        newBlock_p(TREE_NODE_TYPE_LEAF, &_rootBlock, 0);
+        writeBlock_p(&_rootBlock);
+        _headerDirty = true;
+        unlockTree_p();
+    }  else {
+        int flags = _fm -> readInt(_blkSize + B_TREE_FILE_HEADER_LEN + sizeof(int) * 3);
+        if (((flags & HEADER_CHECKSUMS) != 0) != _checksums){
+            delete _bp;
+            delete _layout;
+            pthread_rwlock_destroy(&_treeLatch);
+            throw BPlusTreeException(BPlusTreeException::ERR_FORMAT_MISMATCH);
+        }
+        if (_checksums){
+            /* The header is read past the pool, pinning it checks it first */
+            BPlusTreeBlock header;
+            readBlock_p(1, &header);
+            clearBlock_p(&header);
+        }
+        int emptyNode = loadHeader_p();
+        if (emptyNode){
+            /* Older files chain their free blocks through the blocks themselves, the chain moves into the map once */
+            lockTree_p();
+            while (emptyNode){
+                BPlusTreeBlock block;
+                readBlock_p(emptyNode, &block);
+                int next = NodeLayout::emptyNext(block.page);
+                clearBlock_p(&block);
+                freeBlock_p(emptyNode);
+                emptyNode = next;
+            }
+            _headerDirty = true;
+            unlockTree_p();
+        }
+    }
+}
+
+/* The pin is the calling thread's until clearBlock_p, the root's is the tree's */
+void BPlusTree::pinBlock_p(int position, BPlusTreeBlock *block, bool load) const{
+    block -> position = position;
+    block -> page = _bp -> pin(position, &block -> frame, load);
+    if (block != &_rootBlock && _guard && _guard -> tree == this) _guard -> pins.push_back(block -> frame);
+}
+
+/*
+ * Reads ahead up to count leaves following the one that holds data, all at
+ * once, and returns how many there were. Only the leaves sharing its parent
+ * are known without reading more of the tree, so fewer may come back.
+ */
+int BPlusTree::prefetchLeaves_p(const void *data, int count) const{
+    std::vector <int> positions;
+    lockShared_p();
+    BPlusTreeBlock b = _rootBlock;
+    latch_p(b.frame, false);
+    while (NodeLayout::type(b.page) != TREE_NODE_TYPE_LEAF){
+        int loc = _layout -> search(b.page, data);
+        BPlusTreeBlock next;
+        readBlock_p(_layout -> child(b.page, loc), &next);
+        latch_p(next.frame, false);
+        if (NodeLayout::type(next.page) == TREE_NODE_TYPE_LEAF){
+            for (int i = loc + 1; i <= NodeLayout::size(b.page) && (int)positions.size() < count; i ++)
+                positions.push_back(_layout -> child(b.page, i));
+        }
+        releaseBlock_p(&b);
+        b = next;
+        if (positions.size()) break;
+    }
+    releaseBlock_p(&b);
+    unlockShared_p();
+    if (positions.size()) _bp -> prefetch(&positions[0], positions.size());
+    return positions.size();
+}
+
+/* The caller latches block shared */
+void BPlusTree::print_p(BPlusTreeBlock *block) const{
+    char *page = block -> page;
+    int type = NodeLayout::type(page);
+    int size = NodeLayout::size(page);
+    char key[_idxLen];
+    for (int i = 0; i <= size; i ++){
+        if (type == TREE_NODE_TYPE_NONLEAF){
+            BPlusTreeBlock child;
+            printf("(");
+            readBlock_p(_layout -> child(page, i), &child);
+            latch_p(child.frame, false);
+            print_p(&child);
+            releaseBlock_p(&child);
+            printf(")");
+        }
+        if (i == size) break;
+        putchar(' ');
+        _layout -> readKey(page, i, key);
+        _layout -> printKey(key);
+        if (type == TREE_NODE_TYPE_LEAF)
+            printf(",%d,%d", _layout -> posPage(page, i), _layout -> posSlot(page, i));
+        putchar(' ');
+    }
+}
+
+/* The caller latches block shared, children are latched while they are visited */
+void BPlusTree::queryBatch_p(BPlusTreeBlock *block, BPlusTreeBatch *batch, int from, int to, std::pair <int, int> *results){
+    char *page = block -> page;
+    if (NodeLayout::type(page) == TREE_NODE_TYPE_LEAF){
+        for (int i = from; i < to; i ++){
+            int idx = batch -> order[i], equals;
+            int loc = _layout -> search(page, batch -> data + idx * _idxLen, &equals);
+            if (equals) results[idx] = firstPosition_p(page, loc - 1);
+            else results[idx] = std::make_pair(-1, -1);
+        }
+        return;
+    }
+    std::vector <int> children, ends;
+    for (int i = from; i < to; i = ends.back()){
+        int loc = _layout -> search(page, batch -> data + batch -> order[i] * _idxLen);
+        children.push_back(_layout -> child(page, loc));
+        ends.push_back(batchGroupEnd_p(page, loc, batch, i, to));
+    }
+    /* All children needed are read at once, before the first one is visited */
+    if (children.size() > 1) _bp -> prefetch(&children[0], children.size());
+    for (int g = 0, i = from; g < (int)children.size(); i = ends[g ++]){
+        BPlusTreeBlock child;
+        readBlock_p(children[g], &child);
+        latch_p(child.frame, false);
+        queryBatch_p(&child, batch, i, ends[g], results);
+        releaseBlock_p(&child);
+    }
+}
+
+/* Merges child loc of the non-leaf block, when filled under the minimum, into a neighbour if both fit in one node, otherwise refills it from one */
+void BPlusTree::rebalance_p(BPlusTreeBlock *block, int loc){
+    char *page = block -> page;
+    BPlusTreeBlock child;
+    readBlock_p(_layout -> child(page, loc), &child);
+    if (_layout -> fill(child.page) >= _minFill){
+        clearBlock_p(&child);
+        return;
+    }
+    bool isLeaf = (NodeLayout::type(child.page) == TREE_NODE_TYPE_LEAF);
+    char sep[_idxLen];
+    BPlusTreeBlock sibling;
+    if (loc > 0){
+        readBlock_p(_layout -> child(page, loc - 1), &sibling);
+        if (!isLeaf) _layout -> readKey(page, loc - 1, sep);
+        if (isLeaf ? _layout -> mergeLeaf(sibling.page, child.page) : _layout -> mergeNonLeaf(sibling.page, child.page, sep)){
+            _stats.count(TreeStats::COUNTER_MERGES);
+            freeBlock_p(child.position);
+            _layout -> removeNonLeaf(page, loc);
+            writeBlock_p(&sibling);
+            writeBlock_p(block);
+            loc = -1;
+        }
+        clearBlock_p(&sibling);
+    }
+    if (loc != -1 && loc < NodeLayout::size(page)){
+        readBlock_p(_layout -> child(page, loc + 1), &sibling);
+        if (!isLeaf) _layout -> readKey(page, loc, sep);
+        if (isLeaf ? _layout -> mergeLeaf(child.page, sibling.page) : _layout -> mergeNonLeaf(child.page, sibling.page, sep)){
+            _stats.count(TreeStats::COUNTER_MERGES);
+            freeBlock_p(sibling.position);
+            _layout -> removeNonLeaf(page, loc + 1);
+            writeBlock_p(&child);
+            writeBlock_p(block);
+            loc = -1;
+        }
+        clearBlock_p(&sibling);
+    }
+    clearBlock_p(&child);
+    /* Neither neighbour has room for it: three leaves may still fit in two, else it borrows from the fuller neighbour */
+    int n = NodeLayout::size(page);
+    if (loc == -1 || n == 0) return;
+    if (isLeaf && n >= 2){
+        int from = loc > 0 ? loc - 1 : 0;
+        if (from + 2 > n) from = n - 2;
+        if (mergeLeaves_p(block, from)) return;
+    }
+    int at = loc;
+    if (loc == n) at = loc - 1;
+    else if (loc > 0){
+        BPlusTreeBlock left, right;
+        readBlock_p(_layout -> child(page, loc - 1), &left);
+        readBlock_p(_layout -> child(page, loc + 1), &right);
+        if (_layout -> fill(left.page) > _layout -> fill(right.page)) at = loc - 1;
+        clearBlock_p(&left);
+        clearBlock_p(&right);
+    }
+    if (isLeaf) balanceLeaves_p(block, at);
+    else balanceNonLeaves_p(block, at);
+}
+
+/*
+ * Moves the children of the non-leaf block that lie at or past end into free
+ * blocks, then does the same under them; height counts the levels below
+ * block. Leaves are only read when they move, to copy them and to relink the
+ * leaf before them, prevLeaf.
+ */
+void BPlusTree::relocate_p(BPlusTreeBlock *block, int height, int end, int *prevLeaf, std::map <int, int> &moved){
+    char *page = block -> page;
+    for (int i = 0; i <= NodeLayout::size(page); i ++){
+        int c = _layout -> child(page, i);
+        if (c >= end){
+            c = moveBlock_p(c);
+            _layout -> setChild(page, i, c);
+            writeBlock_p(block);
+            if (height == 1 && *prevLeaf != -1){
+                BPlusTreeBlock prev;
+                readBlock_p(*prevLeaf, &prev);
+                NodeLayout::next(prev.page) = c;
+                writeBlock_p(&prev);
+                clearBlock_p(&prev);
+            }
+        }
+        if (height == 1){
+            *prevLeaf = c;
+            if (_duplicates) relocatePostings_p(c, end, moved);
+            continue;
+        }
+        BPlusTreeBlock child;
+        readBlock_p(c, &child);
+        relocate_p(&child, height - 1, end, prevLeaf, moved);
+        clearBlock_p(&child);
+    }
+}
+
+/*
+ * Moves the pages of the posting lists of the leaf at position that lie at or
+ * after block end. A page of short lists moves the first time one of its keys
+ * is met, moved then tells the keys met later where it went.
+ */
+void BPlusTree::relocatePostings_p(int position, int end, std::map <int, int> &moved){
+    BPlusTreeBlock leaf;
+    readBlock_p(position, &leaf);
+    for (int i = 0; i < NodeLayout::size(leaf.page); i ++){
+        int posPage = _layout -> posPage(leaf.page, i), shortPage = _layout -> posSlot(leaf.page, i);
+        if (posPage < POSTING_LIST && shortPage >= end){
+            std::map <int, int>::iterator it = moved.find(shortPage);
+            int to = it != moved.end() ? it -> second : moveBlock_p(shortPage);
+            moved[shortPage] = to;
+            for (int c = 0; c < PostingList::SHORT_CLASSES; c ++){
+                if (_shortPages[c] != shortPage) continue;
+                _shortPages[c] = to;
+                _headerDirty = true;
+            }
+            _layout -> setPosition(leaf.page, i, posPage, to);
+            writeBlock_p(&leaf);
+        }
+        if (posPage != POSTING_LIST) continue;
+        for (int at = _layout -> posSlot(leaf.page, i), prev = 0; at; ){
+            if (at >= end){
+                at = moveBlock_p(at);
+                BPlusTreeBlock b;
+                if (!prev){
+                    _layout -> setPosition(leaf.page, i, POSTING_LIST, at);
+                    writeBlock_p(&leaf);
+                }  else {
+                    readBlock_p(prev, &b);
+                    PostingList::next(b.page) = at;
+                    writeBlock_p(&b);
+                    clearBlock_p(&b);
+                }
+            }
+            BPlusTreeBlock b;
+            readBlock_p(at, &b);
+            prev = at;
+            at = PostingList::next(b.page);
+            clearBlock_p(&b);
+        }
+    }
+    clearBlock_p(&leaf);
+}
+
+/*
+ * Fills the leaf path leads to up to fillFactor from the leaves after it
+ * under the same parent: whole ones while they fit, then the first values of
+ * the next one, whose separator in the parent is worked out anew.
+ */
+void BPlusTree::repackLeaf_p(std::vector <int> &path, std::vector <int> &locs, double fillFactor){
+    if (path.size() < 2) return;
+    BPlusTreeBlock parent, leaf, next;
+    readBlock_p(path[path.size() - 2], &parent);
+    readBlock_p(path.back(), &leaf);
+    int loc = locs.back();
+    char savedLeaf[_blkSize], savedNext[_blkSize], savedParent[_blkSize];
+    char key[_idxLen], sep[_idxLen];
+    while (loc < NodeLayout::size(parent.page) && _layout -> fill(leaf.page) < fillFactor){
+        readBlock_p(_layout -> child(parent.page, loc + 1), &next);
+        memcpy(savedLeaf, leaf.page, _blkSize);
+        /* A parent other than the root keeps at least one value */
+        bool merged = (NodeLayout::size(parent.page) > 1 || parent.page == _rootBlock.page) && _layout -> mergeLeaf(leaf.page, next.page);
+        if (merged && _layout -> fill(leaf.page) > fillFactor){
+            memcpy(leaf.page, savedLeaf, _blkSize);
+            merged = false;
+        }
+        if (merged){
+            _stats.count(TreeStats::COUNTER_MERGES);
+            freeBlock_p(next.position);
+            _layout -> removeNonLeaf(parent.page, loc + 1);
+            writeBlock_p(&leaf);
+            writeBlock_p(&parent);
+            clearBlock_p(&next);
+            continue;
+        }
+        memcpy(savedNext, next.page, _blkSize);
+        memcpy(savedParent, parent.page, _blkSize);
+        int moved = 0;
+        while (NodeLayout::size(next.page) > 1 && _layout -> fill(leaf.page) < fillFactor){
+            _layout -> readKey(next.page, 0, key);
+            if (!_layout -> insertLeaf(leaf.page, NodeLayout::size(leaf.page), key, _layout -> posPage(next.page, 0), _layout -> posSlot(next.page, 0))) break;
+            _layout -> removeLeaf(next.page, 0);
+            moved ++;
+        }
+        if (moved){
+            char first[_idxLen];
+            _layout -> readKey(next.page, 0, first);
+            _layout -> separator(key, first, sep);
+            _layout -> removeNonLeaf(parent.page, loc + 1);
+            if (_layout -> insertNonLeaf(parent.page, loc, sep, next.position)){
+                writeBlock_p(&leaf);
+                writeBlock_p(&next);
+                writeBlock_p(&parent);
+            }  else {
+                /* The new separator does not fit, everything stays as it was */
+                memcpy(leaf.page, savedLeaf, _blkSize);
+                memcpy(next.page, savedNext, _blkSize);
+                memcpy(parent.page, savedParent, _blkSize);
+            }
+        }
+        clearBlock_p(&next);
+        break;
+    }
+    clearBlock_p(&leaf);
+    clearBlock_p(&parent);
+    if (parent.page == _rootBlock.page && NodeLayout::size(_rootBlock.page) == 0){
+        BPlusTreeBlock newRoot;
+        readBlock_p(path.back(), &newRoot);
+        freeBlock_p(_rootBlock.position);
+        setRoot_p(&newRoot);
+        _headerDirty = true;
+        path.erase(path.begin());
+        locs.erase(locs.begin());
+    }
+}
+
+/* Drops the latch on block and unpins it, unless it is the root which stays pinned */
+void BPlusTree::releaseBlock_p(BPlusTreeBlock *block) const{
+    unlatch_p(block -> frame);
+    if (block -> page != _rootBlock.page) clearBlock_p(block);
+}
+
+bool BPlusTree::remove_p(BPlusTreeBlock *block, void *data){
+    bool ret;
+    char *page = block -> page;
+    if (NodeLayout::type(page) == TREE_NODE_TYPE_LEAF){
+        int equals;
+        int loc = _layout -> search(page, data, &equals) - 1;
+        if (!equals) ret = 0;
+        else {
+            freePostings_p(page, loc);
+            _layout -> removeLeaf(page, loc);
+            writeBlock_p(block);
+            ret = 1;
+        }
+    }  else {
+        int loc = _layout -> search(page, data);
+        BPlusTreeBlock child;
+        readBlock_p(_layout -> child(page, loc), &child);
+        ret = remove_p(&child, data);
+        clearBlock_p(&child);
+        if (ret) rebalance_p(block, loc);
+    }
+    return ret;
+}
+
+/* Removes batch keys [from, to) under block, rebalancing every child touched */
+int BPlusTree::removeBatch_p(BPlusTreeBlock *block, BPlusTreeBatch *batch, int from, int to){
+    int ret = 0;
+    char *page = block -> page;
+    if (NodeLayout::type(page) == TREE_NODE_TYPE_LEAF){
+        for (int i = from; i < to; i ++){
+            int idx = batch -> order[i], equals;
+            int loc = _layout -> search(page, batch -> data + idx * _idxLen, &equals) - 1;
+            batch -> results[idx] = equals;
+            if (equals){
+                freePostings_p(page, loc);
+                _layout -> removeLeaf(page, loc);
+                ret ++;
+            }
+        }
+        if (ret) writeBlock_p(block);
+        return ret;
+    }
+    /* Groups are visited right to left, so merges never move a child not visited yet */
+    for (int i = to; i > from; ){
+        int loc = _layout -> search(page, batch -> data + batch -> order[i - 1] * _idxLen);
+        int begin = i - 1;
+        while (begin > from && _layout -> search(page, batch -> data + batch -> order[begin - 1] * _idxLen) == loc) begin --;
+        BPlusTreeBlock child;
+        readBlock_p(_layout -> child(page, loc), &child);
+        int n = removeBatch_p(&child, batch, begin, i);
+        clearBlock_p(&child);
+        if (n) rebalance_p(block, loc);
+        ret += n;
+        i = begin;
+    }
+    return ret;
+}
+
+/*
+ * Takes a position away from value loc of the leaf, returns how many it has
+ * left or -1 if it did not have that one. A value left with none is for the
+ * caller to remove. A short list down to one position is freed, the leaf
+ * keeps that one itself; one down to half of the class below moves to a
+ * smaller slot, and a posting list down to half of _shortSize becomes a
+ * short list again.
+ */
+int BPlusTree::removePosting_p(BPlusTreeBlock *leaf, int loc, int posPage, int posSlot){
+    PostingList::Position p(posPage, posSlot), old(_layout -> posPage(leaf -> page, loc), _layout -> posSlot(leaf -> page, loc));
+    if (!_duplicates || old.first > POSTING_LIST) return old == p ? 0 : -1;
+    BPlusTreeBlock b;
+    if (old.first != POSTING_LIST){
+        int slot = POSTING_SHORT - old.first;
+        std::vector <PostingList::Position> positions;
+        readBlock_p(old.second, &b);
+        PostingList::readShort(b.page, slot, positions);
+        std::vector <PostingList::Position>::iterator it = std::lower_bound(positions.begin(), positions.end(), p);
+        if (it == positions.end() || *it != p){
+            clearBlock_p(&b);
+            return -1;
+        }
+        positions.erase(it);
+        /* Down to half of the class below, the list moves to a smaller slot */
+        int cls = PostingList::slotClass(b.page), smaller = cls ? (PostingList::SHORT_SIZE << cls) / 4 : 1;
+        if ((int)positions.size() > smaller){
+            PostingList::writeShort(b.page, slot, &positions[0], positions.size());
+            writeBlock_p(&b);
+            clearBlock_p(&b);
+        }  else {
+            freeShort_p(&b, slot);
+            setPositions_p(leaf, loc, positions);
+        }
+        return positions.size();
+    }
+    int prev, at = findPosting_p(old.second, p, &prev);
+    readBlock_p(at, &b);
+    std::vector <PostingList::Position> positions;
+    PostingList::read(b.page, positions);
+    std::vector <PostingList::Position>::iterator it = std::lower_bound(positions.begin(), positions.end(), p);
+    if (it == positions.end() || *it != p){
+        clearBlock_p(&b);
+        return -1;
+    }
+    positions.erase(it);
+    int next = PostingList::next(b.page);
+    if (positions.size()){
+        /* Fewer positions never take more room */
+        PostingList::write(b.page, _pageSize, &positions[0], positions.size());
+        writeBlock_p(&b);
+    }
+    clearBlock_p(&b);
+    int first = old.second;
+    if (positions.empty()){
+        freeBlock_p(at);
+        if (prev){
+            readBlock_p(prev, &b);
+            PostingList::next(b.page) = next;
+            writeBlock_p(&b);
+            clearBlock_p(&b);
+        }  else {
+            /* The next page becomes the first, taking over the total */
+            readBlock_p(first, &b);
+            int total = PostingList::total(b.page);
+            clearBlock_p(&b);
+            first = next;
+            readBlock_p(first, &b);
+            PostingList::total(b.page) = total;
+            writeBlock_p(&b);
+            clearBlock_p(&b);
+            _layout -> setPosition(leaf -> page, loc, POSTING_LIST, first);
+            writeBlock_p(leaf);
+        }
+    }
+    readBlock_p(first, &b);
+    int left = -- PostingList::total(b.page);
+    writeBlock_p(&b);
+    clearBlock_p(&b);
+    if (left <= _shortSize / 2){
+        std::vector <PostingList::Position> rest;
+        readPostings_p(first, rest);
+        freePostings_p(leaf -> page, loc);
+        setPositions_p(leaf, loc, rest);
+    }
+    return left;
+}
+
+/*
+ * Undoes the exclusive section of a call that threw: the log brings the file
+ * back to the last commit, the pages the pool holds, which may be newer, are
+ * all dropped, and the tree state is read again from the file. Nobody else
+ * holds a pin meanwhile, iterators keep copies of their leaves.
+ */
+void BPlusTree::rollback_p(){
+    _log -> rollback(_fm);
+    _logBlocks.clear();
+    _headerDirty = false;
+    clearBlock_p(&_rootBlock);
+    _bp -> discard(0);
+    loadHeader_p();
+    _cacheReload = false;
+    if (_cacheNodes) loadNodeCache_p();
+}
+
+/* Marks block position free or in use, the map grows to cover a block freed past its end */
+void BPlusTree::setFree_p(int position, bool free){
+    if (position >= (int)_mapBlocks.size() * _mapBits){
+        if (!free) return;
+        while (position >= (int)_mapBlocks.size() * _mapBits) addMapBlock_p();
+    }
+    unsigned char &byte = _freeMap[position / 8], bit = 1 << (position & 7);
+    if (free == ((byte & bit) != 0)) return;
+    if (free){
+        byte |= bit;
+        _freeCount ++;
+        if (position / 8 < _freeHint) _freeHint = position / 8;
+    }  else {
+        byte &= ~bit;
+        _freeCount --;
+    }
+    _mapDirty[position / _mapBits] = true;
+}
+
+/* Makes the pinned block the root, the tree keeps its pin and drops the old root's */
+void BPlusTree::setRoot_p(BPlusTreeBlock *root){
+    clearBlock_p(&_rootBlock);
+    _rootBlock = *root;
+    if (_guard && _guard -> tree == this) dropFrame(_guard -> pins, root -> frame);
+}
+
+/* Works out the separator of the neighbouring leaves left and right anew as value loc of the non-leaf page, see setSeparator_p */
+bool BPlusTree::setLeafSeparator_p(char *page, int loc, char *left, char *right){
+    char last[_idxLen], first[_idxLen], sep[_idxLen];
+    _layout -> readKey(left, NodeLayout::size(left) - 1, last);
+    _layout -> readKey(right, 0, first);
+    _layout -> separator(last, first, sep);
+    return setSeparator_p(page, loc, sep);
+}
+
+/*
+ * Gives value loc of the leaf the sorted positions, which hold none of it yet:
+ * a single one stays in the leaf, up to _shortSize go into a short list of
+ * the smallest class they fit in and one more into a page of their own.
+ */
+void BPlusTree::setPositions_p(BPlusTreeBlock *leaf, int loc, std::vector <std::pair <int, int> > &positions){
+    BPlusTreeBlock b;
+    int count = positions.size();
+    if (count == 1) _layout -> setPosition(leaf -> page, loc, positions[0].first, positions[0].second);
+    else if (count <= _shortSize){
+        int slot = allocShort_p(leaf -> position, PostingList::shortClass(count), &b);
+        PostingList::writeShort(b.page, slot, &positions[0], count);
+        _layout -> setPosition(leaf -> page, loc, POSTING_SHORT - slot, b.position);
+    }  else {
+        newBlock_p(TREE_NODE_TYPE_POSTING, &b, leaf -> position);
+        PostingList::init(b.page);
+        PostingList::write(b.page, _pageSize, &positions[0], count);
+        PostingList::total(b.page) = count;
+        _layout -> setPosition(leaf -> page, loc, POSTING_LIST, b.position);
+    }
+    if (count > 1){
+        writeBlock_p(&b);
+        clearBlock_p(&b);
+    }
+    writeBlock_p(leaf);
+}
+
+/* Replaces value loc of the non-leaf page, false if sep does not fit, which leaves the page to be restored by the caller */
+bool BPlusTree::setSeparator_p(char *page, int loc, const char *sep){
+    int child = _layout -> child(page, loc + 1);
+    _layout -> removeNonLeaf(page, loc + 1);
+    return _layout -> insertNonLeaf(page, loc, sep, child);
+}
+
+/* Ends an exclusive section, committing every page it wrote as one group */
+/*
+ * Moves values of the leaf from into its neighbour to, its left one if
+ * toLeft, one at a time while to is less full, or until to is full unless
+ * even. Returns whether any value moved.
+ */
+bool BPlusTree::shiftLeaf_p(char *from, char *to, bool toLeft, bool even){
+    char key[_idxLen];
+    int moved = 0;
+    while (NodeLayout::size(from) > 1 && (!even || _layout -> fill(to) < _layout -> fill(from))){
+        int i = toLeft ? 0 : NodeLayout::size(from) - 1;
+        _layout -> readKey(from, i, key);
+        if (!_layout -> insertLeaf(to, toLeft ? NodeLayout::size(to) : 0, key, _layout -> posPage(from, i), _layout -> posSlot(from, i))) break;
+        _layout -> removeLeaf(from, i);
+        moved ++;
+    }
+    return moved > 0;
+}
+
+/* Counts the nodes of every level and their fill, and the pages of posting lists; needs the tree latch held shared */
+void BPlusTree::structureStats_p(BPlusTreeStats *stats) const{
+    std::vector <int> level(1, _rootBlock.position), below, shortPages;
+    while (level.size()){
+        double fill = 0;
+        below.clear();
+        for (int i = 0; i < (int)level.size(); i ++){
+            BPlusTreeBlock b;
+            readBlock_p(level[i], &b);
+            latch_p(b.frame, false);
+            char *page = b.page;
+            fill += _layout -> fill(page);
+            if (NodeLayout::type(page) == TREE_NODE_TYPE_NONLEAF){
+                for (int j = 0; j <= NodeLayout::size(page); j ++) below.push_back(_layout -> child(page, j));
+            }  else if (_duplicates){
+                for (int j = 0; j < NodeLayout::size(page); j ++){
+                    if (_layout -> posPage(page, j) < POSTING_LIST) shortPages.push_back(_layout -> posSlot(page, j));
+                    if (_layout -> posPage(page, j) != POSTING_LIST) continue;
+                    for (int at = _layout -> posSlot(page, j); at; stats -> postingPages ++){
+                        BPlusTreeBlock p;
+                        readBlock_p(at, &p);
+                        at = PostingList::next(p.page);
+                        clearBlock_p(&p);
+                    }
+                }
+            }
+            /* The root is read like any other node here, so it is unpinned too */
+            unlatch_p(b.frame);
+            clearBlock_p(&b);
+        }
+        stats -> levelNodes.push_back(level.size());
+        stats -> levelFill.push_back(fill / level.size());
+        level.swap(below);
+    }
+    std::sort(shortPages.begin(), shortPages.end());
+    stats -> postingPages += std::unique(shortPages.begin(), shortPages.end()) - shortPages.begin();
+    stats -> height = stats -> levelNodes.size();
+}
+
+void BPlusTree::unlatch_p(int frame) const{
+    _bp -> unlatch(frame);
+    if (_guard && _guard -> tree == this) dropFrame(_guard -> latches, frame);
+}
+
+void BPlusTree::unlockShared_p() const{
+    if (_guard && _guard -> tree == this) _guard -> treeLatch = 0;
+    pthread_rwlock_unlock(&_treeLatch);
+}
+
+void BPlusTree::unlockTree_p(){
+    long lsn = 0;
+    writeFreeMap_p();
+    if (_headerDirty) writeHeader_p();
+    if (_cacheNodes) updateNodeCache_p();
+    if (_log && _logBlocks.size()){
+        std::sort(_logBlocks.begin(), _logBlocks.end());
+        _logBlocks.erase(std::unique(_logBlocks.begin(), _logBlocks.end()), _logBlocks.end());
+        /* Pages are pinned one at a time, a large section may have written more than the pool holds */
+        std::vector <char> group;
+        for (int i = 0; i < (int)_logBlocks.size(); i ++){
+            BPlusTreeBlock block;
+            readBlock_p(_logBlocks[i], &block);
+            if (_checksums) PageChecksum::stamp(block.page, _blkSize, block.position);
+            _log -> addPage(group, block.position, block.page, _blkSize);
+            clearBlock_p(&block);
+        }
+        lsn = _log -> commit(group);
+        for (int i = 0; i < (int)_logBlocks.size(); i ++){
+            BPlusTreeBlock block;
+            readBlock_p(_logBlocks[i], &block);
+            _bp -> logged(block.frame, lsn);
+            clearBlock_p(&block);
+        }
+        _logBlocks.clear();
+    }
+    if (_guard && _guard -> tree == this) _guard -> treeLatch = 0;
+    __atomic_fetch_add(&_treeVersion, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&_treeLatch);
+    if (lsn) _log -> waitCommit(lsn);
+}
+
+/* Copies the non-leaf nodes written in the exclusive section into the node cache, and drops the blocks that are no longer one */
+void BPlusTree::updateNodeCache_p(){
+    if (_cacheReload){
+        _cacheBlocks.clear();
+        loadNodeCache_p();
+        return;
+    }
+    std::sort(_cacheBlocks.begin(), _cacheBlocks.end());
+    _cacheBlocks.erase(std::unique(_cacheBlocks.begin(), _cacheBlocks.end()), _cacheBlocks.end());
+    std::vector <int> nodes;
+    for (int i = 0; i < (int)_cacheBlocks.size(); i ++){
+        /* Freed blocks have left the cache already, and are not to be read */
+        if (isFree_p(_cacheBlocks[i])) continue;
+        BPlusTreeBlock block;
+        readBlock_p(_cacheBlocks[i], &block);
+        if (NodeLayout::type(block.page) == TREE_NODE_TYPE_NONLEAF){
+            _nodeCache -> add(_cacheBlocks[i]);
+            nodes.push_back(_cacheBlocks[i]);
+        }  else _nodeCache -> remove(_cacheBlocks[i]);
+        clearBlock_p(&block);
+    }
+    for (int i = 0; i < (int)nodes.size(); i ++){
+        BPlusTreeBlock block;
+        readBlock_p(nodes[i], &block);
+        _nodeCache -> update(nodes[i], block.page);
+        clearBlock_p(&block);
+    }
+    _cacheBlocks.clear();
+    _nodeCache -> setRoot(NodeLayout::type(_rootBlock.page) == TREE_NODE_TYPE_NONLEAF ? _rootBlock.position : 0);
+}
+
+/* True if a page read without latching is still what it was when the tree version and its frame version were taken */
+bool BPlusTree::validate_p(int frame, unsigned long version, unsigned long treeVersion) const{
+    return _bp -> validate(frame, version) && __atomic_load_n(&_treeVersion, __ATOMIC_ACQUIRE) == treeVersion;
+}
+
+/* Checks the node at position and every node below it, or with split only the node, handing its children with their key ranges to split */
+void BPlusTree::verify_p(BPlusTreeVerifier *verifier, int position, int depth, const char *lower, const char *upper, std::vector <BPlusTreeSubtree> *split) const{
+    std::vector <BPlusTreeProblem> &problems = verifier -> problems;
+    BPlusTreeBlock b;
+    if (!verifyRead_p(verifier, position, &b)){
+        verifier -> prevLeaf = -1;
+        return;
+    }
+    latch_p(b.frame, false);
+    char *page = b.page;
+    int type = NodeLayout::type(page), size = NodeLayout::size(page);
+    bool leaf = type == TREE_NODE_TYPE_LEAF;
+    if ((!leaf && type != TREE_NODE_TYPE_NONLEAF) || size < 0 || size > (leaf ? _leafDataCount : _nonLeafDataCount) || depth > VERIFY_MAX_HEIGHT){
+        addProblem_p(problems, depth > VERIFY_MAX_HEIGHT ? BPlusTreeProblem::DEPTH : BPlusTreeProblem::BAD_NODE, position);
+        releaseBlock_p(&b);
+        verifier -> prevLeaf = -1;
+        return;
+    }
+    /* Leaf keys lie in [lower, upper), separators may equal upper */
+    std::vector <char> keys((long)size * _idxLen);
+    bool ordered = true, inside = true;
+    for (int i = 0; i < size; i ++){
+        char *key = &keys[(long)i * _idxLen];
+        _layout -> readKey(page, i, key);
+        if (i && _layout -> compare(key - _idxLen, key) >= 0) ordered = false;
+        if (lower && _layout -> compare(key, lower) < 0) inside = false;
+        if (upper && _layout -> compare(key, upper) >= (leaf ? 0 : 1)) inside = false;
+    }
+    if (!ordered) addProblem_p(problems, BPlusTreeProblem::KEY_ORDER, position);
+    if (!inside) addProblem_p(problems, BPlusTreeProblem::SEPARATOR, position);
+    if (leaf){
+        if (verifier -> leafDepth == -1) verifier -> leafDepth = depth;
+        else if (depth != verifier -> leafDepth) addProblem_p(problems, BPlusTreeProblem::DEPTH, position);
+        if (verifier -> prevLeaf > 0 && verifier -> prevNext != position) addProblem_p(problems, BPlusTreeProblem::LEAF_CHAIN, position);
+        if (!verifier -> prevLeaf) verifier -> firstLeaf = position;
+        verifier -> prevLeaf = position;
+        verifier -> prevNext = NodeLayout::next(page);
+        for (int i = 0; _duplicates && i < size; i ++){
+            int posPage = _layout -> posPage(page, i), posSlot = _layout -> posSlot(page, i);
+            if (posPage == POSTING_LIST) verifyPostings_p(verifier, posSlot);
+            else if (posPage < POSTING_LIST) verifier -> shortLists.push_back(std::make_pair(posSlot, POSTING_SHORT - posPage));
+        }
+        releaseBlock_p(&b);
+        return;
+    }
+    std::vector <int> children(size + 1);
+    for (int i = 0; i <= size; i ++) children[i] = _layout -> child(page, i);
+    releaseBlock_p(&b);
+    for (int i = 0; i <= size; i ++){
+        const char *from = i ? &keys[(long)(i - 1) * _idxLen] : lower;
+        const char *to = i < size ? &keys[(long)i * _idxLen] : upper;
+        if (!split){
+            verify_p(verifier, children[i], depth + 1, from, to, 0);
+            continue;
+        }
+        BPlusTreeSubtree s;
+        s.position = children[i];
+        s.depth = depth + 1;
+        s.checked = false;
+        if (from) s.lower.assign(from, from + _idxLen);
+        if (to) s.upper.assign(to, to + _idxLen);
+        split -> push_back(s);
+    }
+}
+
+/* Blocks reached from the root must be reached once and not be free; every other block must be free or a map page */
+void BPlusTree::verifyFreeMap_p(std::vector <int> &blocks, std::vector <BPlusTreeProblem> &problems) const{
+    int fileBlocks = _fm -> fileSize() / _blkSize, free = 0;
+    /* 1 for a block reached, 2 for a map page */
+    std::vector <char> used(fileBlocks, 0);
+    for (int i = 0; i < (int)blocks.size(); i ++){
+        if (used[blocks[i]]) addProblem_p(problems, BPlusTreeProblem::SHARED_BLOCK, blocks[i]);
+        used[blocks[i]] = 1;
+    }
+    for (int i = 0; i < (int)_mapBlocks.size(); i ++){
+        if (_mapBlocks[i] >= fileBlocks) addProblem_p(problems, BPlusTreeProblem::BAD_POINTER, _mapBlocks[i]);
+        else {
+            if (used[_mapBlocks[i]]) addProblem_p(problems, BPlusTreeProblem::SHARED_BLOCK, _mapBlocks[i]);
+            used[_mapBlocks[i]] = 2;
+        }
+    }
+    for (int i = 0; i < (int)_freeMap.size() * 8; i ++){
+        if (!(_freeMap[i / 8] & (1 << (i & 7)))) continue;
+        free ++;
+        if (i < FIRST_NODE_BLOCK || i >= fileBlocks || used[i]) addProblem_p(problems, BPlusTreeProblem::FREE_MAP, i);
+    }
+    if (free != _freeCount) addProblem_p(problems, BPlusTreeProblem::FREE_MAP, 0);
+    for (int i = FIRST_NODE_BLOCK; i < fileBlocks; i ++){
+        if (!used[i] && (i / 8 >= (int)_freeMap.size() || !(_freeMap[i / 8] & (1 << (i & 7))))) addProblem_p(problems, BPlusTreeProblem::LOST_BLOCK, i);
+    }
+}
+
+/* The pages of a posting list must be of their type, hold their positions in increasing order and as many as the first page counts, at least two */
+void BPlusTree::verifyPostings_p(BPlusTreeVerifier *verifier, int first) const{
+    std::vector <std::pair <int, int> > positions;
+    bool valid = true;
+    int total = 0;
+    for (int at = first, pages = 0; at && valid; pages ++){
+        BPlusTreeBlock b;
+        /* A chain longer than the file runs in a cycle, its blocks are reached twice already */
+        if (pages == verifier -> fileBlocks || !verifyRead_p(verifier, at, &b)) return;
+        int size = PostingList::size(b.page);
+        if (NodeLayout::type(b.page) != TREE_NODE_TYPE_POSTING || size < 1 || size > (_pageSize - PostingList::HEADER) / 2) valid = false;
+        else {
+            if (at == first) total = PostingList::total(b.page);
+            PostingList::read(b.page, positions);
+        }
+        at = PostingList::next(b.page);
+        clearBlock_p(&b);
+    }
+    for (int i = 1; valid && i < (int)positions.size(); i ++) valid = positions[i - 1] < positions[i];
+    if (!valid || (int)positions.size() != total || total < 2) addProblem_p(verifier -> problems, BPlusTreeProblem::POSTING, first);
+}
+
+/* Pins position for verify(), false with the problem noted if it lies outside the file or cannot be read */
+bool BPlusTree::verifyRead_p(BPlusTreeVerifier *verifier, int position, BPlusTreeBlock *block) const{
+    if (position < FIRST_NODE_BLOCK || position >= verifier -> fileBlocks){
+        addProblem_p(verifier -> problems, BPlusTreeProblem::BAD_POINTER, position);
+        return false;
+    }
+    verifier -> blocks.push_back(position);
+    try {
+        readBlock_p(position, block);
+    }  catch (BufferPoolException &e){
+        if (e.errNo() != BufferPoolException::ERR_BAD_PAGE) throw;
+        addProblem_p(verifier -> problems, BPlusTreeProblem::BAD_PAGE, position);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reads each page of short lists once, however many keys use it: each of its
+ * slots in use must belong to exactly one key and hold 2 to
+ * as many positions as a slot of its class has room for, in increasing order.
+ */
+void BPlusTree::verifyShortLists_p(BPlusTreeVerifier *verifier, std::vector <std::pair <int, int> > &lists) const{
+    std::sort(lists.begin(), lists.end());
+    for (int i = 0, j; i < (int)lists.size(); i = j){
+        int page = lists[i].first;
+        for (j = i; j < (int)lists.size() && lists[j].first == page; j ++);
+        BPlusTreeBlock b;
+        if (!verifyRead_p(verifier, page, &b)) continue;
+        bool valid = NodeLayout::type(b.page) == TREE_NODE_TYPE_SHORT_POSTINGS && PostingList::slotsUsed(b.page) == j - i;
+        int slots = valid ? PostingList::slots(b.page, _pageSize) : 0;
+        for (int k = i; valid && k < j; k ++){
+            int slot = lists[k].second, size = slot < slots ? PostingList::slotSize(b.page, slot) : 0;
+            std::vector <PostingList::Position> positions;
+            if ((k > i && slot == lists[k - 1].second) || size < 2 || size > PostingList::slotCapacity(b.page)) valid = false;
+            else PostingList::readShort(b.page, slot, positions);
+            for (int m = 1; valid && m < size; m ++) valid = positions[m - 1] < positions[m];
+        }
+        clearBlock_p(&b);
+        if (!valid) addProblem_p(verifier -> problems, BPlusTreeProblem::POSTING, page);
+    }
+}
+
+void BPlusTree::verifySubtree_p(BPlusTreeVerifier *verifier, BPlusTreeSubtree *subtree, std::vector <BPlusTreeSubtree> *split) const{
+    verifier -> firstLeaf = -1;
+    verifier -> prevLeaf = 0;
+    verify_p(verifier, subtree -> position, subtree -> depth, subtree -> lower.size() ? &subtree -> lower[0] : 0, subtree -> upper.size() ? &subtree -> upper[0] : 0, split);
+    subtree -> firstLeaf = verifier -> firstLeaf;
+    subtree -> lastLeaf = verifier -> prevLeaf;
+    subtree -> lastNext = verifier -> prevNext;
+}
+
+/* Takes the subtrees of a verify() call in turn until none are left */
+void *BPlusTree::verifyThread_p(void *arg){
+    BPlusTreeVerifier *verifier = (BPlusTreeVerifier *)arg;
+    std::vector <BPlusTreeSubtree> &subtrees = *verifier -> subtrees;
+    for (;;){
+        int i = __atomic_fetch_add(verifier -> next, 1, __ATOMIC_RELAXED);
+        if (i >= (int)subtrees.size()) return 0;
+        if (!subtrees[i].checked) verifier -> tree -> verifySubtree_p(verifier, &subtrees[i], 0);
+    }
+}
+
+void BPlusTree::readBlock_p(int position, BPlusTreeBlock *block) const{
+    _stats.count(TreeStats::COUNTER_BLOCK_READS);
+    pinBlock_p(position, block, true);
+}
+
+/* Appends the positions of the posting list starting at first to to */
+/* Appends every position of value loc of the leaf page to to */
+void BPlusTree::readPositions_p(char *page, int loc, std::vector <std::pair <int, int> > &to) const{
+    int posPage = _layout -> posPage(page, loc), posSlot = _layout -> posSlot(page, loc);
+    if (!_duplicates || posPage > POSTING_LIST) to.push_back(std::make_pair(posPage, posSlot));
+    else if (posPage == POSTING_LIST) readPostings_p(posSlot, to);
+    else {
+        BPlusTreeBlock b;
+        readBlock_p(posSlot, &b);
+        PostingList::readShort(b.page, POSTING_SHORT - posPage, to);
+        clearBlock_p(&b);
+    }
+}
+
+void BPlusTree::readPostings_p(int first, std::vector <std::pair <int, int> > &to) const{
+    for (int at = first; at; ){
+        BPlusTreeBlock b;
+        readBlock_p(at, &b);
+        PostingList::read(b.page, to);
+        at = PostingList::next(b.page);
+        clearBlock_p(&b);
+    }
+}
+
+/* Inside an exclusive section the block is also remembered for the commit and the node cache update in unlockTree_p */
+void BPlusTree::writeBlock_p(BPlusTreeBlock *block){
+    _stats.count(TreeStats::COUNTER_BLOCK_WRITES);
+    _bp -> markDirty(block -> frame);
+    if (_log && (_treeVersion & 1)) _logBlocks.push_back(block -> position);
+    if (_cacheNodes && (_treeVersion & 1)) _cacheBlocks.push_back(block -> position);
+}
+
+/* Writes the pages in run to consecutive blocks from first on, in one call, and empties it */
+void BPlusTree::writeRun_p(int first, std::vector <char> &run){
+    int count = run.size() / _blkSize;
+    std::vector <long> positions(count);
+    std::vector <const char *> data(count);
+    for (int i = 0; i < count; i ++){
+        positions[i] = (long)(first + i) * _blkSize;
+        data[i] = &run[(long)i * _blkSize];
+        if (_checksums) PageChecksum::stamp(&run[(long)i * _blkSize], _blkSize, first + i);
+    }
+    _fm -> writeBlocks(&positions[0], &data[0], count);
+    run.clear();
+}
+
+/* Writes the map pages changed in the current section, each one links to the next */
+void BPlusTree::writeFreeMap_p(){
+    int bytes = _mapBits / 8;
+    for (int i = 0; i < (int)_mapBlocks.size(); i ++){
+        if (!_mapDirty[i]) continue;
+        _mapDirty[i] = false;
+        BPlusTreeBlock block;
+        pinBlock_p(_mapBlocks[i], &block, false);
+        int next = i + 1 < (int)_mapBlocks.size() ? _mapBlocks[i + 1] : 0;
+        memset(block.page, 0, _blkSize);
+        NodeLayout::type(block.page) = TREE_NODE_TYPE_FREE_MAP;
+        memcpy(block.page + sizeof(int), &next, sizeof(int));
+        memcpy(block.page + FREE_MAP_HEADER, &_freeMap[(long)i * bytes], bytes);
+        writeBlock_p(&block);
+        clearBlock_p(&block);
+    }
+}
+
+/* Sections only set _headerDirty, the header is written once when they end; the free list of older files is left empty */
+void BPlusTree::writeHeader_p(){
+    _stats.count(TreeStats::COUNTER_HEADER_WRITES);
+    _headerDirty = false;
+    BPlusTreeBlock block;
+    pinBlock_p(1, &block, false);
+    memset(block.page, 0, _blkSize);
+    memcpy(block.page, B_TREE_FILE_HEADER, B_TREE_FILE_HEADER_LEN);
+    memcpy(block.page + B_TREE_FILE_HEADER_LEN, &_rootBlock.position, sizeof(int));
+    int map = _mapBlocks.size() ? _mapBlocks[0] : 0;
+    memcpy(block.page + B_TREE_FILE_HEADER_LEN + sizeof(int) * 2, &map, sizeof(int));
+    int flags = _checksums ? HEADER_CHECKSUMS : 0;
+    memcpy(block.page + B_TREE_FILE_HEADER_LEN + sizeof(int) * 3, &flags, sizeof(int));
+    for (int c = 0; c < PostingList::SHORT_CLASSES; c ++) memcpy(block.page + B_TREE_FILE_HEADER_LEN + sizeof(int) * (c ? 5 + c : 4), &_shortPages[c], sizeof(int));
+    int blocks = _fm -> fileSize() / _blkSize;
+    memcpy(block.page + B_TREE_FILE_HEADER_LEN + sizeof(int) * 5, &blocks, sizeof(int));
+    writeBlock_p(&block);
+    clearBlock_p(&block);
+}
@@ -1,95 +1,573 @@
 #ifndef B_PLUS_TREE_H
 #define B_PLUS_TREE_H
 
+#include "BufferPool.h"
+#include "NodeLayout.h"
+#include "PostingList.h"
+#include "TreeStats.h"
+
 #include <exception>
 #include <iostream>
+#include <map>
+#include <pthread.h>
+#include <vector>
 
 #define B_TREE_FILE_HEADER "B_TREE_CREATED_BY_SUNZHENG"
 #define B_TREE_FILE_HEADER_LEN strlen(B_TREE_FILE_HEADER)
 
 class FileManager;
+class NodeCache;
+class WriteAheadLog;
 
 class BPlusTreeException : public std::exception{
     public:
         BPlusTreeException(int errNo);
         BPlusTreeException(const BPlusTreeException &e);
 
+        int errNo() const throw();
         const char *msg() const throw();
-        
+
         static const int ERR_FILE_NOT_OPEN = 0;
+        static const int ERR_TREE_NOT_EMPTY = 1;
+        static const int ERR_UNSORTED_INPUT = 2;
+        static const int ERR_UNKNOWN_INDEX_TYPE = 3;
+        static const int ERR_KEY_TOO_LONG = 4;
+        static const int ERR_FORMAT_MISMATCH = 5;
+        static const int ERR_RESERVED_POSITION = 6;
 
     private:
         int _errNo;
 };
 
+class BPlusTree;
+
+/*
+ * Positions stored for one key, in increasing order of posPage, then posSlot.
+ * They are all read when the iterator is made, so it stays valid whatever
+ * happens to the tree afterwards.
+ */
+class BPlusTreeMatchIterator{
+    public:
+        void next();
+        int posPage() const;
+        int posSlot() const;
+        bool valid() const;
+
+    private:
+        friend class BPlusTree;
+
+        BPlusTreeMatchIterator();
+
+        std::vector <std::pair <int, int> > _positions;
+        int _loc;
+};
+
+/*
+ * What BPlusTree::stats() reports. Counters run from when the tree was opened
+ * or resetStats() was last called, indexed by TreeStats::COUNTER_*. The shape
+ * of the tree, from height on, is only filled in when asked for, since it
+ * takes reading every node.
+ */
+struct BPlusTreeStats{
+    long counters[TreeStats::COUNTERS];
+    /* Rows per TreeStats::OP_*, only counted while timing is on, see TreeStats */
+    long latency[TreeStats::OPS][TreeStats::LATENCY_BUCKETS];
+    /* Of the buffer pool, see BufferPool::counts() */
+    long cacheHits;
+    long cacheMisses;
+    long pageWrites;
+    long freeBlocks;
+    long fileBlocks;
+    int height;
+    /* Nodes and their average fill per level, the root level first */
+    std::vector <long> levelNodes;
+    std::vector <double> levelFill;
+    long postingPages;
+    /* Memory the node cache holds, 0 while it is off */
+    long nodeCacheBytes;
+
+    /* Cached pages read with or without pinning them, over all pages read */
+    double cacheHitRatio() const;
+    /* Average fill of all nodes */
+    double fill() const;
+    /* Nanoseconds within which fraction p of the timed operations op ended, rounded up to a bucket bound */
+    long latencyPercentile(int op, double p) const;
+};
+
+/* Something wrong verify() found, in or about the block at position */
+struct BPlusTreeProblem{
+    int kind;
+    int position;
+
+    /* Could not be read, or failed its checksum */
+    static const int BAD_PAGE = 0;
+    /* A child, next leaf or posting page pointing outside the file */
+    static const int BAD_POINTER = 1;
+    /* Not the type it should be, or holding more or fewer values than it can */
+    static const int BAD_NODE = 2;
+    static const int KEY_ORDER = 3;
+    /* A key outside the range the separators of its parents give it */
+    static const int SEPARATOR = 4;
+    /* A leaf at another depth than the others */
+    static const int DEPTH = 5;
+    /* The next link of the leaf before this one does not lead here */
+    static const int LEAF_CHAIN = 6;
+    static const int POSTING = 7;
+    /* Reached twice over the tree */
+    static const int SHARED_BLOCK = 8;
+    /* A block in use marked free, or a free count that does not match the map */
+    static const int FREE_MAP = 9;
+    /* Neither free nor reached from the root */
+    static const int LOST_BLOCK = 10;
+};
+
+/* Input of BPlusTree::bulkLoad, values must come in strictly increasing index order */
+class BPlusTreeSource{
+    public:
+        virtual ~BPlusTreeSource(){}
+
+        virtual bool next(void *data, int *posPage, int *posSlot) = 0;
+};
+
+/*
+ * Forward iterator over the leaf chain, in index order. It works on a private
+ * copy of the current leaf, so no page stays pinned or latched between calls;
+ * moving to the next leaf starts again from the root if the tree has been
+ * restructured meanwhile. With prefetch, the leaves ahead are read in groups
+ * of up to PREFETCH_WINDOW, all at once over an asynchronous FileManager.
+ */
+class BPlusTreeIterator{
+    public:
+        BPlusTreeIterator(const BPlusTreeIterator &it);
+        ~BPlusTreeIterator();
+        BPlusTreeIterator &operator=(const BPlusTreeIterator &it);
+
+        const void *key() const;
+        /* Every position of the current key, which posPage() and posSlot() only give for a key that has one */
+        BPlusTreeMatchIterator matches() const;
+        void next();
+        int posPage() const;
+        int posSlot() const;
+        bool valid() const;
+
+    private:
+        friend class BPlusTree;
+
+        BPlusTreeIterator(BPlusTree *tree, bool prefetch);
+
+        BPlusTree *_tree;
+        int _position;
+        char *_page;
+        int _loc;
+        /* Key of value _loc, read out of _page by settle_p */
+        char *_key;
+        char *_end;
+        char *_last;
+        bool _lastInclusive;
+        unsigned long _treeVersion;
+        bool _prefetch;
+        /* Leaves read ahead that the iterator has not reached yet */
+        int _window;
+
+        void alloc_p();
+        void copy_p(int position, int frame, const char *page);
+        bool nextOptimistic_p(int next);
+        void seek_p(const void *data, bool inclusive);
+        bool seekOptimistic_p(const void *data, bool inclusive);
+        void settle_p();
+};
+
+/*
+ * All calls may be made from several threads at once. Lookups, scans and
+ * updates that stay within one leaf run concurrently, crabbing latches from
+ * the root down; splits, merges, batch updates and bulk loading take the
+ * tree latch exclusively.
+ *
+ * query() and iterators first try without any latch: they read cached pages
+ * in place and validate the page and tree versions afterwards, falling back
+ * to latch crabbing after repeated conflicts or on a page that is not cached.
+ *
+ * Given a WriteAheadLog, every update is logged and committed as a whole, and
+ * opening the tree first recovers the file from the log. The tree header
+ * keeps the length of the file as of the last commit, so blocks appended by a
+ * section that never committed are cut off then. flush() is then a
+ * checkpoint.
+ *
+ * Keys are ordered by the NodeLayout the tree is built on: the one for an
+ * IDX_TYPE_* index type, or any TypedNodeLayout handed over by the caller,
+ * see TypedBPlusTree.h. IDX_TYPE_INT64 and IDX_TYPE_UINT64 take 8 byte keys,
+ * IDX_TYPE_BYTES indexLen bytes compared with memcmp. IDX_TYPE_COMPRESSED_STRING
+ * orders keys as IDX_TYPE_STRING but stores them prefix compressed, see
+ * CompressedNodeLayout; it is a different file format. Nodes there take up
+ * as many bytes as their keys need, so indexLen is only the longest key
+ * allowed. String keys given to insert(), query(), remove(), lowerBound() and
+ * scan() may be shorter than indexLen if NUL terminated. The tree cannot be
+ * opened with an indexLen too long for MIN_NODE_CAPACITY keys to fit in a node.
+ *
+ * Free blocks are tracked by a bitmap, kept in free-space map pages, so a
+ * block is reused without being read. A new node goes into a free block near
+ * the node it splits off, else the lowest free one. compact() moves the nodes
+ * at the end of the file into free blocks before them and cuts the file
+ * short; files written before the map have their free list moved into it
+ * when they are opened.
+ *
+ * defragment() lays the leaves out again in index order, in consecutive
+ * blocks from the start of the file, so that scans read them sequentially.
+ * Each call handles a bounded number of leaves and remembers where it
+ * stopped, to be called again from a background thread until it returns
+ * false.
+ *
+ * A node filled less than the minimum fill after a remove is merged into a
+ * neighbour if they fit in one node. Otherwise a leaf and the leaves on
+ * either side are spread over two if they fit, else the node takes values
+ * over from its fuller neighbour.
+ * With SPLIT_SHIFT, a full leaf first hands values to a neighbour before it
+ * splits; when both are full, the split leaves three nodes about two thirds
+ * full instead of two half full ones.
+ *
+ * With IDX_DUPLICATES or'ed into the index type, a key may be inserted with
+ * any number of positions. A key with one keeps it in its leaf; a key with
+ * more has its leaf value point to a posting list, see PostingList. Up to
+ * PostingList::shortSize() positions take a slot of a page shared by keys of
+ * about as many, moving to a larger or smaller slot as the key gains or loses
+ * positions; a key past that gets pages of its own, which hold the positions
+ * sorted and delta encoded, until removes bring it down to half as many.
+ * posPage values from POSTING_LIST down are the tree's own in such an index,
+ * and are refused as positions of a key. query() then gives the
+ * first position of a key and queryAll() every one, remove() with a position
+ * takes a single one away and remove() without any the key with all of them.
+ *
+ * stats() tells what the tree has been doing, see TreeStats, and how it is
+ * shaped. Counting costs a few stores per page read, timing query(), insert()
+ * and remove() two clock reads each and is off until setStatsTiming().
+ *
+ * With IDX_CHECKSUMS or'ed into the index type, the last PageChecksum::SIZE
+ * bytes of every page hold a CRC32C of it, written as the buffer pool writes
+ * the page back and checked as it reads the page in. A corrupt or torn page
+ * makes the call that reads it throw BufferPoolException::ERR_BAD_PAGE
+ * instead of being taken for a node. Nodes get that much less room, so such
+ * a file only opens with checksums on, and any other only with them off.
+ * A call that throws, here or for want of a free frame in the pool, first
+ * gives back every latch and pin it held, so the tree stays usable. With a
+ * log, an update cut short is rolled back to the last commit; without one
+ * it keeps what it had changed so far.
+ * verify() checks the whole tree, key order, separators, the leaf chain and
+ * the free-space map, reading subtrees in several threads if asked to.
+ *
+ * setNodeCache() keeps a copy of every non-leaf node in memory, see
+ * NodeCache, brought up to date as each exclusive section ends. Finding the
+ * leaf of a key then reads no page, so a lookup reads the leaf alone. Each
+ * copy has room for the keys its node holds, up to four times as many, at
+ * full length: for a layout that stores keys shorter on the page, such as a
+ * compressed one, that is more than the node takes on disk.
+ */
 class BPlusTree{
-    public: 
-        BPlusTree(FileManager *fm, int indexType, int indexLen);
+    public:
+        BPlusTree(FileManager *fm, int indexType, int indexLen, int cacheSize = DEFAULT_CACHE_SIZE, int cachePolicy = BufferPool::POLICY_LRU, WriteAheadLog *log = 0);
+        /* The tree takes over layout, which with checksums must be made for PageChecksum::SIZE bytes less than a block; duplicates is IDX_DUPLICATES */
+        BPlusTree(FileManager *fm, NodeLayout *layout, int cacheSize = DEFAULT_CACHE_SIZE, int cachePolicy = BufferPool::POLICY_LRU, WriteAheadLog *log = 0, bool checksums = false, bool duplicates = false);
         ~BPlusTree();
-        
+
+        int bulkLoad(BPlusTreeSource *source, double fillFactor = 1.0);
+        int compact();
+        bool defragment(int maxLeaves = DEFRAG_STEP, double fillFactor = 0);
+        void flush();
         bool insert(void *data, int posPage, int posSlot);
+        int insertBatch(void *data, int *posPage, int *posSlot, int count, bool *results = 0);
+        BPlusTreeIterator lowerBound(void *data, bool prefetch = false);
         void print() const;
         std::pair <int, int> query(void *data);
+        BPlusTreeMatchIterator queryAll(void *data);
+        void queryBatch(void *data, int count, std::pair <int, int> *results);
         bool remove(void *data);
+        bool remove(void *data, int posPage, int posSlot);
+        int removeBatch(void *data, int count, bool *results = 0);
+        void resetStats();
+        BPlusTreeIterator scan(void *from, void *to, bool prefetch = false);
+        void setMinFill(double minFill);
+        void setNodeCache(bool on);
+        void setSplitPolicy(int policy);
+        void setStatsTiming(bool timing);
+        BPlusTreeStats stats(bool structure = false) const;
+        /* Number of problems found, which are appended to problems if given; structure changes wait for it */
+        int verify(std::vector <BPlusTreeProblem> *problems = 0, int threads = 1);
 
         static const int IDX_TYPE_INT = 0;
-        static const int IDX_TYPE_STRING = 1; 
+        static const int IDX_TYPE_STRING = 1;
+        static const int IDX_TYPE_INT64 = 2;
+        static const int IDX_TYPE_UINT64 = 3;
+        static const int IDX_TYPE_BYTES = 4;
+        static const int IDX_TYPE_COMPRESSED_STRING = 5;
+        /* Or'ed into an index type for the packed leaf format of NodeLayout */
+        static const int IDX_PACKED_LEAVES = 0x100;
+        /* Or'ed into an index type for a non-unique index */
+        static const int IDX_DUPLICATES = 0x200;
+        /* Or'ed into an index type for checksummed pages */
+        static const int IDX_CHECKSUMS = 0x400;
+        /* posPage of the leaf value of a key with a posting list, posSlot is the list's first page */
+        static const int POSTING_LIST = -2;
+        /* posPage of the leaf value of a key with a short list, less its slot; posSlot is the page of the slot */
+        static const int POSTING_SHORT = -3;
+
+        static const int SPLIT_HALVES = 0;
+        static const int SPLIT_SHIFT = 1;
+
+        static const double DEFAULT_MIN_FILL;
+
+        /* Leaves one call to defragment() handles by default */
+        static const int DEFRAG_STEP = 64;
+
+        static const int DEFAULT_CACHE_SIZE = 1024;
+        static const int MIN_CACHE_SIZE = 64;
 
     private:
+        friend class BPlusTreeIterator;
+
+        /* A pinned page of the buffer pool, interpreted through _layout */
         struct BPlusTreeBlock{
             int position;
-            int type;
-            union {
-                struct {
-                    int size;
-                    int next;
-                    int *posPage;
-                    int *posSlot;
-                    void *value;
-                } leaf;
-                struct {
-                    int size;
-                    int *child;
-                    void *value;
-                } nonleaf;
-                struct {
-                    int next;
-                } empty;
-            } data;
+            int frame;
+            char *page;
+        };
+
+        /* A subtree verify() hands to one thread, with the range of keys its parents allow, empty where they set no bound */
+        struct BPlusTreeSubtree{
+            int position;
+            int depth;
+            std::vector <char> lower;
+            std::vector <char> upper;
+            /* Already checked while the tree was being split */
+            bool checked;
+            /* Its first and last leaves and where the last one links to, see BPlusTreeVerifier */
+            int firstLeaf;
+            int lastLeaf;
+            int lastNext;
+        };
+
+        /* State of one verify() thread */
+        struct BPlusTreeVerifier{
+            const BPlusTree *tree;
+            std::vector <BPlusTreeSubtree> *subtrees;
+            int *next;
+            std::vector <BPlusTreeProblem> problems;
+            /* Nodes and posting pages reached */
+            std::vector <int> blocks;
+            /* Page and slot of every short list reached, its pages are checked once all are */
+            std::vector <std::pair <int, int> > shortLists;
+            int fileBlocks;
+            /* First leaf of the subtree being checked, and the last one so far with its next link; -1 where a node that could not be read hides them, prevLeaf 0 before any leaf */
+            int firstLeaf;
+            int prevLeaf;
+            int prevNext;
+            /* Depth of the first leaf, which every leaf shares, -1 if unknown */
+            int leafDepth;
+        };
+
+        /*
+         * What the calling thread holds of the tree in the current call: the
+         * tree latch, and the frames it pinned and latched. Every call that
+         * may read a page makes one; a page that cannot be read throws out of
+         * the call, and the guard then gives back whatever is left.
+         */
+        struct BPlusTreeGuard{
+            BPlusTreeGuard(BPlusTree *tree);
+            ~BPlusTreeGuard();
+            /* Gives back the frames held */
+            void release();
+
+            BPlusTree *tree;
+            /* Guard of the call this one runs in, if any */
+            BPlusTreeGuard *outer;
+            /* 0, GUARD_SHARED or GUARD_EXCLUSIVE */
+            int treeLatch;
+            std::vector <int> pins;
+            std::vector <int> latches;
+        };
+
+        /* Keys of a batch call, visited in index order through order */
+        struct BPlusTreeBatch{
+            const char *data;
+            const int *posPage;
+            const int *posSlot;
+            int *order;
+            bool *results;
         };
 
-        static const int TREE_NODE_TYPE_EMPTY = 0;
-        static const int TREE_NODE_TYPE_LEAF = 1;
-        static const int TREE_NODE_TYPE_NONLEAF = 2;
+        static const int TREE_NODE_TYPE_EMPTY = NodeLayout::TYPE_EMPTY;
+        static const int TREE_NODE_TYPE_LEAF = NodeLayout::TYPE_LEAF;
+        static const int TREE_NODE_TYPE_NONLEAF = NodeLayout::TYPE_NONLEAF;
+        static const int TREE_NODE_TYPE_FREE_MAP = NodeLayout::TYPE_FREE_MAP;
+        static const int TREE_NODE_TYPE_POSTING = NodeLayout::TYPE_POSTING;
+        static const int TREE_NODE_TYPE_SHORT_POSTINGS = NodeLayout::TYPE_SHORT_POSTINGS;
+
+        static const int OPTIMISTIC_RETRIES = 4;
+        static const int OPTIMISTIC_CONFLICT = -1;
+        static const int OPTIMISTIC_MISS = -2;
+
+        /* Leaves an iterator asked to prefetch reads ahead */
+        static const int PREFETCH_WINDOW = 32;
+
+        /* Fewest keys of indexLen bytes every node must hold, or splits could not make room */
+        static const int MIN_NODE_CAPACITY = 3;
+
+        /* Most consecutive blocks bulkLoad() writes at once */
+        static const int BULK_WRITE_RUN = 64;
+
+        /* Bit of the tree header flags, set for a file with checksummed pages */
+        static const int HEADER_CHECKSUMS = 1;
+
+        /* Tree latch held by a BPlusTreeGuard */
+        static const int GUARD_SHARED = 1;
+        static const int GUARD_EXCLUSIVE = 2;
+
+        /* verify() splits the tree into this many subtrees per thread, where it is large enough */
+        static const int VERIFY_SUBTREES = 8;
+        /* Deeper nodes are taken for a cycle */
+        static const int VERIFY_MAX_HEIGHT = 64;
+
+        /* Blocks 0 and 1 hold the file and tree headers */
+        static const int FIRST_NODE_BLOCK = 2;
+        /* Bytes of the free-space map searched on either side of a new node's neighbour */
+        static const int LOCALITY_WINDOW = 64;
+        /* A free-space map page: type | next map page | bits */
+        static const int FREE_MAP_HEADER = sizeof(int) * 2;
 
         FileManager *_fm;
-        BPlusTreeBlock *_rootBlock;
-        int _idxType;
+        WriteAheadLog *_log;
+        /* Blocks written in the current exclusive section, committed when it ends */
+        std::vector <int> _logBlocks;
+        BufferPool *_bp;
+        NodeLayout *_layout;
+        /* Shared by operations that keep the tree shape, exclusive for structure modifications */
+        mutable pthread_rwlock_t _treeLatch;
+        /* Odd inside exclusive sections, which modify pages without latching them */
+        unsigned long _treeVersion;
+        /* Root, first map page or file length changed in the current exclusive section, see writeHeader_p */
+        bool _headerDirty;
+        /* Keys may have several positions, see IDX_DUPLICATES */
+        bool _duplicates;
+        /* Pages end with a checksum, see IDX_CHECKSUMS */
+        bool _checksums;
+        BPlusTreeBlock _rootBlock;
         int _idxLen;
         int _blkSize;
+        /* Bytes of a block the tree may use, the checksum takes the rest */
+        int _pageSize;
         int _nonLeafDataCount;
+        /* Nodes filled less after a remove are merged or refilled, see setMinFill() */
+        double _minFill;
+        int _splitPolicy;
         int _leafDataCount;
-        int _emptyNode;
-        
-        void addEmptyBlock_p(int position);
-        void addToLeaf_p(void *data, int posPage, int posSlot, BPlusTreeBlock *block, int loc = -1);
-        void addToNonLeaf_p(BPlusTreeBlock *blockAdd, BPlusTreeBlock *block, int loc = -1);
-        int calcBlockPosition_p(void *data, BPlusTreeBlock *block, int *equals = 0);
-        void clearBlock_p(BPlusTreeBlock *&block) const;
-        int emptyBlockPosition_p();
-        bool insert_p(BPlusTreeBlock *block, void *data, int posPage, int posSlot);
-        void mergeLeaf_p(BPlusTreeBlock *block, BPlusTreeBlock *nextBlock);
-        void mergeNonLeaf_p(BPlusTreeBlock *block, BPlusTreeBlock *nextBlock);
-        BPlusTreeBlock *newBlock_p(int position, int type);
+        /* Free-space map, bit i is set while block i is free; blocks it does not cover are in use */
+        std::vector <unsigned char> _freeMap;
+        /* Map pages keeping it on disk, each covers _mapBits blocks */
+        std::vector <int> _mapBlocks;
+        /* Map pages changed in the current exclusive section, written when it ends */
+        std::vector <bool> _mapDirty;
+        int _mapBits;
+        int _freeCount;
+        /* No byte of _freeMap before this one has a bit set */
+        int _freeHint;
+        /* Page of short lists of each class a new one tries first, 0 for none; kept in the tree header */
+        int _shortPages[PostingList::SHORT_CLASSES];
+        /* PostingList::shortSize() of the pages */
+        int _shortSize;
+        /* Where the next leaf of a running defragmentation goes, 0 when none runs */
+        int _defragNext;
+        /* First key of that leaf, empty for the first leaf */
+        std::vector <char> _defragKey;
+        TreeStats _stats;
+        /* Made the first time setNodeCache() turns it on and kept until the tree is deleted, optimistic readers may be using it */
+        NodeCache *_nodeCache;
+        /* Changed in exclusive sections only */
+        bool _cacheNodes;
+        /* Blocks written in the current exclusive section, the non-leaf ones are copied into the node cache when it ends */
+        std::vector <int> _cacheBlocks;
+        /* The node cache is loaded again as a whole when the next exclusive section ends, one was cut short */
+        bool _cacheReload;
+
+        /* Innermost guard of the calling thread */
+        static __thread BPlusTreeGuard *_guard;
+
+        void abortTree_p();
+        void addMapBlock_p();
+        bool addPosting_p(BPlusTreeBlock *leaf, int loc, int posPage, int posSlot);
+        static void addProblem_p(std::vector <BPlusTreeProblem> &problems, int kind, int position);
+        int allocBlock_p(int near);
+        int allocShort_p(int near, int cls, BPlusTreeBlock *block);
+        bool balanceLeaves_p(BPlusTreeBlock *block, int loc);
+        bool balanceNonLeaves_p(BPlusTreeBlock *block, int loc);
+        void batchOrder_p(BPlusTreeBatch *batch, int count);
+        int batchGroupEnd_p(char *page, int loc, BPlusTreeBatch *batch, int from, int to);
+        void bulkLoadLevel_p(std::vector <char> &values, std::vector <int> &positions, int perNode);
+        void clearBlock_p(BPlusTreeBlock *block) const;
+        void collapseRoot_p();
+        long commit_p(BPlusTreeBlock *blocks, int count);
+        void descend_p(const void *data, BPlusTreeBlock *leaf, bool exclusive) const;
+        int descendOptimistic_p(const void *data, BPlusTreeBlock *leaf, unsigned long *version, unsigned long *treeVersion) const;
+        int findFree_p(int from, int to);
+        int findPosting_p(int first, const std::pair <int, int> &position, int *prev) const;
+        std::pair <int, int> firstPosition_p(char *page, int loc) const;
+        void freeBlock_p(int position);
+        void freePostings_p(char *page, int loc);
+        void freeShort_p(BPlusTreeBlock *block, int slot);
+        bool insert_p(BPlusTreeBlock *block, void *data, int posPage, int posSlot, BPlusTreeBlock *split, char *sep);
+        int insertBatch_p(BPlusTreeBlock *block, BPlusTreeBatch *batch, int from, int to, std::vector <char> &values, std::vector <int> &positions);
+        void insertChildren_p(BPlusTreeBlock *block, std::vector <int> &at, std::vector <char> &values, std::vector <int> &positions, std::vector <char> &newValues, std::vector <int> &newPositions);
+        bool isFree_p(int position) const;
+        void latch_p(int frame, bool exclusive) const;
+        bool leafFull_p(char *page, const void *data);
+        void leafPath_p(const void *data, std::vector <int> &path, std::vector <int> &locs);
+        void loadFreeMap_p(int first);
+        int loadHeader_p();
+        void loadNodeCache_p();
+        void lockShared_p() const;
+        void lockTree_p();
+        bool mergeLeaves_p(BPlusTreeBlock *block, int loc);
+        int moveBlock_p(int position);
+        void newBlock_p(int type, BPlusTreeBlock *block, int near);
+        void open_p(NodeLayout *layout, int cacheSize, int cachePolicy);
+        void pinBlock_p(int position, BPlusTreeBlock *block, bool load) const;
+        bool placeLeaf_p(std::vector <int> &path, std::vector <int> &locs, int to);
+        int prevLeaf_p(std::vector <int> &path, std::vector <int> &locs);
+        int prefetchLeaves_p(const void *data, int count) const;
         void print_p(BPlusTreeBlock *block) const;
-        BPlusTreeBlock *readBlock_p(int position) const;
+        void queryBatch_p(BPlusTreeBlock *block, BPlusTreeBatch *batch, int from, int to, std::pair <int, int> *results);
+        void readBlock_p(int position, BPlusTreeBlock *block) const;
+        void readPositions_p(char *page, int loc, std::vector <std::pair <int, int> > &to) const;
+        void readPostings_p(int first, std::vector <std::pair <int, int> > &to) const;
+        void rebalance_p(BPlusTreeBlock *block, int loc);
+        void repackLeaf_p(std::vector <int> &path, std::vector <int> &locs, double fillFactor);
+        void relocate_p(BPlusTreeBlock *block, int height, int end, int *prevLeaf, std::map <int, int> &moved);
+        void relocatePostings_p(int position, int end, std::map <int, int> &moved);
+        void releaseBlock_p(BPlusTreeBlock *block) const;
         bool remove_p(BPlusTreeBlock *block, void *data);
-        void removeFromLeaf_p(BPlusTreeBlock *block, int loc);
-        void removeFromNonLeaf_p(BPlusTreeBlock *block, int loc);
-        BPlusTreeBlock *splitLeaf_p(BPlusTreeBlock *block);
-        BPlusTreeBlock *splitNonLeaf_p(BPlusTreeBlock *block);
+        int removeBatch_p(BPlusTreeBlock *block, BPlusTreeBatch *batch, int from, int to);
+        int removePosting_p(BPlusTreeBlock *leaf, int loc, int posPage, int posSlot);
+        void rollback_p();
+        void setFree_p(int position, bool free);
+        bool setLeafSeparator_p(char *page, int loc, char *left, char *right);
+        void setPositions_p(BPlusTreeBlock *leaf, int loc, std::vector <std::pair <int, int> > &positions);
+        void setRoot_p(BPlusTreeBlock *root);
+        bool setSeparator_p(char *page, int loc, const char *sep);
+        bool shiftLeaf_p(char *from, char *to, bool toLeft, bool even);
+        void structureStats_p(BPlusTreeStats *stats) const;
+        void unlatch_p(int frame) const;
+        void unlockShared_p() const;
+        void unlockTree_p();
+        void updateNodeCache_p();
+        bool validate_p(int frame, unsigned long version, unsigned long treeVersion) const;
+        void verify_p(BPlusTreeVerifier *verifier, int position, int depth, const char *lower, const char *upper, std::vector <BPlusTreeSubtree> *split) const;
+        void verifyFreeMap_p(std::vector <int> &blocks, std::vector <BPlusTreeProblem> &problems) const;
+        void verifyPostings_p(BPlusTreeVerifier *verifier, int first) const;
+        bool verifyRead_p(BPlusTreeVerifier *verifier, int position, BPlusTreeBlock *block) const;
+        void verifyShortLists_p(BPlusTreeVerifier *verifier, std::vector <std::pair <int, int> > &lists) const;
+        void verifySubtree_p(BPlusTreeVerifier *verifier, BPlusTreeSubtree *subtree, std::vector <BPlusTreeSubtree> *split) const;
+        static void *verifyThread_p(void *verifier);
         void writeBlock_p(BPlusTreeBlock *block);
+        void writeFreeMap_p();
         void writeHeader_p();
+        void writeRun_p(int first, std::vector <char> &run);
 };
 
 #endif
@@ -0,0 +1,635 @@
+#include "BufferPool.h"
+#include "FileManager.h"
+#include "PageChecksum.h"
+#include "WriteAheadLog.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+BufferPoolException::BufferPoolException(int errNo) : _errNo(errNo){
+}
+
+BufferPoolException::BufferPoolException(const BufferPoolException &e) : _errNo(e._errNo){
+}
+
+int BufferPoolException::errNo() const throw(){
+    return _errNo;
+}
+
+const char *BufferPoolException::msg() const throw(){
+    switch (_errNo){
+        case ERR_NO_FREE_FRAME :
+            return "no free frame in buffer pool";
+        case ERR_INVALID_CAPACITY :
+            return "invalid buffer pool capacity";
+        case ERR_BAD_PAGE :
+            return "page failed its checksum or could not be read";
+        default :
+            return "unknown error";
+    }
+}
+
+BufferPool::BufferPool(FileManager *fm, int capacity, int policy) : _fm(fm), _log(0), _capacity(capacity), _policy(policy), _checksums(false), _prefetching(0), _hits(0), _misses(0), _writes(0){
+    if (capacity <= 0) throw BufferPoolException(BufferPoolException::ERR_INVALID_CAPACITY);
+    _blkSize = _fm -> blockSize();
+    pthread_mutex_init(&_lock, 0);
+    pthread_mutex_init(&_flushLock, 0);
+    pthread_cond_init(&_loaded, 0);
+    _frames = new Frame[_capacity];
+    _data = new char[(long)_capacity * _blkSize];
+    int hashSize = 1;
+    while (hashSize < _capacity * 2) hashSize <<= 1;
+    _hashMask = hashSize - 1;
+    _bucket = new int[hashSize];
+    for (int i = 0; i < hashSize; i ++) _bucket[i] = -1;
+
+    /* Free frames are chained through hashNext */
+    _freeFrame = -1;
+    for (int i = _capacity - 1; i >= 0; i --){
+        _frames[i].data = _data + (long)i * _blkSize;
+        _frames[i].position = -1;
+        _frames[i].pinCount = 0;
+        _frames[i].dirty = false;
+        _frames[i].referenced = false;
+        _frames[i].loading = false;
+        _frames[i].writing = false;
+        _frames[i].exclusive = false;
+        _frames[i].uncommitted = false;
+        _frames[i].failed = false;
+        _frames[i].lsn = 0;
+        _frames[i].version = 0;
+        pthread_rwlock_init(&_frames[i].latch, 0);
+        _frames[i].lruPrev = _frames[i].lruNext = -1;
+        _frames[i].hashNext = _freeFrame;
+        _freeFrame = i;
+    }
+    _lruHead = _lruTail = -1;
+    _clockHand = 0;
+}
+
+BufferPool::~BufferPool(){
+    /* A destructor cannot report a failed write, callers that need to know flush() first */
+    try {
+        flush();
+    }  catch (...){
+    }
+    for (int i = 0; i < _capacity; i ++) pthread_rwlock_destroy(&_frames[i].latch);
+    pthread_cond_destroy(&_loaded);
+    pthread_mutex_destroy(&_flushLock);
+    pthread_mutex_destroy(&_lock);
+    delete []_bucket;
+    delete []_data;
+    delete []_frames;
+}
+
+int BufferPool::capacity() const{
+    return _capacity;
+}
+
+void BufferPool::counts(long *hits, long *misses, long *writes) const{
+    *hits = __atomic_load_n(&_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&_misses, __ATOMIC_RELAXED);
+    *writes = __atomic_load_n(&_writes, __ATOMIC_RELAXED);
+}
+
+/* Drops the unpinned frames of blocks from `from` on without writing them back, before the file is cut there */
+void BufferPool::discard(int from){
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < _capacity; i ++){
+        Frame &f = _frames[i];
+        if (f.position < from || f.pinCount || f.loading) continue;
+        if (_policy == POLICY_LRU) lruRemove_p(i);
+        hashRemove_p(i);
+        /* Stays even, but readers holding the old version fail to validate */
+        __atomic_fetch_add(&f.version, 2, __ATOMIC_ACQ_REL);
+        f.position = -1;
+        f.dirty = false;
+        f.uncommitted = false;
+        f.referenced = false;
+        f.hashNext = _freeFrame;
+        _freeFrame = i;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+/*
+ * Dirty frames are written in position order, a batch at a time. Each one is
+ * pinned, then copied under a shared latch, so writers holding an exclusive
+ * latch are never caught halfway; it stays pinned until the batch is written,
+ * so eviction cannot write a newer copy of the page before this one lands.
+ */
+void BufferPool::flush(){
+    pthread_mutex_lock(&_flushLock);
+    std::vector <std::pair <int, int> > dirty;
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < _capacity; i ++)
+        if (_frames[i].position != -1 && _frames[i].dirty && !_frames[i].loading) dirty.push_back(std::make_pair(_frames[i].position, i));
+    pthread_mutex_unlock(&_lock);
+    std::sort(dirty.begin(), dirty.end());
+
+    /* Leave most frames to the other threads */
+    int batch = _capacity / 4 < FLUSH_BATCH ? _capacity / 4 : FLUSH_BATCH;
+    if (batch < 1) batch = 1;
+    char *copies = new char[(long)batch * _blkSize];
+    WriteBack pages[batch];
+    int pinned[batch];
+    for (int i = 0; i < (int)dirty.size(); ){
+        int n = 0, count = 0;
+        for (; i < (int)dirty.size() && n < batch; i ++){
+            int frame = dirty[i].second;
+            Frame &f = _frames[frame];
+            pthread_mutex_lock(&_lock);
+            if (f.position != dirty[i].first || !f.dirty || f.loading){
+                pthread_mutex_unlock(&_lock);
+                continue;
+            }
+            if (f.pinCount ++ == 0 && _policy == POLICY_LRU) lruRemove_p(frame);
+            pthread_mutex_unlock(&_lock);
+            pinned[n ++] = frame;
+            pthread_rwlock_rdlock(&f.latch);
+            pthread_mutex_lock(&_lock);
+            f.dirty = false;
+            pages[count].position = f.position;
+            pages[count].uncommitted = f.uncommitted;
+            pages[count].lsn = f.lsn;
+            pthread_mutex_unlock(&_lock);
+            /* Mapped pages are written back by the kernel */
+            if (frameData_p(frame) == _data + (long)frame * _blkSize){
+                memcpy(copies + (long)count * _blkSize, frameData_p(frame), _blkSize);
+                pages[count].data = copies + (long)count * _blkSize;
+                count ++;
+            }  else if (_checksums) PageChecksum::stamp(frameData_p(frame), _blkSize, f.position);
+            pthread_rwlock_unlock(&f.latch);
+        }
+        try {
+            if (count) writeBack_p(pages, count);
+        }  catch (...){
+            /* The batch is still to be written */
+            pthread_mutex_lock(&_lock);
+            for (int j = 0; j < n; j ++) _frames[pinned[j]].dirty = true;
+            pthread_mutex_unlock(&_lock);
+            for (int j = 0; j < n; j ++) unpin(pinned[j]);
+            delete []copies;
+            pthread_mutex_unlock(&_flushLock);
+            throw;
+        }
+        for (int j = 0; j < n; j ++) unpin(pinned[j]);
+    }
+    delete []copies;
+    pthread_mutex_unlock(&_flushLock);
+}
+
+/* Latches a pinned frame, shared for readers and exclusive for writers of the page */
+void BufferPool::latch(int frame, bool exclusive){
+    Frame &f = _frames[frame];
+    if (!exclusive){
+        pthread_rwlock_rdlock(&f.latch);
+        return;
+    }
+    pthread_rwlock_wrlock(&f.latch);
+    f.exclusive = true;
+    __atomic_fetch_add(&f.version, 1, __ATOMIC_ACQ_REL);
+}
+
+/* The image of the frame's page is in the log, up to lsn */
+void BufferPool::logged(int frame, long lsn){
+    pthread_mutex_lock(&_lock);
+    _frames[frame].uncommitted = false;
+    _frames[frame].lsn = lsn;
+    pthread_mutex_unlock(&_lock);
+}
+
+/*
+ * Finds the frame caching block `position` without taking the pool lock or
+ * pinning it. Returns 0 if the block is not cached or the frame is being
+ * modified; otherwise the page stays usable as long as validate() succeeds
+ * with the returned version.
+ */
+char *BufferPool::lookup(int position, int *frame, unsigned long *version) const{
+    int f = __atomic_load_n(&_bucket[position & _hashMask], __ATOMIC_ACQUIRE);
+    /* Chains may change under us, so never walk more frames than there are */
+    for (int i = 0; f != -1 && i < _capacity; i ++){
+        const Frame &fr = _frames[f];
+        unsigned long v = __atomic_load_n(&fr.version, __ATOMIC_ACQUIRE);
+        if (!(v & 1) && __atomic_load_n(&fr.position, __ATOMIC_RELAXED) == position){
+            char *data = __atomic_load_n(&fr.data, __ATOMIC_RELAXED);
+            if (!validate(f, v)) return 0;
+            *frame = f;
+            *version = v;
+            return data;
+        }
+        f = __atomic_load_n(&fr.hashNext, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void BufferPool::markDirty(int frame){
+    /* The kernel may write a mapped page back any time, it has to hold its checksum all along */
+    if (_checksums && frameData_p(frame) != _data + (long)frame * _blkSize) PageChecksum::stamp(frameData_p(frame), _blkSize, _frames[frame].position);
+    pthread_mutex_lock(&_lock);
+    _frames[frame].dirty = true;
+    if (_log) _frames[frame].uncommitted = true;
+    pthread_mutex_unlock(&_lock);
+}
+
+/* Returns the page of block `position`. With load == false a missing page is not read from disk, for callers that overwrite it entirely */
+char *BufferPool::pin(int position, int *frame, bool load){
+    pthread_mutex_lock(&_lock);
+    int f = hashLookup_p(position), v = -1;
+    if (f == -1){
+        try {
+            v = victim_p();
+        }  catch (...){
+            pthread_mutex_unlock(&_lock);
+            throw;
+        }
+        if (v == -1){
+            pthread_mutex_unlock(&_lock);
+            throw BufferPoolException(BufferPoolException::ERR_NO_FREE_FRAME);
+        }
+        /* The pool lock is let go of while a dirty victim is written, another thread may have taken the block in meanwhile */
+        f = hashLookup_p(position);
+        if (f != -1){
+            _frames[v].hashNext = _freeFrame;
+            _freeFrame = v;
+        }
+    }
+    if (f == -1){
+        f = v;
+        _misses ++;
+        Frame &fr = _frames[f];
+        if (!(fr.version & 1)) __atomic_fetch_add(&fr.version, 1, __ATOMIC_ACQ_REL);
+        fr.position = position;
+        fr.pinCount = 1;
+        fr.dirty = false;
+        fr.uncommitted = false;
+        fr.lsn = 0;
+        fr.referenced = true;
+        hashInsert_p(f);
+        char *p = _log ? 0 : _fm -> blockPointer((long)position * _blkSize);
+        fr.data = p ? p : _data + (long)f * _blkSize;
+        if (load && !p){
+            /* Read without holding the pool lock, other threads pinning the block wait for it */
+            fr.loading = true;
+            pthread_mutex_unlock(&_lock);
+            bool valid = true;
+            try {
+                _fm -> readBlock((long)position * _blkSize, fr.data);
+            }  catch (FileManagerException &e){
+                valid = false;
+            }
+            if (valid && _checksums) valid = PageChecksum::check(fr.data, _blkSize, position);
+            pthread_mutex_lock(&_lock);
+            fr.loading = false;
+            pthread_cond_broadcast(&_loaded);
+            if (!valid){
+                fail_p(f);
+                pthread_mutex_unlock(&_lock);
+                throw BufferPoolException(BufferPoolException::ERR_BAD_PAGE);
+            }
+        }  else if (load && _checksums && !PageChecksum::check(p, _blkSize, position)){
+            fail_p(f);
+            pthread_mutex_unlock(&_lock);
+            throw BufferPoolException(BufferPoolException::ERR_BAD_PAGE);
+        }
+        __atomic_fetch_add(&fr.version, 1, __ATOMIC_ACQ_REL);
+    }  else {
+        _hits ++;
+        Frame &fr = _frames[f];
+        if (fr.pinCount ++ == 0 && _policy == POLICY_LRU) lruRemove_p(f);
+        fr.referenced = true;
+        while (fr.loading || fr.writing) pthread_cond_wait(&_loaded, &_lock);
+        if (fr.failed){
+            unpinFailed_p(f);
+            pthread_mutex_unlock(&_lock);
+            throw BufferPoolException(BufferPoolException::ERR_BAD_PAGE);
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    *frame = f;
+    return frameData_p(f);
+}
+
+int BufferPool::policy() const{
+    return _policy;
+}
+
+/* Asks the FileManager to start reading a block that is not cached yet */
+void BufferPool::prefetch(int position){
+    pthread_mutex_lock(&_lock);
+    int f = hashLookup_p(position);
+    pthread_mutex_unlock(&_lock);
+    if (f == -1) _fm -> advise(FileManager::ADVISE_WILLNEED, (long)position * _blkSize, _blkSize);
+}
+
+/*
+ * Loads the blocks that are not cached yet and leaves them unpinned. The
+ * reads are submitted together, which only helps an asynchronous FileManager;
+ * any other one just gets hints. All threads together never hold more than a
+ * quarter of the pool for prefetching, the rest of the blocks are skipped.
+ */
+void BufferPool::prefetch(const int *positions, int count){
+    if (!_fm -> asynchronous()){
+        for (int i = 0; i < count; i ++) prefetch(positions[i]);
+        return;
+    }
+    int limit = _capacity / 4 < count ? _capacity / 4 : count;
+    if (limit < 1) limit = 1;
+    FileRequest requests[limit];
+    int frames[limit], n = 0;
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < count && n < limit && _prefetching < _capacity / 4; i ++){
+        if (hashLookup_p(positions[i]) != -1) continue;
+        int f;
+        try {
+            f = victim_p();
+        }  catch (...){
+            /* A victim that cannot be written back is left for pin() to report */
+            break;
+        }
+        if (f == -1) break;
+        if (hashLookup_p(positions[i]) != -1){
+            _frames[f].hashNext = _freeFrame;
+            _freeFrame = f;
+            continue;
+        }
+        /* Set up like in pin(), other threads pinning the block wait for the read */
+        _misses ++;
+        Frame &fr = _frames[f];
+        if (!(fr.version & 1)) __atomic_fetch_add(&fr.version, 1, __ATOMIC_ACQ_REL);
+        fr.position = positions[i];
+        fr.pinCount = 1;
+        fr.dirty = false;
+        fr.uncommitted = false;
+        fr.lsn = 0;
+        fr.referenced = true;
+        fr.loading = true;
+        hashInsert_p(f);
+        fr.data = _data + (long)f * _blkSize;
+        requests[n].type = FileManager::REQUEST_READ;
+        requests[n].position = (long)positions[i] * _blkSize;
+        requests[n].data = fr.data;
+        frames[n ++] = f;
+        _prefetching ++;
+    }
+    pthread_mutex_unlock(&_lock);
+    if (!n) return;
+    _fm -> submit(requests, n);
+    _fm -> wait(requests, n);
+    pthread_mutex_lock(&_lock);
+    for (int i = 0; i < n; i ++){
+        Frame &fr = _frames[frames[i]];
+        fr.loading = false;
+        /* A block that cannot be read is left for pin() to report */
+        if (requests[i].result != _blkSize || (_checksums && !PageChecksum::check(fr.data, _blkSize, fr.position))){
+            fail_p(frames[i]);
+            continue;
+        }
+        __atomic_fetch_add(&fr.version, 1, __ATOMIC_ACQ_REL);
+        if (-- fr.pinCount == 0 && _policy == POLICY_LRU) lruPush_p(frames[i]);
+    }
+    _prefetching -= n;
+    pthread_cond_broadcast(&_loaded);
+    pthread_mutex_unlock(&_lock);
+}
+
+void BufferPool::resetCounts(){
+    pthread_mutex_lock(&_lock);
+    _hits = _misses = 0;
+    __atomic_store_n(&_writes, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&_lock);
+}
+
+/* Must be set before the first pin, as must the log */
+void BufferPool::setChecksums(bool checksums){
+    _checksums = checksums;
+}
+
+/* Must be set before the first pin */
+void BufferPool::setLog(WriteAheadLog *log){
+    _log = log;
+}
+
+void BufferPool::unlatch(int frame){
+    Frame &f = _frames[frame];
+    /* Only the exclusive holder can see the flag set, shared holders never run alongside it */
+    if (f.exclusive){
+        f.exclusive = false;
+        __atomic_fetch_add(&f.version, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_rwlock_unlock(&f.latch);
+}
+
+void BufferPool::unpin(int frame, bool dirty){
+    Frame &f = _frames[frame];
+    pthread_mutex_lock(&_lock);
+    if (dirty){
+        f.dirty = true;
+        if (_log) f.uncommitted = true;
+    }
+    if (-- f.pinCount == 0 && _policy == POLICY_LRU) lruPush_p(frame);
+    pthread_mutex_unlock(&_lock);
+}
+
+/* True if the frame has not been modified or reused since lookup() returned version */
+bool BufferPool::validate(int frame, unsigned long version) const{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&_frames[frame].version, __ATOMIC_RELAXED) == version;
+}
+
+/* Frame `frame`, pinned by the caller, could not be loaded: nothing finds it any more, and it is freed once every thread waiting for it has unpinned it. Called with the pool lock held */
+void BufferPool::fail_p(int frame){
+    hashRemove_p(frame);
+    _frames[frame].failed = true;
+    unpinFailed_p(frame);
+}
+
+char *BufferPool::frameData_p(int frame) const{
+    return _frames[frame].data;
+}
+
+void BufferPool::hashInsert_p(int frame){
+    int h = _frames[frame].position & _hashMask;
+    _frames[frame].hashNext = _bucket[h];
+    _bucket[h] = frame;
+}
+
+int BufferPool::hashLookup_p(int position) const{
+    int f = _bucket[position & _hashMask];
+    while (f != -1 && _frames[f].position != position) f = _frames[f].hashNext;
+    return f;
+}
+
+void BufferPool::hashRemove_p(int frame){
+    int *p = &_bucket[_frames[frame].position & _hashMask];
+    while (*p != frame) p = &_frames[*p].hashNext;
+    *p = _frames[frame].hashNext;
+}
+
+/* The LRU list only holds unpinned frames, most recently used at the head */
+void BufferPool::lruPush_p(int frame){
+    _frames[frame].lruPrev = -1;
+    _frames[frame].lruNext = _lruHead;
+    if (_lruHead != -1) _frames[_lruHead].lruPrev = frame;
+    _lruHead = frame;
+    if (_lruTail == -1) _lruTail = frame;
+}
+
+void BufferPool::lruRemove_p(int frame){
+    Frame &f = _frames[frame];
+    if (f.lruPrev != -1) _frames[f.lruPrev].lruNext = f.lruNext;
+    else _lruHead = f.lruNext;
+    if (f.lruNext != -1) _frames[f.lruNext].lruPrev = f.lruPrev;
+    else _lruTail = f.lruPrev;
+    f.lruPrev = f.lruNext = -1;
+}
+
+/* Unpins a failed frame, it goes back to the free frames with its last pin. Called with the pool lock held */
+void BufferPool::unpinFailed_p(int frame){
+    Frame &f = _frames[frame];
+    if (-- f.pinCount) return;
+    f.failed = false;
+    f.position = -1;
+    f.dirty = false;
+    f.uncommitted = false;
+    f.referenced = false;
+    f.hashNext = _freeFrame;
+    _freeFrame = frame;
+}
+
+/*
+ * Frees a frame for reuse, -1 when every frame is pinned. Called with the pool
+ * lock held; it is let go of while a dirty victim is written back, after which
+ * the victim is only taken if nobody pinned it meanwhile.
+ */
+int BufferPool::victim_p(){
+    for (;;){
+        int f = -1;
+        if (_freeFrame != -1){
+            f = _freeFrame;
+            _freeFrame = _frames[f].hashNext;
+            return f;
+        }
+        if (_policy == POLICY_LRU){
+            f = _lruTail;
+            if (f != -1) lruRemove_p(f);
+        }  else {
+            /* Two sweeps: the first may only clear reference bits */
+            for (int i = 0; i < _capacity * 2 && f == -1; i ++){
+                Frame &fr = _frames[_clockHand];
+                if (fr.pinCount == 0){
+                    if (fr.referenced) fr.referenced = false;
+                    else f = _clockHand;
+                }
+                _clockHand = (_clockHand + 1) % _capacity;
+            }
+        }
+        if (f == -1) return -1;
+        if (_frames[f].dirty && !writeBehind_p(f)) continue;
+        /* Odd until pin() has loaded the new block */
+        __atomic_fetch_add(&_frames[f].version, 1, __ATOMIC_ACQ_REL);
+        hashRemove_p(f);
+        _frames[f].position = -1;
+        return f;
+    }
+}
+
+/*
+ * Writes a group of pages with one call to the FileManager. With a log, the
+ * previous image of every uncommitted page is logged first, and the log is
+ * made durable once for the whole group, up to the last record any of the
+ * pages depends on.
+ */
+void BufferPool::writeBack_p(WriteBack *pages, int count){
+    std::vector <long> positions(count);
+    std::vector <const char *> data(count);
+    long lsn = 0;
+    char old[_blkSize];
+    for (int i = 0; i < count; i ++){
+        positions[i] = (long)pages[i].position * _blkSize;
+        if (_checksums) PageChecksum::stamp(pages[i].data, _blkSize, pages[i].position);
+        data[i] = pages[i].data;
+        if (!_log) continue;
+        long l = pages[i].lsn;
+        if (pages[i].uncommitted){
+            /* A block past the end of file has no image yet, zeros stand for it */
+            if (positions[i] >= _fm -> fileSize()) memset(old, 0, _blkSize);
+            else _fm -> readBlock(positions[i], old);
+            l = _log -> logUndo(pages[i].position, old, _blkSize);
+        }
+        if (l > lsn) lsn = l;
+    }
+    if (lsn) _log -> flushTo(lsn);
+    _fm -> writeBlocks(&positions[0], &data[0], count);
+    __atomic_fetch_add(&_writes, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Writes the dirty victim of an eviction together with the dirty unpinned
+ * frames caching the blocks right before and after it, which would most
+ * likely be written one by one soon. The frames are pinned and marked as being
+ * written, so nobody evicts or modifies them meanwhile, and written in place
+ * without the pool lock. Called with the pool lock held, and with the victim
+ * already taken off the LRU list; returns false if the victim got pinned while
+ * it was written. If the write fails, the frames are left dirty and the
+ * exception passes on with the pool lock held.
+ */
+bool BufferPool::writeBehind_p(int frame){
+    WriteBack pages[WRITE_BEHIND];
+    int frames[WRITE_BEHIND], count = 0;
+    int position = _frames[frame].position, low = position, high = position;
+    frames[count ++] = frame;
+    for (bool grown = true; grown && count < WRITE_BEHIND; ){
+        grown = false;
+        for (int side = 0; side < 2 && count < WRITE_BEHIND; side ++){
+            int p = side ? high + 1 : low - 1;
+            if (p < 0) continue;
+            int f = hashLookup_p(p);
+            if (f == -1) continue;
+            const Frame &fr = _frames[f];
+            if (!fr.dirty || fr.pinCount || fr.loading || frameData_p(f) != _data + (long)f * _blkSize) continue;
+            frames[count ++] = f;
+            if (side) high = p;
+            else low = p;
+            grown = true;
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < count; i ++){
+        Frame &f = _frames[frames[i]];
+        if (f.pinCount ++ == 0 && _policy == POLICY_LRU && i) lruRemove_p(frames[i]);
+        f.writing = true;
+        f.dirty = false;
+        /* Mapped pages are written back by the kernel */
+        if (frameData_p(frames[i]) != _data + (long)frames[i] * _blkSize) continue;
+        pages[n].position = f.position;
+        pages[n].data = frameData_p(frames[i]);
+        pages[n].uncommitted = f.uncommitted;
+        pages[n].lsn = f.lsn;
+        n ++;
+    }
+    pthread_mutex_unlock(&_lock);
+    try {
+        if (n) writeBack_p(pages, n);
+    }  catch (...){
+        pthread_mutex_lock(&_lock);
+        written_p(frames, count, false);
+        throw;
+    }
+    pthread_mutex_lock(&_lock);
+    written_p(frames, count, true);
+    return _frames[frame].pinCount == 0;
+}
+
+/* Ends the write of writeBehind_p(), the victim first among frames. Called with the pool lock held */
+void BufferPool::written_p(const int *frames, int count, bool written){
+    for (int i = 0; i < count; i ++){
+        Frame &f = _frames[frames[i]];
+        f.writing = false;
+        if (!written) f.dirty = true;
+        /* The victim stays off the LRU list if it is to be taken */
+        if (-- f.pinCount == 0 && _policy == POLICY_LRU && (i || !written)) lruPush_p(frames[i]);
+    }
+    pthread_cond_broadcast(&_loaded);
+}
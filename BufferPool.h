@@ -0,0 +1,161 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <exception>
+#include <pthread.h>
+
+class FileManager;
+class WriteAheadLog;
+
+class BufferPoolException : public std::exception{
+    public:
+        BufferPoolException(int errNo);
+        BufferPoolException(const BufferPoolException &e);
+
+        int errNo() const throw();
+        const char *msg() const throw();
+
+        static const int ERR_NO_FREE_FRAME = 0;
+        static const int ERR_INVALID_CAPACITY = 1;
+        static const int ERR_BAD_PAGE = 2;
+
+    private:
+        int _errNo;
+};
+
+/*
+ * Fixed-capacity page cache over a FileManager. Positions are block numbers.
+ * A pinned frame is never evicted; dirty frames are written back on eviction
+ * or flush(), in groups sorted by position so that the FileManager can
+ * coalesce adjacent blocks: flush() writes batches of pages, eviction also
+ * writes the dirty unpinned neighbours of the victim. Pages whose write
+ * fails stay dirty, and the FileManagerException passes on to the caller of
+ * pin() or flush(). When the FileManager maps the file, frames point straight into
+ * the mapping instead of holding a copy.
+ *
+ * All calls are thread-safe. The pool only guards its own bookkeeping, page
+ * contents are guarded by the per-frame latches, taken through latch().
+ *
+ * Every frame also carries a version, odd while the frame is latched
+ * exclusively or being reloaded. lookup() and validate() let readers use a
+ * cached page without pinning or latching it: whatever they read is only
+ * trusted if the version has not changed in between.
+ *
+ * Over an asynchronous FileManager, prefetch() of several blocks reads them
+ * into frames with all reads in flight at once.
+ *
+ * With a WriteAheadLog attached, a page is only written back once the log
+ * holds its image (see logged()); a page changed by an operation that has not
+ * committed yet gets its previous on-disk image logged first. Frames then
+ * always hold copies, even over a mapped file, since the kernel would write
+ * mapped pages back without asking the log.
+ *
+ * With checksums on, see PageChecksum, every page is stamped as it is written
+ * back, a mapped one whenever it is marked dirty and again by flush(), and
+ * checked as it is loaded. A page that fails, or that the file does not hold
+ * entirely, is not cached: pin() throws ERR_BAD_PAGE, to every thread that
+ * was waiting for it as well.
+ */
+class BufferPool{
+    public:
+        BufferPool(FileManager *fm, int capacity, int policy = POLICY_LRU);
+        ~BufferPool();
+
+        int capacity() const;
+        /* Pins that found their block cached, blocks taken into a frame by pin() or prefetch() and pages written back, since the pool was made or resetCounts() */
+        void counts(long *hits, long *misses, long *writes) const;
+        void discard(int from);
+        void flush();
+        void latch(int frame, bool exclusive);
+        void logged(int frame, long lsn);
+        char *lookup(int position, int *frame, unsigned long *version) const;
+        void markDirty(int frame);
+        char *pin(int position, int *frame, bool load = true);
+        int policy() const;
+        void prefetch(int position);
+        void prefetch(const int *positions, int count);
+        void resetCounts();
+        void setChecksums(bool checksums);
+        void setLog(WriteAheadLog *log);
+        void unlatch(int frame);
+        void unpin(int frame, bool dirty = false);
+        bool validate(int frame, unsigned long version) const;
+
+        static const int POLICY_LRU = 0;
+        static const int POLICY_CLOCK = 1;
+
+        /* Most pages flush() writes at once, it keeps them pinned meanwhile */
+        static const int FLUSH_BATCH = 64;
+        /* Most dirty pages next to an evicted one that are written along with it */
+        static const int WRITE_BEHIND = 16;
+
+    private:
+        struct Frame{
+            char *data;
+            int position;
+            int pinCount;
+            bool dirty;
+            bool referenced;
+            bool loading;
+            /* Being written back by an eviction, without the pool lock; pins wait for it */
+            bool writing;
+            bool exclusive;
+            bool uncommitted;
+            /* Could not be loaded, dropped once the threads waiting for it have seen that */
+            bool failed;
+            long lsn;
+            unsigned long version;
+            pthread_rwlock_t latch;
+            int hashNext;
+            int lruPrev;
+            int lruNext;
+        };
+
+        /* A page about to be written back, with what the log needs to know about it */
+        struct WriteBack{
+            int position;
+            char *data;
+            bool uncommitted;
+            long lsn;
+        };
+
+        FileManager *_fm;
+        WriteAheadLog *_log;
+        pthread_mutex_t _lock;
+        /* One flush() at a time, so that no older copy of a page is written after a newer one */
+        pthread_mutex_t _flushLock;
+        pthread_cond_t _loaded;
+        int _blkSize;
+        int _capacity;
+        int _policy;
+        bool _checksums;
+        Frame *_frames;
+        char *_data;
+        int *_bucket;
+        int _hashMask;
+        int _freeFrame;
+        int _lruHead;
+        int _lruTail;
+        int _clockHand;
+        /* Frames pinned by prefetch() while their blocks are read */
+        int _prefetching;
+        /* See counts(), hits and misses are counted under the pool lock */
+        long _hits;
+        long _misses;
+        long _writes;
+
+        void fail_p(int frame);
+        char *frameData_p(int frame) const;
+        void hashInsert_p(int frame);
+        int hashLookup_p(int position) const;
+        void hashRemove_p(int frame);
+        void lruPush_p(int frame);
+        void lruRemove_p(int frame);
+        void unpinFailed_p(int frame);
+        int victim_p();
+        void writeBack_p(WriteBack *pages, int count);
+        bool writeBehind_p(int frame);
+        void written_p(const int *frames, int count, bool written);
+};
+
+#endif
@@ -0,0 +1,359 @@
+#include "CompressedNodeLayout.h"
+
+#include <string.h>
+
+/* Compares x, xLen bytes of a search key, with a stored suffix as strncmp would with the NUL padded suffix */
+static int compareSuffix(const char *x, int xLen, const char *s, int sLen){
+    int c = NodeSearch::compareString(x, s, sLen < xLen ? sLen : xLen);
+    if (c || sLen >= xLen) return c;
+    return x[sLen] != 0;
+}
+
+CompressedNodeLayout::CompressedNodeLayout(int blkSize, int idxLen) : TypedNodeLayout <StringKey>(blkSize, StringKey(idxLen)){
+    _pageLen = blkSize < 65535 ? blkSize : 65535;
+    /* Upper bounds, for values with empty suffixes */
+    _leafCount = (_pageLen - HEADER) / (sizeof(int) * 2 + sizeof(unsigned short) * 2);
+    _nonLeafCount = (_pageLen - HEADER) / (sizeof(int) + sizeof(unsigned short) * 2);
+}
+
+/* Keys of _idxLen bytes with nothing in common, in leaves */
+int CompressedNodeLayout::minCapacity() const{
+    return (_pageLen - slotsOffset_p(_idxLen)) / (int)(sizeof(unsigned short) * 2 + sizeof(int) * 2 + _idxLen);
+}
+
+int CompressedNodeLayout::child(char *page, int i) const{
+    if (!i) return next(page);
+    int c, len;
+    memcpy(&c, record_p(page, i - 1, &len), sizeof(int));
+    return c;
+}
+
+double CompressedNodeLayout::fill(char *page) const{
+    return (double)(_pageLen - freeSpace_p(page) - HEADER) / (_pageLen - HEADER);
+}
+
+void CompressedNodeLayout::init(char *page, int t) const{
+    NodeLayout::init(page, t);
+    if (t == TYPE_EMPTY) return;
+    next(page) = 0;
+    prefixLen_p(page) = 0;
+    heap_p(page) = _pageLen;
+    dead_p(page) = 0;
+}
+
+int CompressedNodeLayout::posPage(char *page, int i) const{
+    int ret, len;
+    memcpy(&ret, record_p(page, i, &len), sizeof(int));
+    return ret;
+}
+
+int CompressedNodeLayout::posSlot(char *page, int i) const{
+    int ret, len;
+    memcpy(&ret, record_p(page, i, &len) + sizeof(int), sizeof(int));
+    return ret;
+}
+
+void CompressedNodeLayout::readKey(char *page, int i, char *key) const{
+    int p = prefix_p(page), len;
+    char *suffix = record_p(page, i, &len) + recordHeader_p(page);
+    if (len > _idxLen - p) len = _idxLen - p;
+    memcpy(key, page + HEADER, p);
+    memcpy(key + p, suffix, len);
+    memset(key + p + len, 0, _idxLen - p - len);
+}
+
+void CompressedNodeLayout::setChild(char *page, int i, int c) const{
+    if (!i){
+        next(page) = c;
+        return;
+    }
+    int len;
+    memcpy(record_p(page, i - 1, &len), &c, sizeof(int));
+}
+
+void CompressedNodeLayout::setPosition(char *page, int i, int pp, int ps) const{
+    int len;
+    char *record = record_p(page, i, &len);
+    memcpy(record, &pp, sizeof(int));
+    memcpy(record + sizeof(int), &ps, sizeof(int));
+}
+
+bool CompressedNodeLayout::underflow(char *page, int loc, double minFill) const{
+    int len;
+    record_p(page, loc, &len);
+    int used = _pageLen - freeSpace_p(page) - HEADER - sizeof(unsigned short) - recordHeader_p(page) - len;
+    return used < (_pageLen - HEADER) * minFill;
+}
+
+/* Keys that differ from the prefix of the node come before or after all of its keys, the others are told apart by their suffixes */
+int CompressedNodeLayout::search(char *page, int n, const void *data, int *equals) const{
+    const char *x = (const char *)data;
+    int p = prefix_p(page);
+    int most = (_pageLen - slotsOffset_p(p)) / (int)sizeof(unsigned short);
+    if (n > most) n = most;
+    if (equals) *equals = 0;
+    if (n <= 0) return 0;
+    int c = NodeSearch::compareString(x, page + HEADER, p);
+    if (c) return c < 0 ? n : 0;
+    int header = recordHeader_p(page), l = 0, r = n, len;
+    while (l < r){
+        int mid = (l + r) >> 1;
+        char *s = record_p(page, mid, &len) + header;
+        if (compareSuffix(x + p, _idxLen - p, s, len) <= 0) l = mid + 1;
+        else r = mid;
+    }
+    if (equals && l > 0){
+        char *s = record_p(page, l - 1, &len) + header;
+        *equals = (compareSuffix(x + p, _idxLen - p, s, len) == 0);
+    }
+    return l;
+}
+
+/*
+ * Keys are in descending strncmp order, so a prefix of left, cut right after
+ * the first byte it differs from right in, comes after left and before
+ * right. It is used when it is shorter than right.
+ */
+void CompressedNodeLayout::separator(const char *left, const char *right, char *sep) const{
+    int d = 0;
+    while (d < _idxLen && left[d] == right[d] && left[d]) d ++;
+    if (d + 1 < keyLen_p(left) && d + 1 < keyLen_p(right)){
+        memcpy(sep, left, d + 1);
+        memset(sep + d + 1, 0, _idxLen - d - 1);
+    }  else strncpy(sep, right, _idxLen);
+}
+
+bool CompressedNodeLayout::insertLeaf(char *page, int loc, const void *data, int pp, int ps) const{
+    return insert_p(page, loc, (const char *)data, pp, ps);
+}
+
+void CompressedNodeLayout::removeLeaf(char *page, int loc) const{
+    remove_p(page, loc);
+}
+
+void CompressedNodeLayout::splitLeaf(char *page, char *newPage, int loc, const void *data, int pp, int ps, char *sep) const{
+    Entries e;
+    decode_p(page, e);
+    add_p(e, loc, (const char *)data, pp, ps);
+    int count = size(page) + 1;
+    char left[_pageLen];
+    for (int k = 0; k < count; k ++){
+        int at = splitOrder_p(e, count, k);
+        if (at < 1 || at >= count) continue;
+        if (!build_p(left, TYPE_LEAF, next(page), e, 0, at) || !build_p(newPage, TYPE_LEAF, next(newPage), e, at, count)) continue;
+        memcpy(page, left, _pageLen);
+        separator(&e.keys[(at - 1) * _idxLen], &e.keys[at * _idxLen], sep);
+        return;
+    }
+}
+
+bool CompressedNodeLayout::mergeLeaf(char *page, char *nextPage) const{
+    Entries e;
+    decode_p(page, e);
+    decode_p(nextPage, e);
+    char merged[_pageLen];
+    if (!build_p(merged, TYPE_LEAF, next(nextPage), e, 0, size(page) + size(nextPage))) return false;
+    memcpy(page, merged, _pageLen);
+    return true;
+}
+
+bool CompressedNodeLayout::insertNonLeaf(char *page, int loc, const void *data, int c) const{
+    return insert_p(page, loc, (const char *)data, c, 0);
+}
+
+/* Remove the child and the value BEFORE it, which share a record */
+void CompressedNodeLayout::removeNonLeaf(char *page, int loc) const{
+    remove_p(page, loc - 1);
+}
+
+/* Value m of the node with the new value added moves up into sep, the values after it go to newPage */
+void CompressedNodeLayout::splitNonLeaf(char *page, char *newPage, int loc, const void *data, int c, char *sep) const{
+    Entries e;
+    decode_p(page, e);
+    add_p(e, loc, (const char *)data, c, 0);
+    int count = size(page) + 1;
+    char left[_pageLen];
+    for (int k = 0; k < count; k ++){
+        int m = splitOrder_p(e, count, k);
+        if (m < 1 || m >= count - 1) continue;
+        if (!build_p(left, TYPE_NONLEAF, next(page), e, 0, m) || !build_p(newPage, TYPE_NONLEAF, e.first[m], e, m + 1, count)) continue;
+        memcpy(page, left, _pageLen);
+        memcpy(sep, &e.keys[m * _idxLen], _idxLen);
+        return;
+    }
+}
+
+/* sep is the parent value separating page from nextPage */
+bool CompressedNodeLayout::mergeNonLeaf(char *page, char *nextPage, const void *sep) const{
+    Entries e;
+    decode_p(page, e);
+    add_p(e, size(page), (const char *)sep, next(nextPage), 0);
+    decode_p(nextPage, e);
+    char merged[_pageLen];
+    if (!build_p(merged, TYPE_NONLEAF, next(page), e, 0, size(page) + size(nextPage) + 1)) return false;
+    memcpy(page, merged, _pageLen);
+    return true;
+}
+
+void CompressedNodeLayout::add_p(Entries &e, int at, const char *key, int first, int second) const{
+    e.keys.insert(e.keys.begin() + at * _idxLen, _idxLen, 0);
+    strncpy(&e.keys[at * _idxLen], key, _idxLen);
+    e.first.insert(e.first.begin() + at, first);
+    e.second.insert(e.second.begin() + at, second);
+}
+
+/* Builds a node of type out of entries [from, to) with link as next leaf or child 0, false if they do not fit in a page */
+bool CompressedNodeLayout::build_p(char *page, int t, int link, Entries &e, int from, int to) const{
+    int n = to - from, p = 0;
+    const char *lo = 0;
+    if (n){
+        lo = &e.keys[from * _idxLen];
+        const char *hi = &e.keys[(to - 1) * _idxLen];
+        int len = keyLen_p(lo);
+        while (p < len && lo[p] == hi[p]) p ++;
+    }
+    int header = (t == TYPE_LEAF ? sizeof(int) * 2 : sizeof(int)) + sizeof(unsigned short);
+    int need = slotsOffset_p(p);
+    for (int i = from; i < to; i ++) need += sizeof(unsigned short) + header + keyLen_p(&e.keys[i * _idxLen]) - p;
+    if (need > _pageLen) return false;
+    type(page) = t;
+    size(page) = n;
+    next(page) = link;
+    prefixLen_p(page) = p;
+    if (n) memcpy(page + HEADER, lo, p);
+    int heap = _pageLen;
+    unsigned short *slots = slots_p(page);
+    for (int i = 0; i < n; i ++){
+        const char *key = &e.keys[(from + i) * _idxLen];
+        unsigned short len = keyLen_p(key) - p;
+        heap -= header + len;
+        char *rec = page + heap;
+        memcpy(rec, &e.first[from + i], sizeof(int));
+        if (t == TYPE_LEAF) memcpy(rec + sizeof(int), &e.second[from + i], sizeof(int));
+        memcpy(rec + header - sizeof(unsigned short), &len, sizeof(unsigned short));
+        memcpy(rec + header, key + p, len);
+        slots[i] = heap;
+    }
+    heap_p(page) = heap;
+    dead_p(page) = 0;
+    return true;
+}
+
+/* Moves the live records to the end of the page in slot order, so that the dead bytes join the free room */
+void CompressedNodeLayout::compact_p(char *page) const{
+    char copy[_pageLen];
+    memcpy(copy, page, _pageLen);
+    int n = size(page), header = recordHeader_p(page), heap = _pageLen, len;
+    unsigned short *slots = slots_p(page);
+    for (int i = 0; i < n; i ++){
+        char *rec = record_p(copy, i, &len);
+        heap -= header + len;
+        memcpy(page + heap, rec, header + len);
+        slots[i] = heap;
+    }
+    heap_p(page) = heap;
+    dead_p(page) = 0;
+}
+
+/* Appends the values of page to e */
+void CompressedNodeLayout::decode_p(char *page, Entries &e) const{
+    int n = size(page), at = e.first.size();
+    bool leaf = (type(page) == TYPE_LEAF);
+    e.keys.resize((at + n) * _idxLen);
+    for (int i = 0; i < n; i ++){
+        int len, first, second = 0;
+        char *rec = record_p(page, i, &len);
+        memcpy(&first, rec, sizeof(int));
+        if (leaf) memcpy(&second, rec + sizeof(int), sizeof(int));
+        readKey(page, i, &e.keys[(at + i) * _idxLen]);
+        e.first.push_back(first);
+        e.second.push_back(second);
+    }
+}
+
+int CompressedNodeLayout::freeSpace_p(char *page) const{
+    return heap_p(page) + dead_p(page) - slotsOffset_p(prefixLen_p(page)) - size(page) * (int)sizeof(unsigned short);
+}
+
+/* Adds a record in place when the key has the prefix of the node and there is room, otherwise builds the node anew with a shorter prefix */
+bool CompressedNodeLayout::insert_p(char *page, int loc, const char *key, int first, int second) const{
+    int n = size(page), p = prefixLen_p(page), len = keyLen_p(key);
+    if (n && len >= p && !memcmp(key, page + HEADER, p)){
+        int header = recordHeader_p(page);
+        unsigned short sLen = len - p;
+        int need = sizeof(unsigned short) + header + sLen;
+        if (freeSpace_p(page) < need) return false;
+        if (freeSpace_p(page) - dead_p(page) < need) compact_p(page);
+        int heap = heap_p(page) - header - sLen;
+        char *rec = page + heap;
+        memcpy(rec, &first, sizeof(int));
+        if (type(page) == TYPE_LEAF) memcpy(rec + sizeof(int), &second, sizeof(int));
+        memcpy(rec + header - sizeof(unsigned short), &sLen, sizeof(unsigned short));
+        memcpy(rec + header, key + p, sLen);
+        unsigned short *slots = slots_p(page);
+        memmove(slots + loc + 1, slots + loc, (n - loc) * sizeof(unsigned short));
+        slots[loc] = heap;
+        heap_p(page) = heap;
+        size(page) = n + 1;
+        return true;
+    }
+    Entries e;
+    decode_p(page, e);
+    add_p(e, loc, key, first, second);
+    char built[_pageLen];
+    if (!build_p(built, type(page), next(page), e, 0, n + 1)) return false;
+    memcpy(page, built, _pageLen);
+    return true;
+}
+
+int CompressedNodeLayout::keyLen_p(const char *key) const{
+    return strnlen(key, _idxLen);
+}
+
+int CompressedNodeLayout::prefix_p(char *page) const{
+    int p = prefixLen_p(page);
+    return p < _idxLen ? p : _idxLen;
+}
+
+/*
+ * Record of value i, with the length of its suffix in len. Offsets and
+ * lengths are kept inside the page, for pages read without a latch may hold
+ * anything.
+ */
+char *CompressedNodeLayout::record_p(char *page, int i, int *len) const{
+    int header = recordHeader_p(page), p = prefix_p(page);
+    int most = (_pageLen - slotsOffset_p(p)) / (int)sizeof(unsigned short);
+    if (i >= most) i = most - 1;
+    if (i < 0) i = 0;
+    int off = ((unsigned short *)(page + slotsOffset_p(p)))[i];
+    if (off > _pageLen - header) off = _pageLen - header;
+    unsigned short l;
+    memcpy(&l, page + off + header - sizeof(unsigned short), sizeof(unsigned short));
+    *len = l;
+    if (*len > _pageLen - off - header) *len = _pageLen - off - header;
+    return page + off;
+}
+
+/* Drops the slot of record i, the record itself is left as dead bytes unless it is the lowest one in the heap */
+void CompressedNodeLayout::remove_p(char *page, int i) const{
+    int n = size(page), len;
+    char *rec = record_p(page, i, &len);
+    int recLen = recordHeader_p(page) + len;
+    unsigned short *slots = slots_p(page);
+    memmove(slots + i, slots + i + 1, (n - i - 1) * sizeof(unsigned short));
+    size(page) = n - 1;
+    if (n == 1){
+        heap_p(page) = _pageLen;
+        dead_p(page) = 0;
+    }  else if (rec - page == heap_p(page)) heap_p(page) += recLen;
+    else dead_p(page) += recLen;
+}
+
+/* The k-th split point to try for count entries: the one that halves their bytes first, then the ones around it */
+int CompressedNodeLayout::splitOrder_p(Entries &e, int count, int k) const{
+    int total = 0, half = 0, mid = 0;
+    for (int i = 0; i < count; i ++) total += keyLen_p(&e.keys[i * _idxLen]);
+    while (mid < count && (half + keyLen_p(&e.keys[mid * _idxLen])) * 2 <= total) half += keyLen_p(&e.keys[mid ++ * _idxLen]);
+    if (mid < 1) mid = 1;
+    return k & 1 ? mid - (k + 1) / 2 : mid + k / 2;
+}
@@ -0,0 +1,88 @@
+#ifndef COMPRESSED_NODE_LAYOUT_H
+#define COMPRESSED_NODE_LAYOUT_H
+
+#include "TypedNodeLayout.h"
+
+#include <vector>
+
+/*
+ * Node format for string keys that stores the prefix shared by all keys of a
+ * node once, and every key only up to its first NUL. Leaves split with the
+ * shortest separator that tells the two halves apart, so non-leaf nodes hold
+ * short keys. Pages are slotted:
+ *     type | size | next or child 0 | prefixLen | heap | dead | prefix | pad | slot[size] | free | records
+ * where slot i is the offset of the record of value i, records grow down
+ * from the end of the page to heap and read
+ *     posPage | posSlot | len | suffix    in leaves,
+ *     child | len | suffix                in non-leaf nodes, child i + 1.
+ * The prefix only shrinks while keys are added, a split or merge works it out
+ * anew for the nodes it builds. A removed record stays in the heap as dead
+ * bytes until an insert needs the room and the page is compacted. Offsets are 16 bits wide, so pages larger
+ * than that only use their first 65535 bytes.
+ */
+class CompressedNodeLayout : public TypedNodeLayout <StringKey>{
+    public:
+        CompressedNodeLayout(int blkSize, int idxLen);
+
+        int minCapacity() const;
+
+        int child(char *page, int i) const;
+        double fill(char *page) const;
+        void init(char *page, int type) const;
+        int posPage(char *page, int i) const;
+        int posSlot(char *page, int i) const;
+        void readKey(char *page, int i, char *key) const;
+        void setChild(char *page, int i, int child) const;
+        void setPosition(char *page, int i, int posPage, int posSlot) const;
+        bool underflow(char *page, int loc, double minFill) const;
+
+        using NodeLayout::search;
+        int search(char *page, int n, const void *data, int *equals = 0) const;
+        void separator(const char *left, const char *right, char *sep) const;
+
+        bool insertLeaf(char *page, int loc, const void *data, int posPage, int posSlot) const;
+        void removeLeaf(char *page, int loc) const;
+        void splitLeaf(char *page, char *newPage, int loc, const void *data, int posPage, int posSlot, char *sep) const;
+        bool mergeLeaf(char *page, char *nextPage) const;
+
+        bool insertNonLeaf(char *page, int loc, const void *data, int child) const;
+        void removeNonLeaf(char *page, int loc) const;
+        void splitNonLeaf(char *page, char *newPage, int loc, const void *data, int child, char *sep) const;
+        bool mergeNonLeaf(char *page, char *nextPage, const void *sep) const;
+
+    private:
+        /* The values of a node as full keys, for the operations that build nodes anew */
+        struct Entries{
+            std::vector <char> keys;
+            /* posPage and posSlot in leaves, the child after the key in non-leaf nodes */
+            std::vector <int> first;
+            std::vector <int> second;
+        };
+
+        static const int HEADER = sizeof(int) * 3 + sizeof(unsigned short) * 3;
+
+        /* Bytes of the page in use */
+        int _pageLen;
+
+        static unsigned short &prefixLen_p(char *page){ return *(unsigned short *)(page + sizeof(int) * 3); }
+        static unsigned short &heap_p(char *page){ return *(unsigned short *)(page + sizeof(int) * 3 + sizeof(unsigned short)); }
+        static unsigned short &dead_p(char *page){ return *(unsigned short *)(page + sizeof(int) * 3 + sizeof(unsigned short) * 2); }
+        /* Slots start at an even offset after the prefix */
+        static int slotsOffset_p(int prefixLen){ return HEADER + ((prefixLen + 1) & ~1); }
+        static unsigned short *slots_p(char *page){ return (unsigned short *)(page + slotsOffset_p(prefixLen_p(page))); }
+        static int recordHeader_p(char *page){ return type(page) == TYPE_LEAF ? sizeof(int) * 2 + sizeof(unsigned short) : sizeof(int) + sizeof(unsigned short); }
+
+        void add_p(Entries &e, int at, const char *key, int first, int second) const;
+        bool build_p(char *page, int type, int link, Entries &e, int from, int to) const;
+        void compact_p(char *page) const;
+        void decode_p(char *page, Entries &e) const;
+        int freeSpace_p(char *page) const;
+        bool insert_p(char *page, int loc, const char *key, int first, int second) const;
+        int keyLen_p(const char *key) const;
+        int prefix_p(char *page) const;
+        char *record_p(char *page, int i, int *len) const;
+        void remove_p(char *page, int i) const;
+        int splitOrder_p(Entries &e, int count, int k) const;
+};
+
+#endif
@@ -1,11 +1,16 @@
 #include "FileManager.h"
 
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <vector>
 
 FileManagerException::FileManagerException(int errNo) : exception(), _errNo(errNo){
 }
@@ -13,6 +18,10 @@ FileManagerException::FileManagerException(int errNo) : exception(), _errNo(errN
 FileManagerException::FileManagerException(const FileManagerException &e) : _errNo(e._errNo){
 }
 
+int FileManagerException::errNo() const throw(){
+    return _errNo;
+}
+
 const char *FileManagerException::msg() const throw(){
     switch (_errNo){
         case ERR_FILE_NOT_OPEN :
@@ -21,16 +30,42 @@ const char *FileManagerException::msg() const throw(){
             return "invalid file";
         case ERR_INVALID_FILE_NAME :
             return "invalid file name";
+        case ERR_SHORT_READ :
+            return "block past the end of file or unreadable";
+        case ERR_WRITE_FAILED :
+            return "write or sync failed";
         default :
             return "unknown error";
     }
 }
 
 FileManager::FileManager() : _fd(0){
+    pthread_mutex_init(&_appendLock, 0);
 }
 
 FileManager::~FileManager(){
     closeFile();
+    pthread_mutex_destroy(&_appendLock);
+}
+
+/* Access pattern hint for the given byte range, length 0 meaning up to the end of file */
+void FileManager::advise(int advice, long position, long length){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    int a = POSIX_FADV_NORMAL;
+    if (advice == ADVISE_RANDOM) a = POSIX_FADV_RANDOM;
+    else if (advice == ADVISE_SEQUENTIAL) a = POSIX_FADV_SEQUENTIAL;
+    else if (advice == ADVISE_WILLNEED) a = POSIX_FADV_WILLNEED;
+    posix_fadvise(_fd, position, length, a);
+}
+
+/* True if submit() returns before the requests are done, so that many of them can be in flight */
+bool FileManager::asynchronous() const{
+    return false;
+}
+
+/* Blocks are not addressable in memory unless the file is mapped */
+char *FileManager::blockPointer(long){
+    return 0;
 }
 
 void FileManager::closeFile(){
@@ -55,45 +90,43 @@ void FileManager::createFile(const char *fileName, int blockSize){
     memset(block, 0, blockSize);
     memcpy(block, FILE_HEADER, FILE_HEADER_LEN); 
     memcpy(block + FILE_HEADER_LEN, &blockSize, sizeof(int));
-    writeBlock(0, block);
+    FileManager::writeBlock(0, block);
+}
+
+long FileManager::fileSize(){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    struct stat st;
+    fstat(_fd, &st);
+    return st.st_size;
 }
 
 bool FileManager::isOpen() const{
     return (_fd != 0);
 }
 
-char *FileManager::readBlock(int position){
+void FileManager::readBlock(long position, char *data){
     if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
-    char *ret = new char[_blockSize + 1];
-    lseek(_fd, position, SEEK_SET);
-    read(_fd, ret, _blockSize);
-    ret[_blockSize] = 0;
-    return ret;
+    if (read_p(data, _blockSize, position) < _blockSize) throw FileManagerException(FileManagerException::ERR_SHORT_READ);
 }
 
-int FileManager::readInt(int position){
+int FileManager::readInt(long position){
     if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
     int ret;
-    lseek(_fd, position, SEEK_SET);
-    read(_fd, &ret, sizeof(int));
+    read_p(&ret, sizeof(int), position);
     return ret;
 }
 
-long FileManager::readLong(int position){
+long FileManager::readLong(long position){
     if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
     long ret;
-    lseek(_fd, position, SEEK_SET);
-    read(_fd, &ret, sizeof(long));
+    read_p(&ret, sizeof(long), position);
     return ret;
 }
 
-char *FileManager::readString(int position, int length){
+void FileManager::readString(long position, int length, char *data){
     if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
-    char *ret = new char[length + 1];
-    lseek(_fd, position, SEEK_SET);
-    read(_fd, ret, length);
-    ret[length] = 0;
-    return ret;
+    read_p(data, length, position);
+    data[length] = 0;
 }
 
 void FileManager::openFile(const char *fileName){
@@ -103,28 +136,120 @@ void FileManager::openFile(const char *fileName){
         throw FileManagerException(FileManagerException::ERR_INVALID_FILE_NAME);
         _fd = 0;
     }
-    char *s = readString(0, FILE_HEADER_LEN);
-    if (!s){
-        delete[] s;
-        throw FileManagerException(FileManagerException::ERR_INVALID_FILE);
-    }  else if (strcmp(s, FILE_HEADER)){
-        delete[] s;
-        throw FileManagerException(FileManagerException::ERR_INVALID_FILE);
+    char s[sizeof(FILE_HEADER)];
+    FileManager::readString(0, FILE_HEADER_LEN, s);
+    if (strcmp(s, FILE_HEADER)) throw FileManagerException(FileManagerException::ERR_INVALID_FILE);
+    _blockSize = FileManager::readInt(FILE_HEADER_LEN);
+}
+
+/* Starts block reads and writes, see wait(). Here they are simply done one after the other */
+void FileManager::submit(FileRequest *requests, int count){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    for (int i = 0; i < count; i ++){
+        FileRequest &r = requests[i];
+        if (r.type == REQUEST_READ) r.result = read_p(r.data, _blockSize, r.position);
+        else {
+            writeBlock(r.position, r.data);
+            r.result = _blockSize;
+        }
+        r.done = true;
     }
-    delete[] s;
-    _blockSize = readInt(FILE_HEADER_LEN);
 }
 
-int FileManager::writeBlock(int position, const char *data){
+void FileManager::sync(){
     if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
-    int ret = lseek(_fd, position, SEEK_SET);
-    write(_fd, data, _blockSize);
-    return ret;
+    if (fsync(_fd)) throw FileManagerException(FileManagerException::ERR_WRITE_FAILED);
 }
 
-int FileManager::writeNewBlock(const char *data){
+/* Cuts the file to length bytes, no block past it may be read or written meanwhile */
+void FileManager::truncate(long length){
     if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
-    int ret = lseek(_fd, 0, SEEK_END);
-    write(_fd, data, _blockSize);
+    pthread_mutex_lock(&_appendLock);
+    ftruncate(_fd, length);
+    pthread_mutex_unlock(&_appendLock);
+}
+
+/* Returns once every submitted request is done */
+void FileManager::wait(FileRequest *, int){
+}
+
+long FileManager::writeBlock(long position, const char *data){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    struct iovec iov = {(void *)data, (size_t)_blockSize};
+    write_p(&iov, 1, position);
+    return position;
+}
+
+/*
+ * Writes a group of blocks with as few system calls as possible: they are
+ * sorted by position, a block given more than once is only written with its
+ * last data, and every run of adjacent blocks goes out in one pwritev.
+ */
+void FileManager::writeBlocks(const long *positions, const char * const *data, int count){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    /* Equal positions stay in call order, so the last one of each is the one to keep */
+    std::vector <std::pair <long, int> > blocks(count);
+    for (int i = 0; i < count; i ++) blocks[i] = std::make_pair(positions[i], i);
+    std::sort(blocks.begin(), blocks.end());
+    struct iovec iov[IOV_MAX];
+    for (int i = 0; i < count; ){
+        long start = blocks[i].first;
+        int n = 0;
+        while (i < count && n < IOV_MAX){
+            while (i + 1 < count && blocks[i + 1].first == blocks[i].first) i ++;
+            if (blocks[i].first != start + (long)n * _blockSize) break;
+            iov[n].iov_base = (void *)data[blocks[i].second];
+            iov[n].iov_len = _blockSize;
+            n ++;
+            i ++;
+        }
+        write_p(iov, n, start);
+    }
+}
+
+long FileManager::writeNewBlock(const char *data){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    pthread_mutex_lock(&_appendLock);
+    long ret = lseek(_fd, 0, SEEK_END);
+    struct iovec iov = {(void *)data, (size_t)_blockSize};
+    try {
+        write_p(&iov, 1, ret);
+    }  catch (...){
+        pthread_mutex_unlock(&_appendLock);
+        throw;
+    }
+    pthread_mutex_unlock(&_appendLock);
     return ret;
 }
+
+/* Positional read resumed after short reads, whatever lies past the end of file reads as zeros; returns the bytes the file had */
+long FileManager::read_p(void *data, int length, long position){
+    long done = 0;
+    while (done < length){
+        long n = pread(_fd, (char *)data + done, length - done, position + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done < length) memset((char *)data + done, 0, length - done);
+    return done;
+}
+
+/* Vectored positional write, resumed after short writes; ERR_WRITE_FAILED if the file takes no more */
+void FileManager::write_p(struct iovec *iov, int count, long position){
+    while (count){
+        long n = pwritev(_fd, iov, count, position);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw FileManagerException(FileManagerException::ERR_WRITE_FAILED);
+        position += n;
+        while (count && n >= (long)iov -> iov_len){
+            n -= iov -> iov_len;
+            iov ++;
+            count --;
+        }
+        if (count){
+            iov -> iov_base = (char *)iov -> iov_base + n;
+            iov -> iov_len -= n;
+        }
+    }
+}
@@ -2,20 +2,35 @@
 #define FILE_MANAGER_H
 
 #include <exception>
+#include <pthread.h>
 
 #define FILE_HEADER "DB_FILE_CREATED_BY_SUNZHENG"
 #define FILE_HEADER_LEN strlen(FILE_HEADER)
 
+struct iovec;
+
+/* A block read or write handed to FileManager::submit(), done once wait() has returned */
+struct FileRequest{
+    int type;
+    long position;
+    char *data;
+    long result;
+    bool done;
+};
+
 class FileManagerException : public std::exception{
     public:
         FileManagerException(int errNo);
         FileManagerException(const FileManagerException &e);
 
+        int errNo() const throw();
         const char *msg() const throw();
         
         static const int ERR_FILE_NOT_OPEN = 0;
         static const int ERR_INVALID_FILE = 1;
         static const int ERR_INVALID_FILE_NAME = 2;
+        static const int ERR_SHORT_READ = 3;
+        static const int ERR_WRITE_FAILED = 4;
 
     private:
         int _errNo;
@@ -24,24 +39,48 @@ class FileManagerException : public std::exception{
 class FileManager{
     public:
         FileManager();
-        ~FileManager();
+        virtual ~FileManager();
        
+        virtual void advise(int advice, long position = 0, long length = 0);
+        virtual bool asynchronous() const;
+        virtual char *blockPointer(long position);
         int blockSize() const;
-        void closeFile();
-        void createFile(const char *fileName, int blockSize); 
+        virtual void closeFile();
+        virtual void createFile(const char *fileName, int blockSize); 
+        virtual long fileSize();
         bool isOpen() const;
-        void openFile(const char *fileName);
-        char *readBlock(int position);
-        int readInt(int position);
-        long readLong(int position);
-        char *readString(int position, int length);
-        int writeBlock(int position, const char *data);
-        int writeNewBlock(const char *data);
+        virtual void openFile(const char *fileName);
+        /* Reads one block into data, which must hold blockSize() bytes; ERR_SHORT_READ if the file does not hold all of it */
+        virtual void readBlock(long position, char *data);
+        virtual int readInt(long position);
+        virtual long readLong(long position);
+        /* Reads length bytes into data and ends them with a NUL, data must hold length + 1 bytes */
+        virtual void readString(long position, int length, char *data);
+        virtual void submit(FileRequest *requests, int count);
+        virtual void sync();
+        virtual void truncate(long length);
+        virtual void wait(FileRequest *requests, int count);
+        virtual long writeBlock(long position, const char *data);
+        virtual void writeBlocks(const long *positions, const char * const *data, int count);
+        virtual long writeNewBlock(const char *data);
 
-    private:
+        static const int ADVISE_NORMAL = 0;
+        static const int ADVISE_RANDOM = 1;
+        static const int ADVISE_SEQUENTIAL = 2;
+        static const int ADVISE_WILLNEED = 3;
+
+        static const int REQUEST_READ = 0;
+        static const int REQUEST_WRITE = 1;
+
+    protected:
+        /* Serializes appends, the other calls use positional I/O and can run concurrently */
+        pthread_mutex_t _appendLock;
         int _fd;
         int _blockSize;
         char *_fileName;
+
+        long read_p(void *data, int length, long position);
+        void write_p(struct iovec *iov, int count, long position);
 };
 
 #endif
@@ -0,0 +1,153 @@
+#ifndef INDEX_KEY_H
+#define INDEX_KEY_H
+
+#include "NodeSearch.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Key types a TypedNodeLayout can be specialized on. A key type knows how
+ * many bytes a key takes in a page, compares two stored keys, negative if a
+ * comes before b in the index, and searches the sorted keys of a node. Keys
+ * without a search kernel of NodeSearch use binarySearch(), which is inline,
+ * so node search compiles down to plain loads and compares for each type.
+ *
+ * Keys are read with memcpy, for values of a page are not aligned to their
+ * own size.
+ */
+
+/* Number of the n keys at arr not after x in the index */
+template <class Key>
+inline int binarySearch(const Key &key, const char *arr, int n, const char *x){
+    int len = key.length();
+    int l = 0, r = n;
+    while (l < r){
+        int mid = (l + r) >> 1;
+        if (key.compare(arr + mid * len, x) <= 0) l = mid + 1;
+        else r = mid;
+    }
+    return l;
+}
+
+/* Signed or unsigned integers in ascending order, NodeSearch has kernels for int32_t, int64_t and uint64_t */
+template <class T>
+struct NumberKey{
+    typedef T Type;
+
+    int length() const{ return sizeof(T); }
+
+    static T load(const char *a){
+        T x;
+        memcpy(&x, a, sizeof(T));
+        return x;
+    }
+
+    int compare(const char *a, const char *b) const{
+        T x = load(a), y = load(b);
+        return (x > y) - (x < y);
+    }
+
+    void copy(char *to, const void *from) const{
+        memcpy(to, from, sizeof(T));
+    }
+
+    int search(const char *arr, int n, const char *x) const{
+        return NodeSearch::upperBound(arr, n, load(x));
+    }
+
+    void print(const char *a) const{
+        if ((T)-1 < (T)0) printf("%lld", (long long)load(a));
+        else printf("%llu", (unsigned long long)load(a));
+    }
+};
+
+typedef NumberKey <int32_t> Int32Key;
+typedef NumberKey <int64_t> Int64Key;
+typedef NumberKey <uint64_t> UInt64Key;
+
+/* NUL padded strings, kept in descending strncmp order as the tree always did */
+struct StringKey{
+    StringKey(int len = 0) : _len(len){}
+
+    int length() const{ return _len; }
+
+    int compare(const char *a, const char *b) const{
+        return NodeSearch::compareString(b, a, _len);
+    }
+
+    /* The caller's string may be shorter than the key */
+    void copy(char *to, const void *from) const{
+        strncpy(to, (const char *)from, _len);
+    }
+
+    int search(const char *arr, int n, const char *x) const{
+        return binarySearch(*this, arr, n, x);
+    }
+
+    void print(const char *a) const{
+        for (int i = 0; i < _len; i ++) putchar(a[i]);
+    }
+
+    int _len;
+};
+
+/* Fixed width byte strings in ascending memcmp order */
+struct BytesKey{
+    BytesKey(int len = 0) : _len(len){}
+
+    int length() const{ return _len; }
+
+    int compare(const char *a, const char *b) const{
+        return memcmp(a, b, _len);
+    }
+
+    void copy(char *to, const void *from) const{
+        memcpy(to, from, _len);
+    }
+
+    int search(const char *arr, int n, const char *x) const{
+        return binarySearch(*this, arr, n, x);
+    }
+
+    void print(const char *a) const{
+        for (int i = 0; i < _len; i ++) printf("%02x", (unsigned char)a[i]);
+    }
+
+    int _len;
+};
+
+/* First then Second, stored one after the other */
+template <class First, class Second>
+struct CompositeKey{
+    CompositeKey(const First &first = First(), const Second &second = Second()) : _first(first), _second(second){}
+
+    int length() const{ return _first.length() + _second.length(); }
+
+    int compare(const char *a, const char *b) const{
+        int c = _first.compare(a, b);
+        if (c) return c;
+        return _second.compare(a + _first.length(), b + _first.length());
+    }
+
+    void copy(char *to, const void *from) const{
+        _first.copy(to, from);
+        _second.copy(to + _first.length(), (const char *)from + _first.length());
+    }
+
+    int search(const char *arr, int n, const char *x) const{
+        return binarySearch(*this, arr, n, x);
+    }
+
+    void print(const char *a) const{
+        _first.print(a);
+        putchar(':');
+        _second.print(a + _first.length());
+    }
+
+    First _first;
+    Second _second;
+};
+
+#endif
@@ -0,0 +1,206 @@
+#include "MappedFileManager.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+MappedFileManager::MappedFileManager() : FileManager(), _extents(0), _extentCount(0){
+    pthread_mutex_init(&_growLock, 0);
+}
+
+MappedFileManager::~MappedFileManager(){
+    closeFile();
+    pthread_mutex_destroy(&_growLock);
+}
+
+void MappedFileManager::advise(int advice, long position, long length){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    int a = MADV_NORMAL;
+    if (advice == ADVISE_RANDOM) a = MADV_RANDOM;
+    else if (advice == ADVISE_SEQUENTIAL) a = MADV_SEQUENTIAL;
+    else if (advice == ADVISE_WILLNEED) a = MADV_WILLNEED;
+    long end = length ? position + length : _fileSize;
+    for (long p = position - position % _extentSize; p < end && p < _fileSize; p += _extentSize){
+        long from = p < position ? position : p, to = p + _extentSize < end ? p + _extentSize : end;
+        /* madvise needs a page aligned start */
+        long start = from - from % sysconf(_SC_PAGESIZE);
+        madvise(_extents[p / _extentSize] + (start - p), to - start, a);
+    }
+}
+
+char *MappedFileManager::blockPointer(long position){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    if (position + _blockSize > __atomic_load_n(&_fileSize, __ATOMIC_ACQUIRE)) return 0;
+    return address_p(position, _blockSize);
+}
+
+void MappedFileManager::closeFile(){
+    if (!_fd) return;
+    unmap_p();
+    /* Give back the space reserved for the rest of the last extent */
+    ftruncate(_fd, _fileSize);
+    FileManager::closeFile();
+}
+
+void MappedFileManager::createFile(const char *fileName, int blockSize){
+    if (_fd) closeFile();
+    FileManager::createFile(fileName, blockSize);
+    map_p();
+}
+
+long MappedFileManager::fileSize(){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    return __atomic_load_n(&_fileSize, __ATOMIC_ACQUIRE);
+}
+
+void MappedFileManager::openFile(const char *fileName){
+    if (_fd) closeFile();
+    FileManager::openFile(fileName);
+    map_p();
+}
+
+void MappedFileManager::readBlock(long position, char *data){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    if (position + _blockSize > fileSize()) throw FileManagerException(FileManagerException::ERR_SHORT_READ);
+    memcpy(data, address_p(position, _blockSize), _blockSize);
+}
+
+int MappedFileManager::readInt(long position){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    int ret;
+    copy_p(&ret, position, sizeof(int));
+    return ret;
+}
+
+long MappedFileManager::readLong(long position){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    long ret;
+    copy_p(&ret, position, sizeof(long));
+    return ret;
+}
+
+void MappedFileManager::readString(long position, int length, char *data){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    copy_p(data, position, length);
+    data[length] = 0;
+}
+
+void MappedFileManager::sync(){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    long size = fileSize();
+    for (int i = 0; i < _extentCount && (long)i * _extentSize < size; i ++){
+        long length = size - (long)i * _extentSize < _extentSize ? size - (long)i * _extentSize : _extentSize;
+        if (msync(_extents[i], length, MS_SYNC)) throw FileManagerException(FileManagerException::ERR_WRITE_FAILED);
+    }
+}
+
+/* Extents are never unmapped, the pages past the new end are just never touched again until the file grows back over them */
+void MappedFileManager::truncate(long length){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    pthread_mutex_lock(&_appendLock);
+    if (length < _fileSize){
+        ftruncate(_fd, length);
+        __atomic_store_n(&_fileSize, length, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_appendLock);
+}
+
+long MappedFileManager::writeBlock(long position, const char *data){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    char *p = address_p(position, _blockSize);
+    if (position + _blockSize <= __atomic_load_n(&_fileSize, __ATOMIC_ACQUIRE)){
+        memcpy(p, data, _blockSize);
+        return position;
+    }
+    /* Mapped pages past the end of file cannot be touched, the file grows first */
+    pthread_mutex_lock(&_appendLock);
+    if (position + _blockSize > _fileSize && ftruncate(_fd, position + _blockSize)){
+        pthread_mutex_unlock(&_appendLock);
+        throw FileManagerException(FileManagerException::ERR_WRITE_FAILED);
+    }
+    memcpy(p, data, _blockSize);
+    if (position + _blockSize > _fileSize) __atomic_store_n(&_fileSize, position + _blockSize, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_appendLock);
+    return position;
+}
+
+/* Copies into the mapping in call order, so the last data given for a block wins; there is no system call to save */
+void MappedFileManager::writeBlocks(const long *positions, const char * const *data, int count){
+    for (int i = 0; i < count; i ++) writeBlock(positions[i], data[i]);
+}
+
+long MappedFileManager::writeNewBlock(const char *data){
+    if (!_fd) throw FileManagerException(FileManagerException::ERR_FILE_NOT_OPEN);
+    pthread_mutex_lock(&_appendLock);
+    long ret = _fileSize;
+    char *p;
+    try {
+        p = address_p(ret, _blockSize);
+    }  catch (...){
+        pthread_mutex_unlock(&_appendLock);
+        throw;
+    }
+    if (ftruncate(_fd, ret + _blockSize)){
+        pthread_mutex_unlock(&_appendLock);
+        throw FileManagerException(FileManagerException::ERR_WRITE_FAILED);
+    }
+    memcpy(p, data, _blockSize);
+    __atomic_store_n(&_fileSize, ret + _blockSize, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_appendLock);
+    return ret;
+}
+
+/* Returns the mapped address of a byte range, mapping whole extents when it ends past the mapping; the file itself is not grown */
+char *MappedFileManager::address_p(long position, long length){
+    if (position + length > __atomic_load_n(&_extentCount, __ATOMIC_ACQUIRE) * _extentSize){
+        pthread_mutex_lock(&_growLock);
+        while (position + length > _extentCount * _extentSize){
+            if (_extentCount == MAX_EXTENTS){
+                pthread_mutex_unlock(&_growLock);
+                throw FileManagerException(FileManagerException::ERR_INVALID_FILE);
+            }
+            /* Only a reservation, the file systems that cannot make it still work */
+            fallocate(_fd, FALLOC_FL_KEEP_SIZE, _extentCount * _extentSize, _extentSize);
+            void *p = mmap(0, _extentSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _extentCount * _extentSize);
+            if (p == MAP_FAILED){
+                pthread_mutex_unlock(&_growLock);
+                throw FileManagerException(FileManagerException::ERR_INVALID_FILE);
+            }
+            _extents[_extentCount] = (char *)p;
+            __atomic_store_n(&_extentCount, _extentCount + 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&_growLock);
+    }
+    return _extents[position / _extentSize] + position % _extentSize;
+}
+
+/* Copies a byte range out of the mapping; what lies past the end of file reads as zeros, as it does with read() */
+void MappedFileManager::copy_p(void *data, long position, long length){
+    long size = fileSize(), n = size - position < length ? size - position : length;
+    if (n < 0) n = 0;
+    if (n) memcpy(data, address_p(position, n), n);
+    memset((char *)data + n, 0, length - n);
+}
+
+void MappedFileManager::map_p(){
+    /* Extents hold whole blocks and start on page boundaries */
+    long page = sysconf(_SC_PAGESIZE), unit = page;
+    while (unit % _blockSize) unit += page;
+    _extentSize = unit * (EXTENT_SIZE / unit > 0 ? EXTENT_SIZE / unit : 1);
+    struct stat st;
+    fstat(_fd, &st);
+    _fileSize = st.st_size;
+    _extents = new char *[MAX_EXTENTS];
+    _extentCount = 0;
+    if (_fileSize) address_p(0, _fileSize);
+}
+
+void MappedFileManager::unmap_p(){
+    for (int i = 0; i < _extentCount; i ++) munmap(_extents[i], _extentSize);
+    delete []_extents;
+    _extents = 0;
+    _extentCount = 0;
+}
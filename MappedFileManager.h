@@ -0,0 +1,50 @@
+#ifndef MAPPED_FILE_MANAGER_H
+#define MAPPED_FILE_MANAGER_H
+
+#include "FileManager.h"
+
+/*
+ * FileManager backend that maps the file into memory in fixed-size extents.
+ * The mapping grows one extent at a time, with its disk space reserved, but
+ * the file only grows by the blocks written, so its size stays right even if
+ * the process ends without closing it. Extents are never remapped, so
+ * pointers returned by blockPointer() stay valid until the file is closed.
+ */
+class MappedFileManager : public FileManager{
+    public:
+        MappedFileManager();
+        ~MappedFileManager();
+
+        void advise(int advice, long position = 0, long length = 0);
+        char *blockPointer(long position);
+        void closeFile();
+        void createFile(const char *fileName, int blockSize);
+        long fileSize();
+        void openFile(const char *fileName);
+        void readBlock(long position, char *data);
+        int readInt(long position);
+        long readLong(long position);
+        void readString(long position, int length, char *data);
+        void sync();
+        void truncate(long length);
+        long writeBlock(long position, const char *data);
+        void writeBlocks(const long *positions, const char * const *data, int count);
+        long writeNewBlock(const char *data);
+
+        static const int EXTENT_SIZE = 64 << 20;
+        static const int MAX_EXTENTS = 4096;
+
+    private:
+        pthread_mutex_t _growLock;
+        char **_extents;
+        int _extentCount;
+        long _extentSize;
+        long _fileSize;
+
+        char *address_p(long position, long length);
+        void copy_p(void *data, long position, long length);
+        void map_p();
+        void unmap_p();
+};
+
+#endif
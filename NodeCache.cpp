@@ -0,0 +1,161 @@
+#include "NodeCache.h"
+#include "NodeLayout.h"
+
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+NodeCache::NodeCache(const NodeLayout *layout) : _layout(layout), _slots(0), _root(-1), _full(false), _areaNext(0), _areaLeft(0), _areaBytes(0){
+    _idxLen = layout -> keyLength();
+    _capacity = layout -> nonLeafCapacity();
+    for (_classes = 1; (MIN_ROOM << (_classes - 1)) < _capacity; _classes ++);
+    _freeBlocks.resize(_classes);
+    memset(_chunks, 0, sizeof(_chunks));
+}
+
+NodeCache::~NodeCache(){
+    for (int i = 0; i < MAX_CHUNKS && _chunks[i]; i ++) free(_chunks[i]);
+    for (int i = 0; i < (int)_areas.size(); i ++) free(_areas[i]);
+}
+
+int NodeCache::add(int position){
+    std::map <int, int>::iterator it = _slotOf.find(position);
+    if (it != _slotOf.end()) return it -> second;
+    int slot;
+    if (_freeSlots.size()){
+        slot = _freeSlots.back();
+        _freeSlots.pop_back();
+    }  else {
+        if (_slots % CHUNK_SLOTS == 0){
+            if (_slots == MAX_CHUNKS * CHUNK_SLOTS){
+                _full = true;
+                __atomic_store_n(&_root, -1, __ATOMIC_RELEASE);
+                return -1;
+            }
+            void *p = calloc(CHUNK_SLOTS, sizeof(char *));
+            if (!p) throw std::bad_alloc();
+            _chunks[_slots / CHUNK_SLOTS] = (char **)p;
+        }
+        slot = _slots;
+        __atomic_store_n(&_slots, _slots + 1, __ATOMIC_RELEASE);
+    }
+    _slotOf[position] = slot;
+    return slot;
+}
+
+long NodeCache::bytes() const{
+    return _areaBytes + (long)(_slots + CHUNK_SLOTS - 1) / CHUNK_SLOTS * CHUNK_SLOTS * sizeof(char *);
+}
+
+/* Blocks stay allocated, their slots are all free again */
+void NodeCache::clear(){
+    __atomic_store_n(&_root, -1, __ATOMIC_RELEASE);
+    _full = false;
+    _slotOf.clear();
+    _freeSlots.clear();
+    for (int i = _slots - 1; i >= 0; i --){
+        detach_p(i);
+        _freeSlots.push_back(i);
+    }
+}
+
+int NodeCache::leaf(const void *data) const{
+    int slot = __atomic_load_n(&_root, __ATOMIC_ACQUIRE), slots = __atomic_load_n(&_slots, __ATOMIC_ACQUIRE);
+    for (int depth = 0; slot >= 0 && slot < slots && depth < MAX_HEIGHT; depth ++){
+        char *node = block_p(slot);
+        if (!node) return 0;
+        /* Size is read once, the block may change under us */
+        int size = __atomic_load_n((int *)node + 1, __ATOMIC_RELAXED);
+        if (size < 0 || size > room_p(node)) return 0;
+        int *child = children_p(node) + _layout -> searchKeys(node + HEADER, size, data) * 2;
+        if (child[1] < 0) return child[0] > 0 ? child[0] : 0;
+        slot = child[1];
+    }
+    return 0;
+}
+
+void NodeCache::remove(int position){
+    std::map <int, int>::iterator it = _slotOf.find(position);
+    if (it == _slotOf.end()) return;
+    detach_p(it -> second);
+    _freeSlots.push_back(it -> second);
+    _slotOf.erase(it);
+}
+
+void NodeCache::setRoot(int position){
+    std::map <int, int>::iterator it = _slotOf.find(position);
+    __atomic_store_n(&_root, _full || it == _slotOf.end() ? -1 : it -> second, __ATOMIC_RELEASE);
+}
+
+void NodeCache::update(int position, char *page){
+    int slot = add(position);
+    if (slot < 0) return;
+    int cls = class_p(NodeLayout::size(page));
+    char *node = _chunks[slot / CHUNK_SLOTS][slot % CHUNK_SLOTS];
+    if (node && (room_p(node) < NodeLayout::size(page) || class_p(room_p(node)) > cls + 1)){
+        detach_p(slot);
+        node = 0;
+    }
+    if (node){
+        fill_p(node, page);
+        return;
+    }
+    /* A block is filled before readers can reach it */
+    node = alloc_p(cls);
+    fill_p(node, page);
+    __atomic_store_n(&_chunks[slot / CHUNK_SLOTS][slot % CHUNK_SLOTS], node, __ATOMIC_RELEASE);
+}
+
+/* A free block of class cls, else a new one cut from the last area */
+char *NodeCache::alloc_p(int cls){
+    if (_freeBlocks[cls].size()){
+        char *node = _freeBlocks[cls].back();
+        _freeBlocks[cls].pop_back();
+        return node;
+    }
+    int room = MIN_ROOM << cls < _capacity ? MIN_ROOM << cls : _capacity;
+    long size = blockSize_p(room);
+    if (size > _areaLeft){
+        long bytes = _areaBytes;
+        if (bytes < MIN_AREA) bytes = MIN_AREA;
+        if (bytes > MAX_AREA) bytes = MAX_AREA;
+        if (bytes < size) bytes = size;
+        void *p;
+        if (posix_memalign(&p, 64, bytes)) throw std::bad_alloc();
+        _areas.push_back((char *)p);
+        _areaNext = (char *)p;
+        _areaLeft = bytes;
+        _areaBytes += bytes;
+    }
+    char *node = _areaNext;
+    _areaNext += size;
+    _areaLeft -= size;
+    ((int *)node)[0] = room;
+    ((int *)node)[1] = 0;
+    return node;
+}
+
+int NodeCache::class_p(int keys) const{
+    int cls = 0;
+    while (cls + 1 < _classes && (MIN_ROOM << cls) < keys) cls ++;
+    return cls;
+}
+
+void NodeCache::detach_p(int slot){
+    char *node = _chunks[slot / CHUNK_SLOTS][slot % CHUNK_SLOTS];
+    if (!node) return;
+    __atomic_store_n(&_chunks[slot / CHUNK_SLOTS][slot % CHUNK_SLOTS], (char *)0, __ATOMIC_RELEASE);
+    _freeBlocks[class_p(room_p(node))].push_back(node);
+}
+
+void NodeCache::fill_p(char *node, char *page) const{
+    int size = NodeLayout::size(page);
+    int *child = children_p(node);
+    for (int i = 0; i < size; i ++) _layout -> readKey(page, i, node + HEADER + (long)i * _idxLen);
+    for (int i = 0; i <= size; i ++){
+        std::map <int, int>::const_iterator it = _slotOf.find(_layout -> child(page, i));
+        child[i * 2] = _layout -> child(page, i);
+        child[i * 2 + 1] = it == _slotOf.end() ? -1 : it -> second;
+    }
+    __atomic_store_n((int *)node + 1, size, __ATOMIC_RELAXED);
+}
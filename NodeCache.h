@@ -0,0 +1,93 @@
+#ifndef NODE_CACHE_H
+#define NODE_CACHE_H
+
+#include <map>
+#include <vector>
+
+class NodeLayout;
+
+/*
+ * Copies of the non-leaf nodes of a tree, kept in memory so that finding the
+ * leaf a key belongs in reads no page. A node takes a block sized for the
+ * keys it holds, whatever the layout of its page: room for MIN_ROOM keys
+ * times a power of two, up to the capacity of the layout, its size, its keys
+ * one after the other at full length, then for every child its position and
+ * its slot, -1 for a leaf. A node outgrowing its block, or left using a
+ * quarter of it, moves to a block of its size; blocks no node uses go to the
+ * next node of that size. Blocks are cut from areas that grow with the
+ * cache, each as large as all before it, and are only given back when the
+ * cache is deleted.
+ *
+ * leaf() may run while a writer changes the cache, as optimistic readers of
+ * the tree do: it then finds a wrong leaf, but never reads outside the block
+ * of a slot, whose room never changes, and the caller finds out when it
+ * validates what it read. Everything else is for one writer at a time.
+ */
+class NodeCache{
+    public:
+        NodeCache(const NodeLayout *layout);
+        ~NodeCache();
+
+        /* Gives position a slot if it has none, for update() to fill; -1 once the cache is full */
+        int add(int position);
+        /* Bytes of the areas and chunks allocated */
+        long bytes() const;
+        void clear();
+        /* Position of the leaf data belongs in, 0 while no root is cached */
+        int leaf(const void *data) const;
+        void remove(int position);
+        /* 0 for a root that is a leaf */
+        void setRoot(int position);
+        /* Copies the non-leaf node at position; the children that have slots are taken for non-leaf nodes */
+        void update(int position, char *page);
+
+        /* Slots are looked up through chunks of CHUNK_SLOTS blocks */
+        static const int CHUNK_SLOTS = 256;
+        /* Nodes beyond MAX_CHUNKS * CHUNK_SLOTS leave the cache off until clear() */
+        static const int MAX_CHUNKS = 4096;
+
+    private:
+        /* Room, size, then the keys from offset HEADER on */
+        static const int HEADER = sizeof(int) * 2;
+        /* A deeper path is a cycle made up of a torn read */
+        static const int MAX_HEIGHT = 64;
+        static const int MIN_ROOM = 4;
+        /* Bytes of the first area, the others take as many as all before up to MAX_AREA */
+        static const long MIN_AREA = 4096;
+        static const long MAX_AREA = 1 << 20;
+
+        const NodeLayout *_layout;
+        int _idxLen;
+        int _capacity;
+        /* Blocks of class c have room for MIN_ROOM << c keys, _capacity at most */
+        int _classes;
+        /* Block of every slot, 0 for none */
+        char **_chunks[MAX_CHUNKS];
+        /* Slots handed out so far, all in allocated chunks */
+        int _slots;
+        int _root;
+        bool _full;
+        std::vector <int> _freeSlots;
+        std::map <int, int> _slotOf;
+        /* Blocks of each class no slot has */
+        std::vector <std::vector <char *> > _freeBlocks;
+        std::vector <char *> _areas;
+        char *_areaNext;
+        long _areaLeft;
+        /* Bytes of all areas */
+        long _areaBytes;
+
+        char *alloc_p(int cls);
+        char *block_p(int slot) const{ return __atomic_load_n(&_chunks[slot / CHUNK_SLOTS][slot % CHUNK_SLOTS], __ATOMIC_ACQUIRE); }
+        long blockSize_p(int room) const{ return (childOffset_p(room) + (long)(room + 1) * sizeof(int) * 2 + 63) / 64 * 64; }
+        long childOffset_p(int room) const{ return (HEADER + (long)room * _idxLen + sizeof(int) * 2 - 1) / (sizeof(int) * 2) * (sizeof(int) * 2); }
+        int *children_p(char *node) const{ return (int *)(node + childOffset_p(room_p(node))); }
+        /* The smallest class with room for keys */
+        int class_p(int keys) const;
+        /* Takes the block of slot back, if it has one */
+        void detach_p(int slot);
+        void fill_p(char *node, char *page) const;
+        static int room_p(char *node){ return ((int *)node)[0]; }
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "NodeLayout.h"
+#include "BPlusTree.h"
+#include "CompressedNodeLayout.h"
+#include "TypedNodeLayout.h"
+
+#include <string.h>
+
+NodeLayout::NodeLayout(int blkSize, int idxLen, bool packedLeaves) : _idxLen(idxLen), _packedLeaves(packedLeaves){
+    _nonLeafCount = (blkSize - sizeof(int) * 3) / (sizeof(int) + _idxLen);
+    _leafCount = (blkSize - sizeof(int) * 3) / (_idxLen + sizeof(int) * 2);
+}
+
+/* Layout for one of the BPlusTree::IDX_TYPE_* index types, 0 for an unknown type. Compressed leaves keep every value with its position anyway, IDX_DUPLICATES and IDX_CHECKSUMS are left to the tree */
+NodeLayout *NodeLayout::create(int blkSize, int idxType, int idxLen){
+    bool packed = (idxType & BPlusTree::IDX_PACKED_LEAVES) != 0;
+    switch (idxType & ~(BPlusTree::IDX_PACKED_LEAVES | BPlusTree::IDX_DUPLICATES | BPlusTree::IDX_CHECKSUMS)){
+        case BPlusTree::IDX_TYPE_INT :
+            return new TypedNodeLayout <Int32Key>(blkSize, Int32Key(), packed);
+        case BPlusTree::IDX_TYPE_STRING :
+            return new TypedNodeLayout <StringKey>(blkSize, StringKey(idxLen), packed);
+        case BPlusTree::IDX_TYPE_INT64 :
+            return new TypedNodeLayout <Int64Key>(blkSize, Int64Key(), packed);
+        case BPlusTree::IDX_TYPE_UINT64 :
+            return new TypedNodeLayout <UInt64Key>(blkSize, UInt64Key(), packed);
+        case BPlusTree::IDX_TYPE_BYTES :
+            return new TypedNodeLayout <BytesKey>(blkSize, BytesKey(idxLen), packed);
+        case BPlusTree::IDX_TYPE_COMPRESSED_STRING :
+            return new CompressedNodeLayout(blkSize, idxLen);
+    }
+    return 0;
+}
+
+int NodeLayout::keyLength() const{
+    return _idxLen;
+}
+
+int NodeLayout::leafCapacity() const{
+    return _leafCount;
+}
+
+int NodeLayout::nonLeafCapacity() const{
+    return _nonLeafCount;
+}
+
+int NodeLayout::minCapacity() const{
+    return _leafCount < _nonLeafCount ? _leafCount : _nonLeafCount;
+}
+
+int NodeLayout::child(char *page, int i) const{
+    return children(page)[i];
+}
+
+double NodeLayout::fill(char *page) const{
+    return (double)size(page) / (type(page) == TYPE_LEAF ? _leafCount : _nonLeafCount);
+}
+
+void NodeLayout::init(char *page, int t) const{
+    type(page) = t;
+    if (t == TYPE_EMPTY) emptyNext(page) = 0;
+    else if (t == TYPE_LEAF){
+        size(page) = 0;
+        next(page) = 0;
+    }  else size(page) = 0;
+}
+
+int NodeLayout::posPage(char *page, int i) const{
+    return posPages(page)[_packedLeaves ? i * 2 : i];
+}
+
+int NodeLayout::posSlot(char *page, int i) const{
+    return posSlots(page)[_packedLeaves ? i * 2 : i];
+}
+
+void NodeLayout::readKey(char *page, int i, char *key) const{
+    memcpy(key, values(page) + i * _idxLen, _idxLen);
+}
+
+void NodeLayout::setChild(char *page, int i, int c) const{
+    children(page)[i] = c;
+}
+
+void NodeLayout::setPosition(char *page, int i, int pp, int ps) const{
+    posPages(page)[_packedLeaves ? i * 2 : i] = pp;
+    posSlots(page)[_packedLeaves ? i * 2 : i] = ps;
+}
+
+bool NodeLayout::underflow(char *page, int, double minFill) const{
+    return size(page) - 1 < (type(page) == TYPE_LEAF ? _leafCount : _nonLeafCount) * minFill;
+}
+
+/* Returns the number of values not after data in the index, equals tells whether the last of them is data */
+int NodeLayout::search(char *page, const void *data, int *equals) const{
+    return search(page, size(page), data, equals);
+}
+
+int NodeLayout::searchKeys(const char *keys, int n, const void *data) const{
+    int l = 0, r = n;
+    while (l < r){
+        int mid = (l + r) >> 1;
+        if (compare(keys + (long)mid * _idxLen, data) <= 0) l = mid + 1;
+        else r = mid;
+    }
+    return l;
+}
+
+void NodeLayout::separator(const char *, const char *right, char *sep) const{
+    memcpy(sep, right, _idxLen);
+}
+
+bool NodeLayout::insertLeaf(char *page, int loc, const void *data, int pp, int ps) const{
+    int n = size(page);
+    if (n == _leafCount) return false;
+    char *arr = leafValues(page);
+    size(page) ++;
+    memmove(arr + (loc + 1) * _idxLen, arr + loc * _idxLen, (n - loc) * _idxLen);
+    memcpy(arr + loc * _idxLen, data, _idxLen);
+    moveRids_p(page, loc + 1, page, loc, n - loc);
+    posPages(page)[_packedLeaves ? loc * 2 : loc] = pp;
+    posSlots(page)[_packedLeaves ? loc * 2 : loc] = ps;
+    return true;
+}
+
+void NodeLayout::removeLeaf(char *page, int loc) const{
+    int n = size(page) --;
+    moveRids_p(page, loc, page, loc + 1, n - loc - 1);
+    memmove(leafValues(page) + _idxLen * loc, leafValues(page) + _idxLen * (loc + 1), (n - loc - 1) * _idxLen);
+}
+
+/* Moves the upper half of the full leaf page into the empty leaf newPage, inserts the value into its half and copies the smallest value of newPage into sep */
+void NodeLayout::splitLeaf(char *page, char *newPage, int loc, const void *data, int pp, int ps, char *sep) const{
+    int lSize = (size(page) + 1) / 2;
+    if (loc < lSize){
+        splitLeafAt_p(page, newPage, lSize - 1);
+        insertLeaf(page, loc, data, pp, ps);
+    }  else {
+        splitLeafAt_p(page, newPage, lSize);
+        insertLeaf(newPage, loc - lSize, data, pp, ps);
+    }
+    readKey(newPage, 0, sep);
+}
+
+bool NodeLayout::mergeLeaf(char *page, char *nextPage) const{
+    int lSize = size(page), rSize = size(nextPage);
+    if (lSize + rSize > _leafCount) return false;
+    next(page) = next(nextPage);
+    moveRids_p(page, lSize, nextPage, 0, rSize);
+    memcpy(leafValues(page) + _idxLen * lSize, leafValues(nextPage), _idxLen * rSize);
+    size(page) = lSize + rSize;
+    return true;
+}
+
+/* Inserts data as value loc and child as child loc + 1 */
+bool NodeLayout::insertNonLeaf(char *page, int loc, const void *data, int c) const{
+    int n = size(page);
+    if (n == _nonLeafCount) return false;
+    char *arr = nonLeafValues(page);
+    size(page) ++;
+    memmove(arr + (loc + 1) * _idxLen, arr + loc * _idxLen, (n - loc) * _idxLen);
+    memcpy(arr + loc * _idxLen, data, _idxLen);
+    memmove(children(page) + loc + 2, children(page) + loc + 1, (n - loc) * sizeof(int));
+    children(page)[loc + 1] = c;
+    return true;
+}
+
+/* Remove the child and the value BEFORE it */
+void NodeLayout::removeNonLeaf(char *page, int loc) const{
+    int n = size(page) --;
+    memmove(children(page) + loc, children(page) + loc + 1, (n - loc) * sizeof(int));
+    memmove(nonLeafValues(page) + _idxLen * (loc - 1), nonLeafValues(page) + _idxLen * loc, (n - loc) * _idxLen);
+}
+
+/* Same as splitLeaf for the full non-leaf page, the value between the two halves moves up into sep */
+void NodeLayout::splitNonLeaf(char *page, char *newPage, int loc, const void *data, int c, char *sep) const{
+    int lSize = (size(page) + 1) / 2;
+    if (loc < lSize){
+        splitNonLeafAt_p(page, newPage, lSize - 1, sep);
+        insertNonLeaf(page, loc, data, c);
+    }  else if (loc > lSize){
+        splitNonLeafAt_p(page, newPage, lSize, sep);
+        insertNonLeaf(newPage, loc - lSize - 1, data, c);
+    }  else {
+        /* The new child becomes the first child of newPage, data is pushed up */
+        splitNonLeafAt_p(page, newPage, lSize, sep);
+        insertNonLeaf(newPage, 0, sep, children(newPage)[0]);
+        children(newPage)[0] = c;
+        memcpy(sep, data, _idxLen);
+    }
+}
+
+/* sep is the parent value separating page from nextPage */
+bool NodeLayout::mergeNonLeaf(char *page, char *nextPage, const void *sep) const{
+    int lSize = size(page), rSize = size(nextPage);
+    if (lSize + rSize + 1 > _nonLeafCount) return false;
+    memcpy(children(page) + lSize + 1, children(nextPage), sizeof(int) * (rSize + 1));
+    memcpy(nonLeafValues(page) + _idxLen * (lSize + 1), nonLeafValues(nextPage), _idxLen * rSize);
+    memcpy(nonLeafValues(page) + _idxLen * lSize, sep, _idxLen);
+    size(page) = lSize + rSize + 1;
+    return true;
+}
+
+char *NodeLayout::values(char *page) const{
+    if (type(page) == TYPE_LEAF) return leafValues(page);
+    return nonLeafValues(page);
+}
+
+/* Moves the positions of count leaf values, the pages may be the same */
+void NodeLayout::moveRids_p(char *to, int toLoc, char *from, int fromLoc, int count) const{
+    if (_packedLeaves){
+        memmove(posPages(to) + toLoc * 2, posPages(from) + fromLoc * 2, sizeof(int) * 2 * count);
+        return;
+    }
+    memmove(posPages(to) + toLoc, posPages(from) + fromLoc, sizeof(int) * count);
+    memmove(posSlots(to) + toLoc, posSlots(from) + fromLoc, sizeof(int) * count);
+}
+
+/* Moves the values from position at onwards into the empty leaf newPage */
+void NodeLayout::splitLeafAt_p(char *page, char *newPage, int at) const{
+    int rSize = size(page) - at;
+    moveRids_p(newPage, 0, page, at, rSize);
+    memcpy(leafValues(newPage), leafValues(page) + _idxLen * at, _idxLen * rSize);
+    size(page) = at;
+    size(newPage) = rSize;
+}
+
+/* Keeps children [0, at] and values [0, at), copies value at into sep and moves the rest into the empty node newPage */
+void NodeLayout::splitNonLeafAt_p(char *page, char *newPage, int at, char *sep) const{
+    int rSize = size(page) - at - 1;
+    memcpy(children(newPage), children(page) + at + 1, sizeof(int) * (rSize + 1));
+    memcpy(sep, nonLeafValues(page) + _idxLen * at, _idxLen);
+    memcpy(nonLeafValues(newPage), nonLeafValues(page) + _idxLen * (at + 1), _idxLen * rSize);
+    size(page) = at;
+    size(newPage) = rSize;
+}
@@ -0,0 +1,115 @@
+#ifndef NODE_LAYOUT_H
+#define NODE_LAYOUT_H
+
+/*
+ * Interprets a cached page as a tree node in place.
+ *
+ * Every node starts with its type and size, leaves then with the position of
+ * the next leaf and empty pages with the next empty page. Here, keys take
+ * _idxLen bytes each and leaf pages are laid out as
+ *     type | size | next | posPage[N] | posSlot[N] | value[N]
+ * non-leaf pages as
+ *     type | size | child[M + 1] | value[M]
+ * and empty pages as
+ *     type | next
+ * where N and M are the leaf and non-leaf capacities. With packed leaves the
+ * position of every value is kept as one record next to the other, so that
+ * reading one takes a single cache line and shifting them a single memmove:
+ *     type | size | next | (posPage, posSlot)[N] | value[N]
+ * Subclasses may store the entries of a node differently, see
+ * CompressedNodeLayout.
+ *
+ * Keys are opaque here: ordering them is left to a TypedNodeLayout for the
+ * key type, which create() picks for the runtime index types of BPlusTree.
+ * Keys go in and out as buffers of keyLength() bytes.
+ *
+ * Whether a node has room for a value is the layout's call: the insert and
+ * merge functions return false, leaving the pages as they were, when the
+ * result would not fit, and the split functions insert a value into a full
+ * node by moving part of it into an empty one.
+ */
+class NodeLayout{
+    public:
+        NodeLayout(int blkSize, int idxLen, bool packedLeaves = false);
+        virtual ~NodeLayout(){}
+
+        /* idxType may have BPlusTree::IDX_PACKED_LEAVES set */
+        static NodeLayout *create(int blkSize, int idxType, int idxLen);
+
+        int keyLength() const;
+        /* Most values a node may ever hold */
+        int leafCapacity() const;
+        int nonLeafCapacity() const;
+        /* Fewest values a node holds when it is full, whatever the keys */
+        virtual int minCapacity() const;
+
+        static int &type(char *page){ return ((int *)page)[0]; }
+        static int &size(char *page){ return ((int *)page)[1]; }
+        static int &next(char *page){ return ((int *)page)[2]; }
+        static int &emptyNext(char *page){ return ((int *)page)[1]; }
+
+        virtual int child(char *page, int i) const;
+        /* Share of the room for values of the node in use, from 0 to 1 */
+        virtual double fill(char *page) const;
+        virtual void init(char *page, int type) const;
+        virtual int posPage(char *page, int i) const;
+        virtual int posSlot(char *page, int i) const;
+        virtual void readKey(char *page, int i, char *key) const;
+        virtual void setChild(char *page, int i, int child) const;
+        virtual void setPosition(char *page, int i, int posPage, int posSlot) const;
+        /* True if the node would be filled less than minFill without value loc */
+        virtual bool underflow(char *page, int loc, double minFill) const;
+
+        /* Negative if a comes before b in the index */
+        virtual int compare(const void *a, const void *b) const = 0;
+        /* Copies a key given by the caller into a page or key buffer */
+        virtual void copyKey(char *to, const void *from) const = 0;
+        virtual void printKey(const char *key) const = 0;
+        int search(char *page, const void *data, int *equals = 0) const;
+        virtual int search(char *page, int n, const void *data, int *equals = 0) const = 0;
+        /* Upper bound over n keys of keyLength() bytes one after the other, as search() is over the values of a node */
+        virtual int searchKeys(const char *keys, int n, const void *data) const;
+        /* A key after left and not after right, to separate two nodes in their parent */
+        virtual void separator(const char *left, const char *right, char *sep) const;
+
+        virtual bool insertLeaf(char *page, int loc, const void *data, int posPage, int posSlot) const;
+        virtual void removeLeaf(char *page, int loc) const;
+        virtual void splitLeaf(char *page, char *newPage, int loc, const void *data, int posPage, int posSlot, char *sep) const;
+        virtual bool mergeLeaf(char *page, char *nextPage) const;
+
+        virtual bool insertNonLeaf(char *page, int loc, const void *data, int child) const;
+        virtual void removeNonLeaf(char *page, int loc) const;
+        virtual void splitNonLeaf(char *page, char *newPage, int loc, const void *data, int child, char *sep) const;
+        virtual bool mergeNonLeaf(char *page, char *nextPage, const void *sep) const;
+
+        static const int TYPE_EMPTY = 0;
+        static const int TYPE_LEAF = 1;
+        static const int TYPE_NONLEAF = 2;
+        /* A page of the tree's free-space map, not a node */
+        static const int TYPE_FREE_MAP = 3;
+        /* A page of the posting list of a key, see PostingList */
+        static const int TYPE_POSTING = 4;
+        /* A page of the short posting lists of several keys, see PostingList */
+        static const int TYPE_SHORT_POSTINGS = 5;
+
+    protected:
+        /* Every other int of posPages and posSlots belongs to the next value with packed leaves */
+        int *posPages(char *page) const{ return (int *)(page + sizeof(int) * 3); }
+        int *posSlots(char *page) const{ return (int *)(page + sizeof(int) * (3 + (_packedLeaves ? 1 : _leafCount))); }
+        char *leafValues(char *page) const{ return page + sizeof(int) * (3 + _leafCount * 2); }
+        int *children(char *page) const{ return (int *)(page + sizeof(int) * 2); }
+        char *nonLeafValues(char *page) const{ return page + sizeof(int) * (3 + _nonLeafCount); }
+        char *values(char *page) const;
+
+        int _idxLen;
+        int _leafCount;
+        int _nonLeafCount;
+        bool _packedLeaves;
+
+    private:
+        void moveRids_p(char *to, int toLoc, char *from, int fromLoc, int count) const;
+        void splitLeafAt_p(char *page, char *newPage, int at) const;
+        void splitNonLeafAt_p(char *page, char *newPage, int at, char *sep) const;
+};
+
+#endif
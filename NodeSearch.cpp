@@ -0,0 +1,198 @@
+#include "NodeSearch.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NODE_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+/* Binary search narrows the keys down to this many before a vector scan takes over */
+static const int SEARCH_WINDOW = 32;
+
+template <class T>
+static inline T loadKey(const char *arr, int i){
+    T x;
+    memcpy(&x, arr + i * sizeof(T), sizeof(T));
+    return x;
+}
+
+template <class T>
+static inline void narrow(const char *arr, T x, int *l, int *r){
+    while (*r - *l > SEARCH_WINDOW){
+        int mid = (*l + *r) >> 1;
+        if (loadKey <T>(arr, mid) <= x) *l = mid + 1;
+        else *r = mid;
+    }
+}
+
+/* First of keys i to r - 1 greater than x, r if none */
+template <class T>
+static inline int firstGreater(const char *arr, int i, int r, T x){
+    for (; i < r; i ++)
+        if (loadKey <T>(arr, i) > x) return i;
+    return r;
+}
+
+template <class T>
+static int upperBoundScalar(const char *arr, int n, T x){
+    int l = 0, r = n;
+    while (l < r){
+        int mid = (l + r) >> 1;
+        if (loadKey <T>(arr, mid) <= x) l = mid + 1;
+        else r = mid;
+    }
+    return l;
+}
+
+#ifdef NODE_SEARCH_X86
+/*
+ * The vector versions compare a run of keys with x at once and take the
+ * first key greater than x from the movemask. Unsigned keys are compared as
+ * signed ones with their top bit flipped.
+ */
+__attribute__((target("sse4.2")))
+static int upperBound32Sse(const char *arr, int n, int32_t x){
+    int l = 0, r = n;
+    narrow(arr, x, &l, &r);
+    __m128i v = _mm_set1_epi32(x);
+    int i = l;
+    for (; i + 4 <= r; i += 4){
+        __m128i k = _mm_loadu_si128((const __m128i *)(arr + i * sizeof(int32_t)));
+        int gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, v)));
+        if (gt) return i + __builtin_ctz(gt);
+    }
+    return firstGreater(arr, i, r, x);
+}
+
+__attribute__((target("avx2")))
+static int upperBound32Avx2(const char *arr, int n, int32_t x){
+    int l = 0, r = n;
+    narrow(arr, x, &l, &r);
+    __m256i v = _mm256_set1_epi32(x);
+    int i = l;
+    for (; i + 8 <= r; i += 8){
+        __m256i k = _mm256_loadu_si256((const __m256i *)(arr + i * sizeof(int32_t)));
+        int gt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v)));
+        if (gt) return i + __builtin_ctz(gt);
+    }
+    return firstGreater(arr, i, r, x);
+}
+
+template <class T>
+__attribute__((target("sse4.2")))
+static int upperBound64Sse(const char *arr, int n, T x){
+    int l = 0, r = n;
+    narrow(arr, x, &l, &r);
+    __m128i bias = _mm_set1_epi64x((T)-1 < (T)0 ? 0 : (long long)1 << 63);
+    __m128i v = _mm_xor_si128(_mm_set1_epi64x((long long)x), bias);
+    int i = l;
+    for (; i + 2 <= r; i += 2){
+        __m128i k = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(arr + i * sizeof(T))), bias);
+        int gt = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v)));
+        if (gt) return i + __builtin_ctz(gt);
+    }
+    return firstGreater(arr, i, r, x);
+}
+
+template <class T>
+__attribute__((target("avx2")))
+static int upperBound64Avx2(const char *arr, int n, T x){
+    int l = 0, r = n;
+    narrow(arr, x, &l, &r);
+    __m256i bias = _mm256_set1_epi64x((T)-1 < (T)0 ? 0 : (long long)1 << 63);
+    __m256i v = _mm256_xor_si256(_mm256_set1_epi64x((long long)x), bias);
+    int i = l;
+    for (; i + 4 <= r; i += 4){
+        __m256i k = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(arr + i * sizeof(T))), bias);
+        int gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, v)));
+        if (gt) return i + __builtin_ctz(gt);
+    }
+    return firstGreater(arr, i, r, x);
+}
+
+/* 16 bytes at a time: stops at the first byte that differs or ends a */
+__attribute__((target("sse4.2")))
+static int compareStringSse(const char *a, const char *b, int len){
+    int i = 0;
+    for (; i + 16 <= len; i += 16){
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        int stop = (~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff) | _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+        if (stop){
+            int j = i + __builtin_ctz(stop);
+            return (unsigned char)a[j] - (unsigned char)b[j];
+        }
+    }
+    return strncmp(a + i, b + i, len - i);
+}
+#endif
+
+static int compareStringScalar(const char *a, const char *b, int len){
+    return strncmp(a, b, len);
+}
+
+int NodeSearch::compareString(const char *a, const char *b, int len){
+    return kernels_p().compareString(a, b, len);
+}
+
+int NodeSearch::isa(){
+    return kernels_p().isa;
+}
+
+int NodeSearch::setIsa(int isa){
+    if (isa > supported_p()) isa = supported_p();
+    if (isa < ISA_SCALAR) isa = ISA_SCALAR;
+    kernels_p() = select_p(isa);
+    return isa;
+}
+
+int NodeSearch::upperBound(const char *arr, int n, int32_t x){
+    return kernels_p().upperBound32(arr, n, x);
+}
+
+int NodeSearch::upperBound(const char *arr, int n, int64_t x){
+    return kernels_p().upperBound64(arr, n, x);
+}
+
+int NodeSearch::upperBound(const char *arr, int n, uint64_t x){
+    return kernels_p().upperBoundU64(arr, n, x);
+}
+
+NodeSearch::Kernels &NodeSearch::kernels_p(){
+    static Kernels kernels = select_p(supported_p());
+    return kernels;
+}
+
+NodeSearch::Kernels NodeSearch::select_p(int isa){
+    Kernels k;
+    k.isa = isa;
+    k.compareString = compareStringScalar;
+    k.upperBound32 = upperBoundScalar <int32_t>;
+    k.upperBound64 = upperBoundScalar <int64_t>;
+    k.upperBoundU64 = upperBoundScalar <uint64_t>;
+#ifdef NODE_SEARCH_X86
+    if (isa >= ISA_SSE42){
+        k.compareString = compareStringSse;
+        k.upperBound32 = upperBound32Sse;
+        k.upperBound64 = upperBound64Sse <int64_t>;
+        k.upperBoundU64 = upperBound64Sse <uint64_t>;
+    }
+    if (isa >= ISA_AVX2){
+        k.upperBound32 = upperBound32Avx2;
+        k.upperBound64 = upperBound64Avx2 <int64_t>;
+        k.upperBoundU64 = upperBound64Avx2 <uint64_t>;
+    }
+#endif
+    return k;
+}
+
+/* Best ISA_* this CPU runs */
+int NodeSearch::supported_p(){
+#ifdef NODE_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return ISA_SSE42;
+#endif
+    return ISA_SCALAR;
+}
@@ -0,0 +1,45 @@
+#ifndef NODE_SEARCH_H
+#define NODE_SEARCH_H
+
+#include <stdint.h>
+
+/*
+ * Search kernels for the keys of one node. Each kernel comes in a scalar
+ * version and, on x86, in SSE4.2 and AVX2 versions; the best one the CPU
+ * supports is picked the first time a kernel is used.
+ *
+ * upperBound() returns the number of the n keys at arr not greater than x.
+ * The keys need not be aligned. Given keys that are not sorted, as an
+ * optimistic reader may see, the result is still between 0 and n.
+ *
+ * compareString() is strncmp.
+ */
+class NodeSearch{
+    public:
+        static int compareString(const char *a, const char *b, int len);
+        static int isa();
+        /* Kernels no better than isa, before any tree is in use; returns the ISA_* in effect */
+        static int setIsa(int isa);
+        static int upperBound(const char *arr, int n, int32_t x);
+        static int upperBound(const char *arr, int n, int64_t x);
+        static int upperBound(const char *arr, int n, uint64_t x);
+
+        static const int ISA_SCALAR = 0;
+        static const int ISA_SSE42 = 1;
+        static const int ISA_AVX2 = 2;
+
+    private:
+        struct Kernels{
+            int isa;
+            int (*compareString)(const char *a, const char *b, int len);
+            int (*upperBound32)(const char *arr, int n, int32_t x);
+            int (*upperBound64)(const char *arr, int n, int64_t x);
+            int (*upperBoundU64)(const char *arr, int n, uint64_t x);
+        };
+
+        static Kernels &kernels_p();
+        static Kernels select_p(int isa);
+        static int supported_p();
+};
+
+#endif
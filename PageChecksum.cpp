@@ -0,0 +1,101 @@
+#include "PageChecksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PAGE_CHECKSUM_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define PAGE_CHECKSUM_ARM
+#include <arm_acle.h>
+#endif
+
+/* Reflected CRC32C polynomial */
+static const unsigned int POLY = 0x82f63b78;
+
+static unsigned int crc32cTable(unsigned int crc, const unsigned char *data, long length){
+    static unsigned int table[256];
+    static bool ready = false;
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)){
+        /* Threads racing here all fill in the same numbers */
+        for (unsigned int i = 0; i < 256; i ++){
+            unsigned int c = i;
+            for (int k = 0; k < 8; k ++) c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+            __atomic_store_n(&table[i], c, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+    }
+    for (long i = 0; i < length; i ++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef PAGE_CHECKSUM_X86
+__attribute__((target("sse4.2")))
+static unsigned int crc32cSse(unsigned int crc, const unsigned char *data, long length){
+    for (; length > 0 && ((unsigned long)data & 7); length --) crc = _mm_crc32_u8(crc, *data ++);
+#ifdef __x86_64__
+    unsigned long c = crc;
+    for (; length >= 8; length -= 8, data += 8){
+        unsigned long x;
+        memcpy(&x, data, 8);
+        c = _mm_crc32_u64(c, x);
+    }
+    crc = c;
+#endif
+    for (; length >= 4; length -= 4, data += 4){
+        unsigned int x;
+        memcpy(&x, data, 4);
+        crc = _mm_crc32_u32(crc, x);
+    }
+    for (; length > 0; length --) crc = _mm_crc32_u8(crc, *data ++);
+    return crc;
+}
+#endif
+
+#ifdef PAGE_CHECKSUM_ARM
+static unsigned int crc32cArm(unsigned int crc, const unsigned char *data, long length){
+    for (; length >= 8; length -= 8, data += 8){
+        unsigned long x;
+        memcpy(&x, data, 8);
+        crc = __crc32cd(crc, x);
+    }
+    for (; length > 0; length --) crc = __crc32cb(crc, *data ++);
+    return crc;
+}
+#endif
+
+unsigned int PageChecksum::crc32c(unsigned int crc, const void *data, long length){
+    return ~kernel_p()(~crc, (const unsigned char *)data, length);
+}
+
+/* True if the page holds the checksum of its contents at block position */
+bool PageChecksum::check(const char *page, int blkSize, int position){
+    unsigned int sum;
+    memcpy(&sum, page + blkSize - SIZE, SIZE);
+    return sum == compute_p(page, blkSize, position);
+}
+
+bool PageChecksum::hardware(){
+    return kernel_p() != crc32cTable;
+}
+
+/* Writes the checksum of the page, to be written to block position, into its last SIZE bytes */
+void PageChecksum::stamp(char *page, int blkSize, int position){
+    unsigned int sum = compute_p(page, blkSize, position);
+    memcpy(page + blkSize - SIZE, &sum, SIZE);
+}
+
+unsigned int PageChecksum::compute_p(const char *page, int blkSize, int position){
+    return crc32c(crc32c(0, &position, sizeof(int)), page, blkSize - SIZE);
+}
+
+PageChecksum::Kernel PageChecksum::kernel_p(){
+#ifdef PAGE_CHECKSUM_X86
+    static Kernel kernel = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2")) ? crc32cSse : crc32cTable;
+    return kernel;
+#elif defined(PAGE_CHECKSUM_ARM)
+    return crc32cArm;
+#else
+    return crc32cTable;
+#endif
+}
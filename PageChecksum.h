@@ -0,0 +1,28 @@
+#ifndef PAGE_CHECKSUM_H
+#define PAGE_CHECKSUM_H
+
+/*
+ * CRC32C (Castagnoli) of pages, kept in the last SIZE bytes of the page. The
+ * block number goes into the checksum as well, so that a page written to the
+ * wrong block fails it too. crc32c() uses the SSE4.2 crc32 instruction or
+ * the ARMv8 CRC extension where there is one, else a table; like NodeSearch,
+ * the choice is made the first time it is used.
+ */
+class PageChecksum{
+    public:
+        /* Continues crc, 0 to start, over length bytes of data */
+        static unsigned int crc32c(unsigned int crc, const void *data, long length);
+        static bool check(const char *page, int blkSize, int position);
+        static bool hardware();
+        static void stamp(char *page, int blkSize, int position);
+
+        static const int SIZE = sizeof(unsigned int);
+
+    private:
+        typedef unsigned int (*Kernel)(unsigned int crc, const unsigned char *data, long length);
+
+        static unsigned int compute_p(const char *page, int blkSize, int position);
+        static Kernel kernel_p();
+};
+
+#endif
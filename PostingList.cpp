@@ -0,0 +1,115 @@
+#include "PostingList.h"
+#include "NodeLayout.h"
+
+#include <string.h>
+
+PostingList::Position PostingList::first(char *page){
+    unsigned int p, s;
+    get_p(get_p(page + HEADER, &p), &s);
+    return Position(p, s);
+}
+
+int PostingList::freeSlot(char *page, int blkSize){
+    int count = slots(page, blkSize);
+    if (slotsUsed(page) == count) return -1;
+    for (int i = 0; i < count; i ++)
+        if (!*slot_p(page, i)) return i;
+    return -1;
+}
+
+void PostingList::init(char *page){
+    NodeLayout::type(page) = NodeLayout::TYPE_POSTING;
+    size(page) = 0;
+    next(page) = 0;
+    used_p(page) = 0;
+    total(page) = 0;
+}
+
+void PostingList::initShort(char *page, int blkSize, int cls){
+    memset(page, 0, blkSize);
+    NodeLayout::type(page) = NodeLayout::TYPE_SHORT_POSTINGS;
+    slotClass(page) = cls;
+}
+
+void PostingList::read(char *page, std::vector <Position> &to){
+    const char *data = page + HEADER;
+    unsigned int p = 0, s = 0;
+    for (int i = 0; i < size(page); i ++){
+        unsigned int dp, x;
+        data = get_p(get_p(data, &dp), &x);
+        if (i == 0 || dp){
+            p = i ? p + dp : dp;
+            s = x;
+        }  else s += x;
+        to.push_back(Position(p, s));
+    }
+}
+
+void PostingList::readShort(char *page, int slot, std::vector <Position> &to){
+    int *s = slot_p(page, slot);
+    for (int i = 0; i < s[0]; i ++) to.push_back(Position(s[1 + i * 2], s[2 + i * 2]));
+}
+
+int PostingList::shortClass(int count){
+    int cls = 0;
+    while ((SHORT_SIZE << cls) < count) cls ++;
+    return cls;
+}
+
+/* The smallest class always counts, however little room it leaves */
+int PostingList::shortSize(int blkSize){
+    int cls = 0;
+    while (cls + 1 < SHORT_CLASSES && slotBytes_p(cls + 1) <= (blkSize - SHORT_HEADER) / 4) cls ++;
+    return SHORT_SIZE << cls;
+}
+
+int PostingList::slots(char *page, int blkSize){
+    int cls = slotClass(page);
+    return cls >= 0 && cls < SHORT_CLASSES ? (blkSize - SHORT_HEADER) / slotBytes_p(cls) : 0;
+}
+
+bool PostingList::write(char *page, int blkSize, const Position *from, int count){
+    char *data = page + HEADER, *end = page + blkSize;
+    for (int i = 0; i < count && data; i ++){
+        unsigned int p = from[i].first, s = from[i].second;
+        if (i == 0) data = put_p(put_p(data, end, p), end, s);
+        else {
+            unsigned int dp = p - (unsigned int)from[i - 1].first;
+            data = put_p(put_p(data, end, dp), end, dp ? s : s - (unsigned int)from[i - 1].second);
+        }
+    }
+    if (!data) return false;
+    size(page) = count;
+    used_p(page) = data - page - HEADER;
+    return true;
+}
+
+void PostingList::writeShort(char *page, int slot, const Position *from, int count){
+    int *s = slot_p(page, slot);
+    slotsUsed(page) += (count != 0) - (s[0] != 0);
+    s[0] = count;
+    for (int i = 0; i < count; i ++){
+        s[1 + i * 2] = from[i].first;
+        s[2 + i * 2] = from[i].second;
+    }
+}
+
+const char *PostingList::get_p(const char *from, unsigned int *n){
+    *n = 0;
+    for (int shift = 0; ; shift += 7){
+        unsigned char c = *from ++;
+        *n |= (unsigned int)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return from;
+    }
+}
+
+/* 0 once past end, which every following call passes on */
+char *PostingList::put_p(char *to, const char *end, unsigned int n){
+    if (!to) return 0;
+    for (;;){
+        if (to == end) return 0;
+        *to ++ = (n & 0x7f) | (n >= 0x80 ? 0x80 : 0);
+        n >>= 7;
+        if (!n) return to;
+    }
+}
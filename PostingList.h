@@ -0,0 +1,80 @@
+#ifndef POSTING_LIST_H
+#define POSTING_LIST_H
+
+#include <utility>
+#include <vector>
+
+/*
+ * Interprets a cached page as one page of the posting list of a key, the
+ * positions of a key of a non-unique BPlusTree that has more than one. The
+ * pages of a list are chained in order and read
+ *     type | size | next | used | total | data
+ * where size counts the positions of the page, used the bytes of data and
+ * total, on the first page only, the positions of the whole list. data holds
+ * the positions in increasing order, delta encoded: the first one of a page
+ * in full, every other as the difference of posPage to the one before,
+ * followed by the difference of posSlot when posPage is the same and by
+ * posSlot in full otherwise. Numbers take 7 bits a byte, low bits first.
+ *
+ * A key with no more than shortSize() positions does not take a page of its
+ * own: its short list goes into a slot of a page shared with other keys of
+ * about as many positions,
+ *     type | slots in use | class | slot...
+ * where a slot is its count of positions, 0 when free, followed by room for
+ * SHORT_SIZE << class positions in full, in increasing order. A list gets the
+ * smallest class it fits in; the largest class used has slots of no more
+ * than a quarter of the page.
+ */
+class PostingList{
+    public:
+        typedef std::pair <int, int> Position;
+
+        static int &size(char *page){ return ((int *)page)[1]; }
+        static int &next(char *page){ return ((int *)page)[2]; }
+        static int &total(char *page){ return ((int *)page)[4]; }
+
+        static Position first(char *page);
+        static void init(char *page);
+        /* Appends the positions of the page to to */
+        static void read(char *page, std::vector <Position> &to);
+        /* Replaces the positions of the page by count sorted ones, false if they do not fit in blkSize bytes; the page is then to be written again */
+        static bool write(char *page, int blkSize, const Position *from, int count);
+
+        /* Short lists, on a page of shared slots */
+        static int &slotsUsed(char *page){ return ((int *)page)[1]; }
+        static int &slotClass(char *page){ return ((int *)page)[2]; }
+        /* Positions a slot of the page has room for */
+        static int slotCapacity(char *page){ return SHORT_SIZE << slotClass(page); }
+        /* Slots of the page, 0 if its class is not one */
+        static int slots(char *page, int blkSize);
+        /* Positions in the slot, 0 when it is free */
+        static int slotSize(char *page, int slot){ return *slot_p(page, slot); }
+        /* A free slot of the page, -1 if it has none */
+        static int freeSlot(char *page, int blkSize);
+        static void initShort(char *page, int blkSize, int cls);
+        /* Appends the positions of the slot to to */
+        static void readShort(char *page, int slot, std::vector <Position> &to);
+        /* The smallest class with room for count positions */
+        static int shortClass(int count);
+        /* The most positions a short list holds on pages of blkSize bytes */
+        static int shortSize(int blkSize);
+        /* Fills the slot with count sorted positions, slotCapacity() at most; 0 frees it */
+        static void writeShort(char *page, int slot, const Position *from, int count);
+
+        static const int HEADER = sizeof(int) * 5;
+        /* Positions a slot of the smallest class has room for, twice as many in each class up */
+        static const int SHORT_SIZE = 4;
+        static const int SHORT_CLASSES = 5;
+        static const int SHORT_HEADER = sizeof(int) * 3;
+
+    private:
+        static int &used_p(char *page){ return ((int *)page)[3]; }
+
+        static int slotBytes_p(int cls){ return sizeof(int) * (1 + (SHORT_SIZE << cls) * 2); }
+        static int *slot_p(char *page, int slot){ return (int *)(page + SHORT_HEADER + slot * slotBytes_p(slotClass(page))); }
+
+        static const char *get_p(const char *from, unsigned int *n);
+        static char *put_p(char *to, const char *end, unsigned int n);
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "TreeStats.h"
+
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+__thread int TreeStats::_slot = -1;
+int TreeStats::_threads = 0;
+
+TreeStats::TreeStats() : _timing(false){
+    void *p;
+    if (posix_memalign(&p, 64, sizeof(Slot) * SLOTS)) throw std::bad_alloc();
+    _slots = (Slot *)p;
+    memset(_slots, 0, sizeof(Slot) * SLOTS);
+}
+
+TreeStats::~TreeStats(){
+    free(_slots);
+}
+
+void TreeStats::read(long *counters, long *latency) const{
+    memset(counters, 0, sizeof(long) * COUNTERS);
+    memset(latency, 0, sizeof(long) * OPS * LATENCY_BUCKETS);
+    for (int s = 0; s < SLOTS; s ++){
+        for (int i = 0; i < COUNTERS; i ++) counters[i] += __atomic_load_n(&_slots[s].counters[i], __ATOMIC_RELAXED);
+        for (int op = 0; op < OPS; op ++){
+            for (int i = 0; i < LATENCY_BUCKETS; i ++) latency[op * LATENCY_BUCKETS + i] += __atomic_load_n(&_slots[s].latency[op][i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Counts made while it runs may survive it */
+void TreeStats::reset(){
+    long *p = &_slots[0].counters[0];
+    for (long i = 0; i < (long)(sizeof(Slot) / sizeof(long)) * SLOTS; i ++) __atomic_store_n(p + i, 0, __ATOMIC_RELAXED);
+}
+
+void TreeStats::setTiming(bool timing){
+    __atomic_store_n(&_timing, timing, __ATOMIC_RELAXED);
+}
+
+bool TreeStats::timing() const{
+    return __atomic_load_n(&_timing, __ATOMIC_RELAXED);
+}
+
+void TreeStats::finish_p(int op, long start) const{
+    unsigned long ns = now_p() - start;
+    int bucket = 63 - __builtin_clzl(ns | 1);
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    long *c = &_slots[slot_p()].latency[op][bucket];
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
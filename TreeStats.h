@@ -0,0 +1,108 @@
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <time.h>
+
+/*
+ * Event counters and latency histograms of a BPlusTree. Every thread counts
+ * into a slot of its own, in cache lines no other thread writes, with plain
+ * loads and stores: nothing is shared or locked on the hot path, read() adds
+ * the slots up. Past SLOTS threads, threads share slots and a count may then
+ * get lost now and then.
+ *
+ * Latencies are only measured while setTiming() is on, operation ns taking
+ * [2^i, 2^(i + 1)) nanoseconds is counted in latency bucket i.
+ *
+ * Built with -DNO_TREE_STATS, count() and the timing calls compile to nothing
+ * and every counter stays 0.
+ */
+class TreeStats{
+    public:
+        TreeStats();
+        ~TreeStats();
+
+#ifndef NO_TREE_STATS
+        void count(int counter, long n = 1) const{
+            long *c = &_slots[slot_p()].counters[counter];
+            __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+        }
+        /* Nanoseconds to hand to finish(), 0 while timing is off */
+        long start() const{
+            if (__atomic_load_n(&_timing, __ATOMIC_RELAXED)) return now_p();
+            return 0;
+        }
+        void finish(int op, long start) const{
+            if (start) finish_p(op, start);
+        }
+#else
+        void count(int, long = 1) const{
+        }
+        long start() const{
+            return 0;
+        }
+        void finish(int, long) const{
+        }
+#endif
+        /* Sums of every slot, counters holds COUNTERS numbers and latency OPS rows of LATENCY_BUCKETS */
+        void read(long *counters, long *latency) const;
+        void reset();
+        void setTiming(bool timing);
+        bool timing() const;
+
+        /* Pages pinned through the buffer pool, and cached pages read without pinning them */
+        static const int COUNTER_BLOCK_READS = 0;
+        static const int COUNTER_CACHED_READS = 1;
+        /* Pages marked dirty, each one once per change */
+        static const int COUNTER_BLOCK_WRITES = 2;
+        static const int COUNTER_SPLITS = 3;
+        static const int COUNTER_MERGES = 4;
+        /* Values moved between neighbours without merging them */
+        static const int COUNTER_REDISTRIBUTIONS = 5;
+        /* Blocks taken from the free-space map, and blocks appended to the file */
+        static const int COUNTER_ALLOCATIONS = 6;
+        static const int COUNTER_FILE_GROWTHS = 7;
+        static const int COUNTER_FREES = 8;
+        static const int COUNTER_HEADER_WRITES = 9;
+        static const int COUNTER_EXCLUSIVE_SECTIONS = 10;
+        /* Latch-free reads tried again after a conflict, and given up for latch crabbing */
+        static const int COUNTER_OPTIMISTIC_RETRIES = 11;
+        static const int COUNTER_OPTIMISTIC_FALLBACKS = 12;
+        static const int COUNTER_QUERIES = 13;
+        static const int COUNTER_INSERTS = 14;
+        static const int COUNTER_REMOVES = 15;
+        static const int COUNTERS = 16;
+
+        static const int OP_QUERY = 0;
+        static const int OP_INSERT = 1;
+        static const int OP_REMOVE = 2;
+        static const int OPS = 3;
+
+        static const int LATENCY_BUCKETS = 40;
+        static const int SLOTS = 32;
+
+    private:
+        struct Slot{
+            long counters[COUNTERS];
+            long latency[OPS][LATENCY_BUCKETS];
+        } __attribute__((aligned(64)));
+
+        Slot *_slots;
+        bool _timing;
+
+        /* Slot of the calling thread, handed out in turn to threads as they first count */
+        static __thread int _slot;
+        static int _threads;
+
+        void finish_p(int op, long start) const;
+        static long now_p(){
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000L + ts.tv_nsec;
+        }
+        static int slot_p(){
+            if (_slot == -1) _slot = __atomic_fetch_add(&_threads, 1, __ATOMIC_RELAXED) % SLOTS;
+            return _slot;
+        }
+};
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef TYPED_B_PLUS_TREE_H
+#define TYPED_B_PLUS_TREE_H
+
+#include "BPlusTree.h"
+#include "FileManager.h"
+#include "PageChecksum.h"
+#include "TypedNodeLayout.h"
+
+/*
+ * BPlusTree on a key type of IndexKey.h chosen at compile time, for keys the
+ * IDX_TYPE_* constants do not cover such as CompositeKey. Keys are still
+ * passed as pointers to their stored bytes; packedLeaves, checksums and
+ * duplicates stand for IDX_PACKED_LEAVES, IDX_CHECKSUMS and IDX_DUPLICATES.
+ */
+template <class Key>
+class TypedBPlusTree : public BPlusTree{
+    public:
+        TypedBPlusTree(FileManager *fm, const Key &key = Key(), int cacheSize = DEFAULT_CACHE_SIZE, int cachePolicy = BufferPool::POLICY_LRU, WriteAheadLog *log = 0, bool packedLeaves = false, bool checksums = false, bool duplicates = false)
+            : BPlusTree(fm, new TypedNodeLayout <Key>(fm -> isOpen() ? fm -> blockSize() - (checksums ? PageChecksum::SIZE : 0) : 0, key, packedLeaves), cacheSize, cachePolicy, log, checksums, duplicates){}
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef TYPED_NODE_LAYOUT_H
+#define TYPED_NODE_LAYOUT_H
+
+#include "IndexKey.h"
+#include "NodeLayout.h"
+
+/*
+ * NodeLayout for one key type, see IndexKey.h. The tree reaches it through a
+ * single virtual call per node search; the search itself is specialized for
+ * Key at compile time, or handed to a NodeSearch kernel for number keys.
+ */
+template <class Key>
+class TypedNodeLayout : public NodeLayout{
+    public:
+        TypedNodeLayout(int blkSize, const Key &key = Key(), bool packedLeaves = false) : NodeLayout(blkSize, key.length(), packedLeaves), _key(key){}
+
+        using NodeLayout::search;
+
+        int compare(const void *a, const void *b) const{
+            return _key.compare((const char *)a, (const char *)b);
+        }
+
+        void copyKey(char *to, const void *from) const{
+            _key.copy(to, from);
+        }
+
+        void printKey(const char *key) const{
+            _key.print(key);
+        }
+
+        /* Upper bound over the first n values, in index order */
+        int search(char *page, int n, const void *data, int *equals = 0) const{
+            const char *x = (const char *)data;
+            const char *arr = values(page);
+            int l = _key.search(arr, n, x);
+            if (equals) *equals = (l > 0 && _key.compare(arr + (l - 1) * _key.length(), x) == 0);
+            return l;
+        }
+
+        int searchKeys(const char *keys, int n, const void *data) const{
+            return _key.search(keys, n, (const char *)data);
+        }
+
+    private:
+        Key _key;
+};
+
+#endif
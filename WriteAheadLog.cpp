@@ -0,0 +1,313 @@
+#include "WriteAheadLog.h"
+#include "FileManager.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+WriteAheadLogException::WriteAheadLogException(int errNo) : _errNo(errNo){
+}
+
+WriteAheadLogException::WriteAheadLogException(const WriteAheadLogException &e) : _errNo(e._errNo){
+}
+
+int WriteAheadLogException::errNo() const throw(){
+    return _errNo;
+}
+
+const char *WriteAheadLogException::msg() const throw(){
+    switch (_errNo){
+        case ERR_LOG_NOT_OPEN :
+            return "log not open";
+        case ERR_INVALID_LOG_NAME :
+            return "invalid log name";
+        case ERR_INVALID_RECORD :
+            return "log record does not match the file";
+        case ERR_WRITE_FAILED :
+            return "log write or sync failed";
+        default :
+            return "unknown error";
+    }
+}
+
+WriteAheadLog::WriteAheadLog() : _fd(0), _policy(POLICY_SYNC_COMMIT), _bufferLength(0), _fileOffset(0), _lsn(0), _writtenLsn(0), _syncedLsn(0), _syncing(false), _failed(false){
+    pthread_mutex_init(&_lock, 0);
+    pthread_cond_init(&_synced, 0);
+    _buffer = new char[BUFFER_SIZE];
+}
+
+WriteAheadLog::~WriteAheadLog(){
+    /* A destructor cannot report a failed write, callers that need to know call closeLog() first */
+    try {
+        closeLog();
+    }  catch (...){
+    }
+    delete []_buffer;
+    pthread_cond_destroy(&_synced);
+    pthread_mutex_destroy(&_lock);
+}
+
+/* Adds the image of a page to a group that is yet to be committed */
+void WriteAheadLog::addPage(std::vector <char> &group, int position, const char *page, int length) const{
+    record_p(group, RECORD_PAGE, position, page, length);
+}
+
+/* Drops every record, all pages they cover must be on disk already */
+void WriteAheadLog::checkpoint(){
+    if (!_fd) throw WriteAheadLogException(WriteAheadLogException::ERR_LOG_NOT_OPEN);
+    pthread_mutex_lock(&_lock);
+    if (ftruncate(_fd, 0)){
+        pthread_mutex_unlock(&_lock);
+        throw WriteAheadLogException(WriteAheadLogException::ERR_WRITE_FAILED);
+    }
+    _bufferLength = 0;
+    _fileOffset = 0;
+    _writtenLsn = _syncedLsn = _lsn;
+    /* The file is empty now whether or not the sync made it to disk, only a failed sync leaves the log failed */
+    _failed = fsync(_fd) != 0;
+    bool failed = _failed;
+    pthread_mutex_unlock(&_lock);
+    if (failed) throw WriteAheadLogException(WriteAheadLogException::ERR_WRITE_FAILED);
+}
+
+void WriteAheadLog::closeLog(){
+    if (!_fd) return;
+    try {
+        flushTo(_lsn);
+    }  catch (...){
+        close(_fd);
+        _fd = 0;
+        throw;
+    }
+    close(_fd);
+    _fd = 0;
+}
+
+/* Appends the group followed by its commit record in one piece and returns the lsn right after it, see waitCommit */
+long WriteAheadLog::commit(std::vector <char> &group){
+    if (!_fd) throw WriteAheadLogException(WriteAheadLogException::ERR_LOG_NOT_OPEN);
+    record_p(group, RECORD_COMMIT, 0, 0, 0);
+    pthread_mutex_lock(&_lock);
+    /* Sequence numbers are only known now, the checksums do not cover them */
+    for (long offset = 0; offset < (long)group.size(); ){
+        RecordHeader *header = (RecordHeader *)&group[offset];
+        header -> lsn = _lsn + offset;
+        offset += sizeof(RecordHeader) + header -> length;
+    }
+    bool appended = append_p(&group[0], group.size());
+    long ret = _lsn;
+    pthread_mutex_unlock(&_lock);
+    if (!appended) throw WriteAheadLogException(WriteAheadLogException::ERR_WRITE_FAILED);
+    return ret;
+}
+
+/*
+ * Makes the log durable up to lsn, to be called before a page whose image
+ * ends there is written back. One thread syncs at a time; the others wait and
+ * are usually covered by its fsync, which is what groups their commits.
+ */
+void WriteAheadLog::flushTo(long lsn){
+    if (!_fd) throw WriteAheadLogException(WriteAheadLogException::ERR_LOG_NOT_OPEN);
+    bool failed = false;
+    pthread_mutex_lock(&_lock);
+    while (_syncedLsn < lsn){
+        if (_syncing){
+            pthread_cond_wait(&_synced, &_lock);
+            continue;
+        }
+        if (_failed || (_writtenLsn < lsn && !writeBuffer_p())){
+            failed = true;
+            break;
+        }
+        if (_policy == POLICY_SYNC_NONE){
+            _syncedLsn = _writtenLsn;
+            break;
+        }
+        long target = _writtenLsn;
+        _syncing = true;
+        pthread_mutex_unlock(&_lock);
+        int ret;
+        while ((ret = fdatasync(_fd)) && errno == EINTR);
+        pthread_mutex_lock(&_lock);
+        if (ret) _failed = true;
+        else if (target > _syncedLsn) _syncedLsn = target;
+        _syncing = false;
+        pthread_cond_broadcast(&_synced);
+    }
+    pthread_mutex_unlock(&_lock);
+    if (failed) throw WriteAheadLogException(WriteAheadLogException::ERR_WRITE_FAILED);
+}
+
+bool WriteAheadLog::isOpen() const{
+    return (_fd != 0);
+}
+
+/* Logs the on-disk image of a page about to be overwritten by an uncommitted change; flushTo() the returned lsn before overwriting it */
+long WriteAheadLog::logUndo(int position, const char *page, int length){
+    if (!_fd) throw WriteAheadLogException(WriteAheadLogException::ERR_LOG_NOT_OPEN);
+    std::vector <char> record;
+    record_p(record, RECORD_UNDO, position, page, length);
+    pthread_mutex_lock(&_lock);
+    ((RecordHeader *)&record[0]) -> lsn = _lsn;
+    bool appended = append_p(&record[0], record.size());
+    long ret = _lsn;
+    pthread_mutex_unlock(&_lock);
+    if (!appended) throw WriteAheadLogException(WriteAheadLogException::ERR_WRITE_FAILED);
+    return ret;
+}
+
+/* recover() has to run before anything is committed */
+void WriteAheadLog::openLog(const char *fileName, int policy){
+    if (_fd) closeLog();
+    _fd = open(fileName, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (_fd == -1){
+        _fd = 0;
+        throw WriteAheadLogException(WriteAheadLogException::ERR_INVALID_LOG_NAME);
+    }
+    _policy = policy;
+    _bufferLength = 0;
+    _fileOffset = 0;
+    _lsn = _writtenLsn = _syncedLsn = 0;
+    _failed = false;
+}
+
+int WriteAheadLog::policy() const{
+    return _policy;
+}
+
+/*
+ * Brings the file back to the last committed state: undo images logged after
+ * the last commit are restored newest first, then the pages of every
+ * committed group are written in log order. Stops at the first record that is
+ * torn, fails its checksum or breaks the lsn sequence. Returns the number of
+ * pages written; the log is empty afterwards.
+ */
+int WriteAheadLog::recover(FileManager *fm){
+    if (!_fd) throw WriteAheadLogException(WriteAheadLogException::ERR_LOG_NOT_OPEN);
+    long size = lseek(_fd, 0, SEEK_END);
+    std::vector <char> log(size + 1);
+    for (long done = 0; done < size; ){
+        long n = pread(_fd, &log[done], size - done, done);
+        if (n <= 0){
+            size = done;
+            break;
+        }
+        done += n;
+    }
+
+    std::vector <long> redo, pending, undo;
+    long offset = 0, expected = -1;
+    while (offset + (long)sizeof(RecordHeader) <= size){
+        const RecordHeader *header = (const RecordHeader *)&log[offset];
+        if (header -> type != RECORD_PAGE && header -> type != RECORD_UNDO && header -> type != RECORD_COMMIT) break;
+        if (header -> length < 0 || offset + (long)sizeof(RecordHeader) + header -> length > size) break;
+        if (expected != -1 && header -> lsn != expected) break;
+        if (checksum_p(header, &log[offset + sizeof(RecordHeader)]) != header -> checksum) break;
+        if (header -> type != RECORD_COMMIT && header -> length != fm -> blockSize())
+            throw WriteAheadLogException(WriteAheadLogException::ERR_INVALID_RECORD);
+        if (header -> type == RECORD_PAGE) pending.push_back(offset);
+        else if (header -> type == RECORD_UNDO) undo.push_back(offset);
+        else {
+            redo.insert(redo.end(), pending.begin(), pending.end());
+            pending.clear();
+            undo.clear();
+        }
+        expected = header -> lsn + sizeof(RecordHeader) + header -> length;
+        offset += sizeof(RecordHeader) + header -> length;
+    }
+
+    for (int i = (int)undo.size() - 1; i >= 0; i --){
+        const RecordHeader *header = (const RecordHeader *)&log[undo[i]];
+        fm -> writeBlock((long)header -> position * header -> length, &log[undo[i] + sizeof(RecordHeader)]);
+    }
+    for (int i = 0; i < (int)redo.size(); i ++){
+        const RecordHeader *header = (const RecordHeader *)&log[redo[i]];
+        fm -> writeBlock((long)header -> position * header -> length, &log[redo[i] + sizeof(RecordHeader)]);
+    }
+    if (undo.size() || redo.size()) fm -> sync();
+    /* Continue the sequence, so that stale records can never pass for new ones */
+    pthread_mutex_lock(&_lock);
+    if (expected > _lsn) _lsn = expected;
+    pthread_mutex_unlock(&_lock);
+    checkpoint();
+    return undo.size() + redo.size();
+}
+
+/*
+ * Brings the file back to the last commit while the log is in use, as
+ * recover() does when it is opened, for an update that was cut short; the
+ * caller drops whatever it cached of the file. Throws ERR_WRITE_FAILED,
+ * changing nothing, if the records still buffered cannot be written first.
+ */
+int WriteAheadLog::rollback(FileManager *fm){
+    if (!_fd) throw WriteAheadLogException(WriteAheadLogException::ERR_LOG_NOT_OPEN);
+    pthread_mutex_lock(&_lock);
+    bool written = writeBuffer_p();
+    pthread_mutex_unlock(&_lock);
+    if (!written) throw WriteAheadLogException(WriteAheadLogException::ERR_WRITE_FAILED);
+    return recover(fm);
+}
+
+/* Returns once the commit that ended at lsn is as durable as the policy asks for */
+void WriteAheadLog::waitCommit(long lsn){
+    if (_policy == POLICY_SYNC_COMMIT) flushTo(lsn);
+}
+
+/* Called with the lock held; false if a write failed, the record is not appended then */
+bool WriteAheadLog::append_p(const char *data, long length){
+    if (_bufferLength + length > BUFFER_SIZE && !writeBuffer_p()) return false;
+    if (length > BUFFER_SIZE){
+        if (!write_p(data, length)) return false;
+        _lsn += length;
+        _writtenLsn = _lsn;
+        return true;
+    }
+    memcpy(_buffer + _bufferLength, data, length);
+    _bufferLength += length;
+    _lsn += length;
+    return true;
+}
+
+/* FNV-1a over the record without its lsn */
+unsigned WriteAheadLog::checksum_p(const RecordHeader *header, const char *page){
+    unsigned h = 2166136261u;
+    int fields[3] = {header -> type, header -> position, header -> length};
+    for (unsigned i = 0; i < sizeof(fields); i ++) h = (h ^ ((const unsigned char *)fields)[i]) * 16777619u;
+    for (int i = 0; i < header -> length; i ++) h = (h ^ (unsigned char)page[i]) * 16777619u;
+    return h;
+}
+
+void WriteAheadLog::record_p(std::vector <char> &group, int type, int position, const char *page, int length) const{
+    RecordHeader header;
+    header.type = type;
+    header.position = position;
+    header.length = length;
+    header.lsn = 0;
+    header.checksum = checksum_p(&header, page);
+    group.insert(group.end(), (const char *)&header, (const char *)&header + sizeof(RecordHeader));
+    if (length) group.insert(group.end(), page, page + length);
+}
+
+/* Writes at the end of the log, resumed after short writes; the end only moves once everything is written, a failed write is overwritten by the next one */
+bool WriteAheadLog::write_p(const char *data, long length){
+    long done = 0;
+    while (done < length){
+        long n = pwrite(_fd, data + done, length - done, _fileOffset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    _fileOffset += length;
+    return true;
+}
+
+/* Called with the lock held; the buffer is kept if it cannot be written */
+bool WriteAheadLog::writeBuffer_p(){
+    if (!write_p(_buffer, _bufferLength)) return false;
+    _bufferLength = 0;
+    _writtenLsn = _lsn;
+    return true;
+}
@@ -0,0 +1,111 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+#include <exception>
+#include <pthread.h>
+#include <vector>
+
+class FileManager;
+
+class WriteAheadLogException : public std::exception{
+    public:
+        WriteAheadLogException(int errNo);
+        WriteAheadLogException(const WriteAheadLogException &e);
+
+        int errNo() const throw();
+        const char *msg() const throw();
+
+        static const int ERR_LOG_NOT_OPEN = 0;
+        static const int ERR_INVALID_LOG_NAME = 1;
+        static const int ERR_INVALID_RECORD = 2;
+        static const int ERR_WRITE_FAILED = 3;
+
+    private:
+        int _errNo;
+};
+
+/*
+ * Redo log of page images. An operation adds the after-image of every page it
+ * modified to a group and commits it; the group is appended as a whole and is
+ * only replayed if its commit record made it to disk. A page changed by an
+ * operation that has not committed yet may still be written back; its
+ * previous on-disk image is logged first and restored on recovery, or by
+ * rollback() if the operation is cut short.
+ *
+ * Every record is
+ *     type | position | length | checksum | lsn | page[length]
+ * where lsn is the log sequence number of the record, the byte offset since
+ * the log was created. Records left over from before a checkpoint fail the
+ * lsn check and end recovery.
+ *
+ * Commits are made durable according to the policy: POLICY_SYNC_COMMIT waits
+ * for fsync before returning, sharing one fsync between all threads that
+ * commit meanwhile; POLICY_SYNC_LAZY only syncs when pages are written back
+ * or on checkpoint; POLICY_SYNC_NONE never syncs and only survives a crash of
+ * the process.
+ *
+ * A record that cannot be written throws ERR_WRITE_FAILED and stays buffered,
+ * none of the lsns move past it. Once a sync has failed, the kernel may have
+ * dropped records it was given, so flushTo() keeps throwing until the next
+ * checkpoint().
+ */
+class WriteAheadLog{
+    public:
+        WriteAheadLog();
+        ~WriteAheadLog();
+
+        void addPage(std::vector <char> &group, int position, const char *page, int length) const;
+        void checkpoint();
+        void closeLog();
+        long commit(std::vector <char> &group);
+        void flushTo(long lsn);
+        bool isOpen() const;
+        long logUndo(int position, const char *page, int length);
+        void openLog(const char *fileName, int policy = POLICY_SYNC_COMMIT);
+        int policy() const;
+        int recover(FileManager *fm);
+        int rollback(FileManager *fm);
+        void waitCommit(long lsn);
+
+        static const int POLICY_SYNC_COMMIT = 0;
+        static const int POLICY_SYNC_LAZY = 1;
+        static const int POLICY_SYNC_NONE = 2;
+
+        static const int BUFFER_SIZE = 1 << 20;
+
+    private:
+        struct RecordHeader{
+            int type;
+            int position;
+            int length;
+            unsigned checksum;
+            long lsn;
+        };
+
+        static const int RECORD_PAGE = 0x57414c01;
+        static const int RECORD_UNDO = 0x57414c02;
+        static const int RECORD_COMMIT = 0x57414c03;
+
+        pthread_mutex_t _lock;
+        pthread_cond_t _synced;
+        int _fd;
+        int _policy;
+        char *_buffer;
+        int _bufferLength;
+        long _fileOffset;
+        /* End of the appended, the written and the synced records */
+        long _lsn;
+        long _writtenLsn;
+        long _syncedLsn;
+        bool _syncing;
+        /* A sync failed since the last checkpoint */
+        bool _failed;
+
+        bool append_p(const char *data, long length);
+        static unsigned checksum_p(const RecordHeader *header, const char *page);
+        void record_p(std::vector <char> &group, int type, int position, const char *page, int length) const;
+        bool write_p(const char *data, long length);
+        bool writeBuffer_p();
+};
+
+#endif
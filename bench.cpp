@@ -0,0 +1,381 @@
+/*
+ * Workload driver for BPlusTree, run by make bench.
+ *
+ * Every configuration loads a fresh index with the records, then runs the
+ * operations of one workload split over the threads and prints one JSON
+ * line: throughput, latency percentiles, the pages read and written and what
+ * BPlusTree::stats() tells about the cache and the shape of the tree.
+ * Workloads follow YCSB:
+ *     read      100% point lookups                      (YCSB C)
+ *     read95    95% lookups, 5% updates                 (YCSB B)
+ *     mixed50   50% lookups, 50% updates                (YCSB A)
+ *     insert    100% inserts of new keys                (YCSB D without reads)
+ *     scan      95% scans of 1 to 100 keys, 5% inserts  (YCSB E)
+ * An update moves a key to a new position: it is removed and inserted again.
+ * Keys are drawn uniformly or from a scrambled Zipfian distribution, as in
+ * YCSB, and are ints or 16 byte strings.
+ *
+ * Options take comma separated lists, every combination is run:
+ *     -w workloads -d distributions -k key types -b block sizes -t threads
+ * and single values:
+ *     -r records -o operations -c cache size in pages -f index file
+ * and -n to run with the node cache on, see BPlusTree::setNodeCache.
+ */
+
+#include "FileManager.h"
+#include "BPlusTree.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const int WORKLOAD_READ = 0;
+static const int WORKLOAD_READ95 = 1;
+static const int WORKLOAD_MIXED50 = 2;
+static const int WORKLOAD_INSERT = 3;
+static const int WORKLOAD_SCAN = 4;
+static const char *WORKLOADS[] = {"read", "read95", "mixed50", "insert", "scan"};
+
+static const int DIST_UNIFORM = 0;
+static const int DIST_ZIPF = 1;
+static const char *DISTS[] = {"uniform", "zipf"};
+
+static const int KEY_INT = 0;
+static const int KEY_STRING = 1;
+static const char *KEYS[] = {"int", "string"};
+
+static const int STRING_KEY_LEN = 16;
+static const int LOAD_BATCH = 4096;
+static const int MAX_SCAN = 100;
+/* YCSB's default skew */
+static const double ZIPF_THETA = 0.99;
+
+/* FileManager that counts the pages it reads and writes */
+class CountingFileManager : public FileManager{
+    public:
+        CountingFileManager() : _reads(0), _writes(0){}
+
+        void readBlock(long position, char *data){
+            __atomic_fetch_add(&_reads, 1, __ATOMIC_RELAXED);
+            FileManager::readBlock(position, data);
+        }
+
+        /* Writes handed over here go through writeBlock() */
+        void submit(FileRequest *requests, int count){
+            for (int i = 0; i < count; i ++)
+                if (requests[i].type == REQUEST_READ) __atomic_fetch_add(&_reads, 1, __ATOMIC_RELAXED);
+            FileManager::submit(requests, count);
+        }
+
+        long writeBlock(long position, const char *data){
+            __atomic_fetch_add(&_writes, 1, __ATOMIC_RELAXED);
+            return FileManager::writeBlock(position, data);
+        }
+
+        void writeBlocks(const long *positions, const char * const *data, int count){
+            __atomic_fetch_add(&_writes, count, __ATOMIC_RELAXED);
+            FileManager::writeBlocks(positions, data, count);
+        }
+
+        long writeNewBlock(const char *data){
+            __atomic_fetch_add(&_writes, 1, __ATOMIC_RELAXED);
+            return FileManager::writeNewBlock(data);
+        }
+
+        long reads() const{ return __atomic_load_n(&_reads, __ATOMIC_RELAXED); }
+        long writes() const{ return __atomic_load_n(&_writes, __ATOMIC_RELAXED); }
+
+    private:
+        long _reads;
+        long _writes;
+};
+
+/* Zipfian over [0, n) as generated by YCSB, item 0 the most popular before scrambling */
+struct Zipf{
+    long n;
+    double theta, alpha, zetan, eta;
+};
+
+struct Config{
+    int workload;
+    int dist;
+    int keyType;
+    int blockSize;
+    int threads;
+    long records;
+    long ops;
+    int cacheSize;
+    bool nodeCache;
+    const char *fileName;
+};
+
+struct Worker{
+    const Config *config;
+    BPlusTree *tree;
+    const Zipf *zipf;
+    /* Ids of keys inserted so far, shared by all workers */
+    long *nextId;
+    unsigned long seed;
+    long ops;
+    std::vector <long> latencies;
+};
+
+static unsigned long xorshift(unsigned long *s){
+    unsigned long x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static double uniform01(unsigned long *s){
+    return (xorshift(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned long fnv64(unsigned long x){
+    unsigned long h = 0xcbf29ce484222325UL;
+    for (int i = 0; i < 8; i ++){
+        h ^= x & 0xff;
+        h *= 0x100000001b3UL;
+        x >>= 8;
+    }
+    return h;
+}
+
+static void zipfInit(Zipf *z, long n, double theta){
+    z -> n = n;
+    z -> theta = theta;
+    z -> alpha = 1 / (1 - theta);
+    z -> zetan = 0;
+    for (long i = 1; i <= n; i ++) z -> zetan += 1 / pow((double)i, theta);
+    double zeta2 = 1 + 1 / pow(2.0, theta);
+    z -> eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z -> zetan);
+}
+
+static long zipfNext(const Zipf *z, unsigned long *s){
+    double u = uniform01(s), uz = u * z -> zetan;
+    long ret;
+    if (uz < 1) ret = 0;
+    else if (uz < 1 + pow(0.5, z -> theta)) ret = 1;
+    else ret = (long)(z -> n * pow(z -> eta * u - z -> eta + 1, z -> alpha));
+    if (ret >= z -> n) ret = z -> n - 1;
+    /* Popular items are spread over the key space instead of sitting together */
+    return fnv64(ret) % z -> n;
+}
+
+/* Key of record id, keyBuf holds STRING_KEY_LEN bytes */
+static void makeKey(int keyType, long id, char *keyBuf){
+    if (keyType == KEY_INT){
+        int k = (int)id;
+        memcpy(keyBuf, &k, sizeof(int));
+        return;
+    }
+    /* Room for any id, the key keeps its first STRING_KEY_LEN bytes and needs no NUL */
+    char buf[sizeof("user") + 20];
+    int len = snprintf(buf, sizeof(buf), "user%011ld", id);
+    memset(keyBuf, 0, STRING_KEY_LEN);
+    memcpy(keyBuf, buf, len < STRING_KEY_LEN ? len : STRING_KEY_LEN);
+}
+
+static long nowNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/* A key inserted already, Zipfian ones among the records loaded */
+static long pickId(Worker *w){
+    if (w -> config -> dist == DIST_ZIPF) return zipfNext(w -> zipf, &w -> seed);
+    return xorshift(&w -> seed) % __atomic_load_n(w -> nextId, __ATOMIC_RELAXED);
+}
+
+static void *work(void *arg){
+    Worker *w = (Worker *)arg;
+    const Config *c = w -> config;
+    char key[STRING_KEY_LEN], end[STRING_KEY_LEN];
+    w -> latencies.reserve(w -> ops);
+    for (long i = 0; i < w -> ops; i ++){
+        int p = xorshift(&w -> seed) % 100;
+        bool insert = c -> workload == WORKLOAD_INSERT || (c -> workload == WORKLOAD_SCAN && p < 5);
+        bool update = (c -> workload == WORKLOAD_READ95 && p < 5) || (c -> workload == WORKLOAD_MIXED50 && p < 50);
+        long id = insert ? __atomic_fetch_add(w -> nextId, 1, __ATOMIC_RELAXED) : pickId(w);
+        makeKey(c -> keyType, id, key);
+        long start = nowNs();
+        if (insert) w -> tree -> insert(key, (int)id, 0);
+        else if (update){
+            w -> tree -> remove(key);
+            w -> tree -> insert(key, (int)id, (int)i);
+        }  else if (c -> workload == WORKLOAD_SCAN){
+            int len = 1 + xorshift(&w -> seed) % MAX_SCAN;
+            /* String keys are ordered backwards, see IDX_TYPE_STRING */
+            makeKey(c -> keyType, c -> keyType == KEY_INT ? id + len - 1 : id - len + 1, end);
+            int n = 0;
+            for (BPlusTreeIterator it = w -> tree -> scan(key, end); it.valid() && n < len; it.next()) n ++;
+        }  else w -> tree -> query(key);
+        w -> latencies.push_back(nowNs() - start);
+    }
+    return 0;
+}
+
+static double percentile(std::vector <long> &sorted, double p){
+    if (sorted.empty()) return 0;
+    long i = (long)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+static void load(BPlusTree *tree, const Config *c){
+    std::vector <char> keys(LOAD_BATCH * STRING_KEY_LEN);
+    std::vector <int> posPage(LOAD_BATCH), posSlot(LOAD_BATCH, 0);
+    int keyLen = c -> keyType == KEY_INT ? sizeof(int) : STRING_KEY_LEN;
+    char key[STRING_KEY_LEN];
+    for (long from = 0; from < c -> records; from += LOAD_BATCH){
+        int n = c -> records - from < LOAD_BATCH ? c -> records - from : LOAD_BATCH;
+        for (int i = 0; i < n; i ++){
+            makeKey(c -> keyType, from + i, key);
+            memcpy(&keys[i * keyLen], key, keyLen);
+            posPage[i] = from + i;
+        }
+        tree -> insertBatch(&keys[0], &posPage[0], &posSlot[0], n);
+    }
+    tree -> flush();
+}
+
+static void run(const Config *c, const Zipf *zipf){
+    unlink(c -> fileName);
+    CountingFileManager *fm = new CountingFileManager();
+    fm -> createFile(c -> fileName, c -> blockSize);
+    int type = c -> keyType == KEY_INT ? BPlusTree::IDX_TYPE_INT : BPlusTree::IDX_TYPE_STRING;
+    BPlusTree *tree = new BPlusTree(fm, type, c -> keyType == KEY_INT ? sizeof(int) : STRING_KEY_LEN, c -> cacheSize);
+    load(tree, c);
+    if (c -> nodeCache) tree -> setNodeCache(true);
+
+    long nextId = c -> records;
+    long reads = fm -> reads(), writes = fm -> writes();
+    tree -> resetStats();
+    std::vector <Worker> workers(c -> threads);
+    std::vector <pthread_t> threads(c -> threads);
+    for (int i = 0; i < c -> threads; i ++){
+        workers[i].config = c;
+        workers[i].tree = tree;
+        workers[i].zipf = zipf;
+        workers[i].nextId = &nextId;
+        workers[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+        workers[i].ops = c -> ops / c -> threads + (i < c -> ops % c -> threads);
+    }
+    long start = nowNs();
+    for (int i = 0; i < c -> threads; i ++) pthread_create(&threads[i], 0, work, &workers[i]);
+    for (int i = 0; i < c -> threads; i ++) pthread_join(threads[i], 0);
+    tree -> flush();
+    double seconds = (nowNs() - start) / 1e9;
+    reads = fm -> reads() - reads;
+    writes = fm -> writes() - writes;
+    BPlusTreeStats stats = tree -> stats(true);
+
+    std::vector <long> all;
+    for (int i = 0; i < c -> threads; i ++) all.insert(all.end(), workers[i].latencies.begin(), workers[i].latencies.end());
+    std::sort(all.begin(), all.end());
+    printf("{\"workload\":\"%s\",\"dist\":\"%s\",\"key\":\"%s\",\"block\":%d,\"threads\":%d,\"records\":%ld,\"ops\":%ld,"
+           "\"seconds\":%.3f,\"throughput\":%.0f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,"
+           "\"page_reads\":%ld,\"page_writes\":%ld,\"reads_per_op\":%.3f,\"writes_per_op\":%.3f,"
+           "\"cache_hit_ratio\":%.4f,\"node_cache_bytes\":%ld,\"splits\":%ld,\"merges\":%ld,\"height\":%d,\"fill\":%.3f}\n",
+           WORKLOADS[c -> workload], DISTS[c -> dist], KEYS[c -> keyType], c -> blockSize, c -> threads, c -> records, c -> ops,
+           seconds, c -> ops / seconds, percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999),
+           reads, writes, (double)reads / c -> ops, (double)writes / c -> ops,
+           stats.cacheHitRatio(), stats.nodeCacheBytes, stats.counters[TreeStats::COUNTER_SPLITS], stats.counters[TreeStats::COUNTER_MERGES], stats.height, stats.fill());
+    fflush(stdout);
+    delete tree;
+    delete fm;
+    unlink(c -> fileName);
+}
+
+/* Indices of the comma separated names in list, exits on one not in names */
+static std::vector <int> parseNames(const char *list, const char **names, int count){
+    std::vector <int> ret;
+    std::string s(list);
+    for (size_t from = 0; from <= s.size(); ){
+        size_t to = s.find(',', from);
+        if (to == std::string::npos) to = s.size();
+        std::string name = s.substr(from, to - from);
+        int i = 0;
+        while (i < count && name != names[i]) i ++;
+        if (i == count){
+            fprintf(stderr, "unknown value %s\n", name.c_str());
+            exit(1);
+        }
+        ret.push_back(i);
+        from = to + 1;
+    }
+    return ret;
+}
+
+static std::vector <int> parseInts(const char *list){
+    std::vector <int> ret;
+    for (const char *p = list; *p; ){
+        ret.push_back(atoi(p));
+        while (*p && *p != ',') p ++;
+        if (*p) p ++;
+    }
+    return ret;
+}
+
+int main(int argc, char **argv){
+    const char *workloads = "read,read95,mixed50,insert,scan", *dists = "uniform,zipf", *keys = "int,string";
+    const char *blocks = "4096,8192", *threads = "1,4";
+    Config c;
+    c.records = 200000;
+    c.ops = 200000;
+    c.cacheSize = BPlusTree::DEFAULT_CACHE_SIZE;
+    c.nodeCache = false;
+    c.fileName = "bench.index";
+    int opt;
+    while ((opt = getopt(argc, argv, "w:d:k:b:t:r:o:c:f:n")) != -1){
+        switch (opt){
+            case 'w' : workloads = optarg; break;
+            case 'd' : dists = optarg; break;
+            case 'k' : keys = optarg; break;
+            case 'b' : blocks = optarg; break;
+            case 't' : threads = optarg; break;
+            case 'r' : c.records = atol(optarg); break;
+            case 'o' : c.ops = atol(optarg); break;
+            case 'c' : c.cacheSize = atoi(optarg); break;
+            case 'f' : c.fileName = optarg; break;
+            case 'n' : c.nodeCache = true; break;
+            default :
+                fprintf(stderr, "usage: %s [-w workloads] [-d distributions] [-k key types] [-b block sizes] [-t threads] [-r records] [-o operations] [-c cache pages] [-f index file] [-n]\n", argv[0]);
+                return 1;
+        }
+    }
+    std::vector <int> w = parseNames(workloads, WORKLOADS, 5), d = parseNames(dists, DISTS, 2), k = parseNames(keys, KEYS, 2);
+    std::vector <int> b = parseInts(blocks), t = parseInts(threads);
+    Zipf zipf;
+    zipfInit(&zipf, c.records, ZIPF_THETA);
+    try {
+        for (int ki = 0; ki < (int)k.size(); ki ++)
+            for (int bi = 0; bi < (int)b.size(); bi ++)
+                for (int wi = 0; wi < (int)w.size(); wi ++)
+                    for (int di = 0; di < (int)d.size(); di ++)
+                        for (int ti = 0; ti < (int)t.size(); ti ++){
+                            c.keyType = k[ki];
+                            c.blockSize = b[bi];
+                            c.workload = w[wi];
+                            c.dist = d[di];
+                            c.threads = t[ti] > 0 ? t[ti] : 1;
+                            run(&c, &zipf);
+                        }
+    }  catch (const BPlusTreeException &e){
+        fprintf(stderr, "ERROR: %s\n", e.msg());
+        return 1;
+    }  catch (const FileManagerException &e){
+        fprintf(stderr, "ERROR: %s\n", e.msg());
+        return 1;
+    }
+    return 0;
+}
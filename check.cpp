@@ -0,0 +1,507 @@
+/*
+ * Checks of behaviour the driver in main.cpp does not reach, run by make
+ * check. Every check works on a file of its own, prints what went wrong and
+ * counts as failed; the exit status is the number of failed checks. A check
+ * that hangs, as on a latch left held, is stopped by an alarm.
+ */
+
+#include "FileManager.h"
+#include "MappedFileManager.h"
+#include "BPlusTree.h"
+#include "PostingList.h"
+#include "TypedBPlusTree.h"
+#include "WriteAheadLog.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static const char *FILE_NAME = "check.index";
+static const char *LOG_NAME = "check.log";
+static const int BLOCK_SIZE = 4096;
+static const int CACHE_SIZE = 64;
+/* Seconds a check may take */
+static const int TIME_LIMIT = 60;
+
+static const int BAD_PAGE_KEYS = 20000;
+/* Enough for several runs of leaves to be written before the unsorted value */
+static const int UNSORTED_KEYS = 100000;
+/* Key i of checkShortLists has i % SHORT_SPREAD + 1 positions */
+static const int SHORT_KEYS = 10000;
+static const int SHORT_SPREAD = PostingList::shortSize(BLOCK_SIZE) + 2;
+static const int MAPPED_EXIT_KEYS = 5000;
+/* Times checkCrashes kills a writer, the first time after CRASH_DELAY microseconds and a little later each time */
+static const int CRASH_ROUNDS = 8;
+static const int CRASH_DELAY = 20000;
+/* A tree of two levels whose non-leaf capacity, with compressed keys, is in the hundreds */
+static const int NODE_CACHE_KEYS = 20000;
+static const int NODE_CACHE_KEY_LEN = 256;
+/* Few enough for every page to stay in the pool until flush() */
+static const int WRITE_FAIL_KEYS = 10000;
+
+static int failures = 0;
+
+static void fail(const char *check, const char *what){
+    printf("FAIL %s: %s\n", check, what);
+    failures ++;
+}
+
+/* Overwrites part of block position in place, behind the tree */
+static void corrupt(int position){
+    FILE *f = fopen(FILE_NAME, "r+b");
+    fseek(f, (long)position * BLOCK_SIZE + 100, SEEK_SET);
+    fputs("corrupt", f);
+    fclose(f);
+}
+
+/* The last block of the file holding a leaf */
+static int lastLeaf(FileManager &fm){
+    char page[BLOCK_SIZE];
+    int position = fm.fileSize() / BLOCK_SIZE;
+    do fm.readBlock((long)-- position * BLOCK_SIZE, page);
+    while (NodeLayout::type(page) != NodeLayout::TYPE_LEAF);
+    return position;
+}
+
+/* Updates keys outside the corrupt leaf of checkBadPage */
+static void *badPageWrites(void *p){
+    const char *name = "bad page";
+    BPlusTree *tree = (BPlusTree *)p;
+    try {
+        tree -> setMinFill(0.4);
+        for (int i = 0; i < BAD_PAGE_KEYS / 2; i ++){
+            if (!tree -> remove(&i)) fail(name, "remove lost a key");
+        }
+        for (int i = 0; i < BAD_PAGE_KEYS / 2; i ++){
+            if (!tree -> insert(&i, i, 1)) fail(name, "insert found a removed key");
+        }
+        int first = 0;
+        if (tree -> query(&first).second != 1) fail(name, "query missed an insert");
+    }  catch (const std::exception &){
+        fail(name, "writes after the corrupt leaf threw");
+    }
+    return 0;
+}
+
+/* Reading a corrupt leaf throws, and gives back the latches and pins it held: writes go on afterwards */
+static void checkBadPage(){
+    const char *name = "bad page";
+    int type = BPlusTree::IDX_TYPE_INT | BPlusTree::IDX_CHECKSUMS;
+    unlink(FILE_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    BPlusTree *tree = new BPlusTree(&fm, type, sizeof(int), CACHE_SIZE);
+    for (int i = 0; i < BAD_PAGE_KEYS; i ++) tree -> insert(&i, i, 0);
+    delete tree;
+    /* Keys went in in order, the last block appended is the last leaf */
+    corrupt(fm.fileSize() / BLOCK_SIZE - 1);
+
+    tree = new BPlusTree(&fm, type, sizeof(int), CACHE_SIZE);
+    int last = BAD_PAGE_KEYS - 1, thrown = 0;
+    /* More than the pool has frames, a pin left behind each time would use them all up */
+    for (int i = 0; i < CACHE_SIZE * 4; i ++){
+        try {
+            if (i % 2) tree -> removeBatch(&last, 1);
+            else tree -> query(&last);
+        }  catch (const BufferPoolException &e){
+            if (e.errNo() == BufferPoolException::ERR_BAD_PAGE) thrown ++;
+        }
+    }
+    if (thrown != CACHE_SIZE * 4) fail(name, "reading the corrupt leaf did not throw ERR_BAD_PAGE");
+    /* Another thread, a tree latch left held would block it rather than fail the calling thread's relock */
+    pthread_t writer;
+    pthread_create(&writer, 0, badPageWrites, tree);
+    pthread_join(writer, 0);
+    std::vector <BPlusTreeProblem> problems;
+    if (!tree -> verify(&problems) || problems[0].kind != BPlusTreeProblem::BAD_PAGE) fail(name, "verify did not report the corrupt leaf");
+    delete tree;
+}
+
+/* Whether problems holds no more than the corrupt page */
+static bool onlyBadPage(std::vector <BPlusTreeProblem> &problems){
+    for (int i = 0; i < (int)problems.size(); i ++){
+        if (problems[i].kind != BPlusTreeProblem::BAD_PAGE) return false;
+    }
+    return !problems.empty();
+}
+
+/* A compaction cut short by a corrupt leaf is rolled back, leaving no block taken behind, then or after reopening */
+static void checkAbortedCompact(){
+    const char *name = "aborted compact";
+    int type = BPlusTree::IDX_TYPE_INT | BPlusTree::IDX_CHECKSUMS;
+    unlink(FILE_NAME);
+    unlink(LOG_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    WriteAheadLog log;
+    log.openLog(LOG_NAME);
+    BPlusTree *tree = new BPlusTree(&fm, type, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+    for (int i = 0; i < BAD_PAGE_KEYS; i ++) tree -> insert(&i, i, 0);
+    /* Frees the leaves at the front, compact() then moves the ones behind them, the corrupt last one among them */
+    for (int i = 0; i < BAD_PAGE_KEYS / 2; i ++) tree -> remove(&i);
+    delete tree;
+    /* The free-space map went in after the leaves */
+    corrupt(lastLeaf(fm));
+
+    tree = new BPlusTree(&fm, type, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+    try {
+        tree -> compact();
+        fail(name, "compacting past the corrupt leaf did not throw");
+    }  catch (const BufferPoolException &e){
+        if (e.errNo() != BufferPoolException::ERR_BAD_PAGE) fail(name, "compact threw another error");
+    }
+    std::vector <BPlusTreeProblem> problems;
+    tree -> verify(&problems);
+    if (!onlyBadPage(problems)) fail(name, "verify found more than the corrupt leaf");
+    int first = BAD_PAGE_KEYS / 2;
+    if (tree -> query(&first).first != first) fail(name, "a key outside the corrupt leaf was lost");
+    delete tree;
+
+    tree = new BPlusTree(&fm, type, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+    problems.clear();
+    tree -> verify(&problems);
+    if (!onlyBadPage(problems)) fail(name, "verify found more than the corrupt leaf after reopening");
+    delete tree;
+    log.closeLog();
+    unlink(LOG_NAME);
+}
+
+/* Keys 0 to count - 1 in order, but for key at, which repeats the one before */
+class CountSource : public BPlusTreeSource{
+    public:
+        CountSource(int count, int at) : _key(0), _count(count), _at(at){}
+
+        bool next(void *data, int *posPage, int *posSlot){
+            if (_key == _count) return false;
+            int key = _key == _at ? _key - 1 : _key;
+            memcpy(data, &key, sizeof(int));
+            *posPage = key;
+            *posSlot = 0;
+            _key ++;
+            return true;
+        }
+
+    private:
+        int _key, _count, _at;
+};
+
+/* Bulk loading unsorted input throws and leaves no block behind, a sorted load then succeeds */
+static void checkUnsortedLoad(){
+    const char *name = "unsorted load";
+    unlink(FILE_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE);
+    tree -> flush();
+    long size = fm.fileSize();
+    CountSource unsorted(UNSORTED_KEYS, UNSORTED_KEYS - 1);
+    try {
+        tree -> bulkLoad(&unsorted);
+        fail(name, "unsorted input did not throw");
+    }  catch (const BPlusTreeException &e){
+        if (e.errNo() != BPlusTreeException::ERR_UNSORTED_INPUT) fail(name, "unsorted input threw another error");
+    }
+    if (fm.fileSize() != size) fail(name, "the leaves written were left in the file");
+    if (tree -> verify()) fail(name, "verify found problems after the unsorted load");
+    CountSource sorted(UNSORTED_KEYS, -1);
+    if (tree -> bulkLoad(&sorted) != UNSORTED_KEYS) fail(name, "the sorted load after it did not take every key");
+    int last = UNSORTED_KEYS - 1;
+    if (tree -> query(&last).first != last) fail(name, "the sorted load lost the last key");
+    if (tree -> verify()) fail(name, "verify found problems after the sorted load");
+    delete tree;
+}
+
+/* Positions of key i of checkShortLists */
+static int shortCount(int i){
+    return i % SHORT_SPREAD + 1;
+}
+
+/* Number of positions queryAll gives for key */
+static int matchCount(BPlusTree *tree, int key){
+    int ret = 0;
+    for (BPlusTreeMatchIterator it = tree -> queryAll(&key); it.valid(); it.next()) ret ++;
+    return ret;
+}
+
+/* Keys with up to a quarter page of positions share pages of short lists, which compact() moves like any page; reserved positions are refused */
+static void checkShortLists(){
+    const char *name = "short lists";
+    unlink(FILE_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT | BPlusTree::IDX_DUPLICATES, sizeof(int), CACHE_SIZE);
+    /* Filler first, removed later so that compact() has pages to move */
+    for (int i = 0; i < SHORT_KEYS; i ++) tree -> insert(&i, i, 0);
+    for (int i = 0; i < SHORT_KEYS; i ++){
+        for (int j = 1; j < shortCount(i); j ++) tree -> insert(&i, i, j);
+    }
+    int shared[PostingList::SHORT_CLASSES] = {0}, pages = 0;
+    for (int i = 0; i < SHORT_KEYS; i ++){
+        if (shortCount(i) > PostingList::shortSize(BLOCK_SIZE)) pages ++;
+        else if (shortCount(i) > 1) shared[PostingList::shortClass(shortCount(i))] ++;
+    }
+    for (int c = 0; c < PostingList::SHORT_CLASSES; c ++){
+        int slots = (BLOCK_SIZE - PostingList::SHORT_HEADER) / (sizeof(int) * (1 + (PostingList::SHORT_SIZE << c) * 2));
+        pages += (shared[c] + slots - 1) / slots;
+    }
+    if (tree -> stats(true).postingPages > pages) fail(name, "short lists took pages of their own");
+
+    int key = 0;
+    try {
+        tree -> insert(&key, BPlusTree::POSTING_LIST, 1);
+        fail(name, "insert took a reserved position");
+    }  catch (const BPlusTreeException &e){
+        if (e.errNo() != BPlusTreeException::ERR_RESERVED_POSITION) fail(name, "insert threw another error");
+    }
+    int keys[] = {0, 1}, posPages[] = {5, BPlusTree::POSTING_SHORT}, posSlots[] = {0, 0};
+    try {
+        tree -> insertBatch(keys, posPages, posSlots, 2);
+        fail(name, "insertBatch took a reserved position");
+    }  catch (const BPlusTreeException &e){
+        if (e.errNo() != BPlusTreeException::ERR_RESERVED_POSITION) fail(name, "insertBatch threw another error");
+    }
+    if (matchCount(tree, 0) != shortCount(0)) fail(name, "insertBatch inserted part of a refused batch");
+
+    /* Lists past the short size shrink back into short lists, the others lose their filler */
+    for (int i = 0; i < SHORT_KEYS; i ++){
+        int left = shortCount(i) > PostingList::shortSize(BLOCK_SIZE) ? 2 : shortCount(i) - 1;
+        for (int j = shortCount(i) - 1; j >= 0 && matchCount(tree, i) > left; j --) tree -> remove(&i, i, j);
+        if (!left) continue;
+        if (tree -> query(&i).first != i) fail(name, "query lost a position");
+    }
+    if (tree -> verify()) fail(name, "verify found problems after the removes");
+    for (int i = 0; i < SHORT_KEYS; i += 2) tree -> remove(&i);
+    tree -> compact();
+    if (tree -> verify()) fail(name, "verify found problems after compact");
+    for (int i = 1; i < SHORT_KEYS; i += 2){
+        int left = shortCount(i) > PostingList::shortSize(BLOCK_SIZE) ? 2 : shortCount(i) - 1;
+        if (matchCount(tree, i) != left){
+            fail(name, "a key lost positions in compact");
+            break;
+        }
+    }
+    delete tree;
+
+    /* The flag reaches a tree made on a layout of its own */
+    unlink(FILE_NAME);
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    TypedBPlusTree <NumberKey <int> > typed(&fm, NumberKey <int>(), CACHE_SIZE, BufferPool::POLICY_LRU, 0, false, false, true);
+    typed.insert(&key, 1, 0);
+    typed.insert(&key, 2, 0);
+    if (matchCount(&typed, key) != 2) fail(name, "TypedBPlusTree did not keep both positions");
+}
+
+/* The node cache of a small tree of long keys takes memory for the keys its nodes hold, not for full nodes of them */
+static void checkNodeCacheSize(){
+    const char *name = "node cache size";
+    unlink(FILE_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_COMPRESSED_STRING, NODE_CACHE_KEY_LEN, CACHE_SIZE);
+    tree -> setNodeCache(true);
+    char key[NODE_CACHE_KEY_LEN];
+    for (int i = 0; i < NODE_CACHE_KEYS; i ++){
+        memset(key, 0, sizeof(key));
+        snprintf(key, sizeof(key), "key%08d", i);
+        tree -> insert(key, i, 0);
+    }
+    BPlusTreeStats stats = tree -> stats(true);
+    /* Every node but the root has a key in its parent, which has room for up to four times as many */
+    long keys = 0;
+    for (int i = 1; i < (int)stats.levelNodes.size(); i ++) keys += stats.levelNodes[i];
+    if (stats.nodeCacheBytes > keys * 4 * (NODE_CACHE_KEY_LEN + sizeof(int) * 2) + BLOCK_SIZE) fail(name, "the node cache took more than its keys");
+    if (tree -> query(key).first != NODE_CACHE_KEYS - 1) fail(name, "query missed the last key");
+    delete tree;
+}
+
+static struct rlimit fileLimit;
+
+/* Writes past bytes fail from now on, rather than kill the process */
+static void limitFiles(long bytes){
+    struct rlimit low;
+    getrlimit(RLIMIT_FSIZE, &fileLimit);
+    low = fileLimit;
+    low.rlim_cur = bytes;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &low);
+}
+
+static void unlimitFiles(){
+    setrlimit(RLIMIT_FSIZE, &fileLimit);
+    signal(SIGXFSZ, SIG_DFL);
+}
+
+/* A write past the file size limit fails, flush() throws and keeps the pages dirty: once the limit is lifted they are all written */
+static void checkWriteFailure(){
+    const char *name = "write failure";
+    unlink(FILE_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE);
+    for (int i = 0; i < WRITE_FAIL_KEYS; i ++) tree -> insert(&i, i, 0);
+    limitFiles(BLOCK_SIZE);
+    try {
+        tree -> flush();
+        fail(name, "flush past the size limit did not throw");
+    }  catch (const FileManagerException &e){
+        if (e.errNo() != FileManagerException::ERR_WRITE_FAILED) fail(name, "flush threw another error");
+    }
+    unlimitFiles();
+    tree -> flush();
+    delete tree;
+    tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE);
+    for (int i = 0; i < WRITE_FAIL_KEYS; i ++){
+        if (tree -> query(&i).first != i){
+            fail(name, "a key written after the failed flush was lost");
+            break;
+        }
+    }
+    if (tree -> verify()) fail(name, "verify found problems after the failed flush");
+    delete tree;
+}
+
+/* A commit the log cannot write is not reported durable, and is written once, whole, when the log can take it */
+static void checkLogWriteFailure(){
+    const char *name = "log write failure";
+    unlink(LOG_NAME);
+    WriteAheadLog log;
+    log.openLog(LOG_NAME);
+    std::vector <char> group;
+    char page[BLOCK_SIZE];
+    memset(page, 1, BLOCK_SIZE);
+    log.addPage(group, 1, page, BLOCK_SIZE);
+    long lsn = log.commit(group);
+    limitFiles(0);
+    try {
+        log.waitCommit(lsn);
+        fail(name, "a commit past the size limit was reported durable");
+    }  catch (const WriteAheadLogException &e){
+        if (e.errNo() != WriteAheadLogException::ERR_WRITE_FAILED) fail(name, "waitCommit threw another error");
+    }
+    unlimitFiles();
+    log.waitCommit(lsn);
+    log.closeLog();
+    FILE *f = fopen(LOG_NAME, "rb");
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) != lsn) fail(name, "the log does not hold the commit exactly once");
+    fclose(f);
+    unlink(LOG_NAME);
+}
+
+/* A mapped file left without closing it holds no more than the blocks written, which the tree all uses */
+static void checkMappedExit(){
+    const char *name = "mapped exit";
+    unlink(FILE_NAME);
+    pid_t child = fork();
+    if (!child){
+        MappedFileManager fm;
+        fm.createFile(FILE_NAME, BLOCK_SIZE);
+        BPlusTree tree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE);
+        for (int i = 0; i < MAPPED_EXIT_KEYS; i ++) tree.insert(&i, i, 0);
+        tree.flush();
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    MappedFileManager fm;
+    fm.openFile(FILE_NAME);
+    if (fm.fileSize() >= MappedFileManager::EXTENT_SIZE) fail(name, "the file kept the rest of its extent");
+    BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE);
+    if (tree -> verify()) fail(name, "verify found problems after reopening");
+    int last = MAPPED_EXIT_KEYS - 1;
+    if (tree -> query(&last).first != last) fail(name, "the last key was lost");
+    delete tree;
+}
+
+/* A logged tree gone before its first commit reached the log opens again as a new one */
+static void checkFirstCommit(){
+    const char *name = "first commit";
+    unlink(FILE_NAME);
+    unlink(LOG_NAME);
+    pid_t child = fork();
+    if (!child){
+        FileManager fm;
+        fm.createFile(FILE_NAME, BLOCK_SIZE);
+        WriteAheadLog log;
+        log.openLog(LOG_NAME, WriteAheadLog::POLICY_SYNC_NONE);
+        new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+        _exit(0);
+    }
+    waitpid(child, 0, 0);
+    FileManager fm;
+    fm.openFile(FILE_NAME);
+    WriteAheadLog log;
+    log.openLog(LOG_NAME, WriteAheadLog::POLICY_SYNC_NONE);
+    BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+    if (tree -> verify()) fail(name, "verify found problems after reopening");
+    int key = 1;
+    tree -> insert(&key, key, 0);
+    if (tree -> query(&key).first != key || tree -> verify()) fail(name, "the tree reopened is not usable");
+    delete tree;
+    log.closeLog();
+    unlink(LOG_NAME);
+}
+
+/* Inserts keys from first on until killed */
+static void crashWriter(int first){
+    FileManager fm;
+    fm.openFile(FILE_NAME);
+    WriteAheadLog log;
+    log.openLog(LOG_NAME, WriteAheadLog::POLICY_SYNC_LAZY);
+    BPlusTree tree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+    for (int i = first; ; i ++) tree.insert(&i, i, 0);
+}
+
+/* A logged tree killed in the middle of its writes comes back without blocks appended by sections that never committed */
+static void checkCrashes(){
+    const char *name = "crashes";
+    unlink(FILE_NAME);
+    unlink(LOG_NAME);
+    FileManager fm;
+    fm.createFile(FILE_NAME, BLOCK_SIZE);
+    fm.closeFile();
+    for (int round = 0; round < CRASH_ROUNDS; round ++){
+        pid_t child = fork();
+        if (!child){
+            crashWriter(round << 20);
+            _exit(0);
+        }
+        usleep(CRASH_DELAY * (round + 1));
+        kill(child, SIGKILL);
+        waitpid(child, 0, 0);
+        fm.openFile(FILE_NAME);
+        WriteAheadLog log;
+        log.openLog(LOG_NAME, WriteAheadLog::POLICY_SYNC_LAZY);
+        BPlusTree *tree = new BPlusTree(&fm, BPlusTree::IDX_TYPE_INT, sizeof(int), CACHE_SIZE, BufferPool::POLICY_LRU, &log);
+        bool clean = !tree -> verify();
+        delete tree;
+        fm.closeFile();
+        if (!clean){
+            fail(name, "verify found problems after a crash");
+            break;
+        }
+    }
+    unlink(LOG_NAME);
+}
+
+int main(void){
+    alarm(TIME_LIMIT);
+    checkBadPage();
+    checkAbortedCompact();
+    checkUnsortedLoad();
+    checkShortLists();
+    checkNodeCacheSize();
+    checkWriteFailure();
+    checkLogWriteFailure();
+    checkMappedExit();
+    checkFirstCommit();
+    checkCrashes();
+    unlink(FILE_NAME);
+    if (!failures) printf("all checks passed\n");
+    return failures;
+}